@@ -5,16 +5,37 @@
 #include <glib/gprintf.h>
 #include "bhcd.h"
 
-extern gboolean merge_global_score;
-extern gboolean dataset_symmetric;
 
 static gboolean binary_only = FALSE;
 static gboolean sparse_greedy = FALSE;
+static gboolean coarsen = FALSE;
+static gboolean split_components = FALSE;
+static guint subsample = 0;
 static gboolean lua_shell = FALSE;
 static gboolean verbose = FALSE;
 static gboolean disable_fit_file = FALSE;
 static gboolean dataset_keep_diag = FALSE;
+static gboolean dataset_symmetric = FALSE;
+static gboolean merge_global_score = FALSE;
 static guint build_restarts = 1;
+static guint score_threads = 1;
+static guint restart_threads = 1;
+static guint max_candidates = 0;
+static gboolean batch_merges = FALSE;
+static gdouble batch_min_score = 0.0;
+static guint ensemble_size = 1;
+static gboolean ensemble_posterior = FALSE;
+static gdouble time_budget = 0.0;
+static gboolean heuristic_prune = FALSE;
+static guint restart_patience = 0;
+static guint max_repeats = 0;
+static gboolean skip_repeats = FALSE;
+static gchar *	checkpoint_fname = NULL;
+static gdouble checkpoint_interval = 600.0;
+static gboolean resume = FALSE;
+static gdouble progress_interval = 0.0;
+static gboolean progress_json = FALSE;
+static gchar *	update_fname = NULL;
 static guint seed = 0x2a23b6bb;
 static gdouble param_gamma = 0.4;
 static gdouble param_alpha = 1.0;
@@ -29,6 +50,7 @@ static gchar *	output_pred_fname = NULL;
 static gchar *	output_fit_fname = NULL;
 static gchar *	output_time_fname = NULL;
 static gchar *	output_hypers_fname = NULL;
+static gchar *	output_data_fname = NULL;
 
 static GOptionEntry options[] = {
 	{ "seed",	 's', 0, G_OPTION_ARG_INT,	&seed,		"set RNG seed to S",		"S" },
@@ -37,7 +59,40 @@ static GOptionEntry options[] = {
 
 	{ "sparse",	 'S', 0, G_OPTION_ARG_NONE,	&sparse_greedy,	"use sparse greedy algorithm",	NULL },
 	{ "binary-only", 'B', 0, G_OPTION_ARG_NONE,	&binary_only, 	"only construct binary trees",	NULL },
+	{ "coarsen",	   0, 0, G_OPTION_ARG_NONE,	&coarsen,	"start from groups of equivalent nodes", NULL },
+	{ "components",	   0, 0, G_OPTION_ARG_NONE,	&split_components,
+									"build each connected component apart (sparse only)", NULL },
+	{ "subsample",	   0, 0, G_OPTION_ARG_INT,	&subsample,	"build on M nodes, then insert the rest", "M" },
 	{ "restarts",	 'R', 0, G_OPTION_ARG_INT,	&build_restarts,"take best of N restarts",	"N" },
+	{ "score-threads", 0, 0, G_OPTION_ARG_INT,	&score_threads,	"score merges with N threads",	"N" },
+	{ "threads",	 'T', 0, G_OPTION_ARG_INT,	&restart_threads,"run N restarts at once",	"N" },
+	{ "max-candidates-per-cluster", 0, 0, G_OPTION_ARG_INT, &max_candidates,
+									"keep only the best K merges of each cluster", "K" },
+	{ "batch-merges",  0, 0, G_OPTION_ARG_NONE,	&batch_merges,	"merge all reciprocal best pairs at once", NULL },
+	{ "batch-min-score", 0, 0, G_OPTION_ARG_DOUBLE,	&batch_min_score,
+									"only batch merges scoring at least S", "S" },
+	{ "time-budget",   0, 0, G_OPTION_ARG_DOUBLE,	&time_budget,
+									"stop merging after S seconds, leaving a flatter tree", "S" },
+	{ "heuristic-prune", 0, 0, G_OPTION_ARG_NONE,	&heuristic_prune,
+									"abandon restarts that look to be heading for a worse tree (a guess, not a bound: may drop the best restart)", NULL },
+	{ "restart-patience", 0, 0, G_OPTION_ARG_INT,	&restart_patience,
+									"stop after K restarts in a row without a better tree", "K" },
+	{ "max-repeats",   0, 0, G_OPTION_ARG_INT,	&max_repeats,
+									"stop after M restarts repeat an earlier one", "M" },
+	{ "skip-repeats",  0, 0, G_OPTION_ARG_NONE,	&skip_repeats,
+									"abandon restarts once they reach an earlier one's forest", NULL },
+	{ "checkpoint",	   0, 0, G_OPTION_ARG_FILENAME,	&checkpoint_fname,
+									"checkpoint the build to this file", NULL },
+	{ "checkpoint-interval", 0, 0, G_OPTION_ARG_DOUBLE, &checkpoint_interval,
+									"checkpoint every S seconds (default 600)", "S" },
+	{ "resume",	   0, 0, G_OPTION_ARG_NONE,	&resume,	"carry on from the checkpoint file", NULL },
+	{ "progress",	   0, 0, G_OPTION_ARG_DOUBLE,	&progress_interval,
+									"report progress every S seconds", "S" },
+	{ "progress-json", 0, 0, G_OPTION_ARG_NONE,	&progress_json,	"report progress as JSON lines", NULL },
+	{ "update",	 'U', 0, G_OPTION_ARG_FILENAME,	&update_fname,	"update the tree saved in TREE: FILE holds only the new nodes and edges", "TREE" },
+	{ "ensemble",	 'E', 0, G_OPTION_ARG_INT,	&ensemble_size,	"predict with the best K restarts",	"K" },
+	{ "ensemble-posterior", 0, 0, G_OPTION_ARG_NONE, &ensemble_posterior,
+									"weight ensemble by posterior, not uniformly", NULL },
 
 	{ "no-fit-file",   0, 0, G_OPTION_ARG_NONE,	&disable_fit_file, "do not generate .fit file",	NULL },
 	{ "test-file",	 't', 0, G_OPTION_ARG_FILENAME,	&test_fname,	"test dataset", NULL },
@@ -59,10 +114,20 @@ static GOptionEntry options[] = {
 	{ NULL,		   0, 0, 0,			NULL,		NULL, NULL },
 };
 
+/* the trees predictions are averaged over, and their log weights */
+typedef struct {
+	GPtrArray * trees;
+	gdouble * logweights;
+} Ensemble;
+
 static gchar * parse_args(int *argc, char ***argv);
-static Tree * run(GRand * rng, Dataset * dataset);
+static Ensemble * run(GRand * rng, Dataset * dataset);
+static Ensemble * update(Dataset * delta, Dataset ** pdataset);
+static Ensemble * ensemble_new(GPtrArray * trees);
+static void ensemble_free(Ensemble * ensemble);
 static void save_pred(Pair * tree_dataset, GIOChannel * io);
 static void timer_save_io(GTimer * timer, GIOChannel * io);
+static void print_progress(const BuildProgress * progress, gpointer unused);
 
 
 static gchar * parse_args(int *argc, char ***argv) {
@@ -84,11 +149,20 @@ static gchar * parse_args(int *argc, char ***argv) {
 		g_print("too many arguments\n");
 		goto error;
 	}
+	if (score_threads < 1 || restart_threads < 1) {
+		g_print("need at least one thread\n");
+		goto error;
+	}
+	if (ensemble_size < 1) {
+		g_print("need at least one tree in the ensemble\n");
+		goto error;
+	}
 	g_option_context_free(ctx);
 	output_tree_fname = g_strdup_printf("%s.tree", output_prefix);
 	output_pred_fname = g_strdup_printf("%s.pred", output_prefix);
 	output_fit_fname  = g_strdup_printf("%s.fit", output_prefix);
 	output_time_fname = g_strdup_printf("%s.time", output_prefix);
+	output_data_fname = g_strdup_printf("%s.gml", output_prefix);
 	return (*argv)[1];
 error:
 	g_print("%s", g_option_context_get_help(ctx, TRUE, NULL));
@@ -96,9 +170,9 @@ error:
 	exit(1);
 }
 
-static Tree * run(GRand * rng, Dataset * dataset) {
+static Ensemble * run(GRand * rng, Dataset * dataset) {
 	Params * params;
-	Tree * root;
+	Ensemble * ensemble;
 	Build * build;
 
 	if (verbose) {
@@ -110,17 +184,135 @@ static Tree * run(GRand * rng, Dataset * dataset) {
 			param_alpha, param_beta,
 			param_delta, param_lambda);
 	params->binary_only = binary_only;
+	params->global_score = merge_global_score;
 
 	build = build_new(rng, params, build_restarts, sparse_greedy);
 	build_set_verbose(build, verbose);
+	build_set_num_threads(build, score_threads);
+	build_set_restart_threads(build, restart_threads);
+	build_set_max_candidates(build, max_candidates);
+	build_set_batch_merges(build, batch_merges, batch_min_score);
+	build_set_coarsen(build, coarsen);
+	build_set_split_components(build, split_components);
+	build_set_subsample(build, subsample);
+	build_set_num_best_trees(build, ensemble_size);
+	build_set_time_budget(build, time_budget);
+	build_set_heuristic_prune(build, heuristic_prune);
+	build_set_adaptive_restarts(build, restart_patience, max_repeats, skip_repeats);
+	if (checkpoint_fname != NULL) {
+		if (resume && g_file_test(checkpoint_fname, G_FILE_TEST_EXISTS)) {
+			build_set_resume(build, checkpoint_fname);
+		}
+		build_set_checkpoint(build, checkpoint_fname, checkpoint_interval);
+	}
+	if (progress_interval > 0.0) {
+		build_set_progress(build, progress_interval, print_progress, NULL);
+	}
 	params_unref(params);
 	build_run(build);
-	root = build_get_best_tree(build);
-	tree_ref(root);
+	if (build_get_incomplete(build)) {
+		g_print("time budget reached: tree is incomplete\n");
+	}
+	if (subsample > 0 && subsample < dataset_num_labels(dataset)) {
+		g_print("built on %u of %u nodes, then inserted the rest\n",
+				subsample, dataset_num_labels(dataset));
+	}
+	if (heuristic_prune) {
+		g_print("abandoned %u of %u restarts, saving about %.1fs\n",
+				build_get_num_pruned(build), build_get_num_run(build),
+				build_get_pruned_saving(build));
+	}
+	if (restart_patience > 0 || max_repeats > 0 || skip_repeats) {
+		g_print("ran %u of %u restarts, %u repeating an earlier one\n",
+				build_get_num_run(build), build_restarts,
+				build_get_num_repeats(build));
+	}
+	ensemble = ensemble_new(build_get_best_trees(build));
 	build_free(build);
 
-	g_assert(tree_num_leaves(root) == dataset_num_labels(dataset));
-	return root;
+	g_assert(tree_num_leaves(g_ptr_array_index(ensemble->trees, 0)) == dataset_num_labels(dataset));
+	return ensemble;
+}
+
+/* the tree in update_fname, with the new nodes of delta inserted one at a
+ * time rather than building afresh. *pdataset is set to its data with
+ * delta added, saved to output_data_fname so the tree saved can be
+ * updated in turn.
+ */
+static Ensemble * update(Dataset * delta, Dataset ** pdataset) {
+	Ensemble * ensemble;
+	GPtrArray * trees;
+	Params * params;
+	Tree * root;
+	DatasetLabelIter iter;
+	gpointer label;
+	guint num_inserted;
+
+	root = tree_io_load(update_fname, delta);
+	params = tree_get_params(root);
+	params->binary_only = binary_only;
+	params->global_score = merge_global_score;
+	num_inserted = 0;
+	dataset_labels_iter_init(delta, &iter);
+	while (dataset_labels_iter_next(&iter, &label)) {
+		Tree * new_root;
+
+		if (labelset_contains(tree_get_labels(root), label)) {
+			continue;
+		}
+		new_root = tree_insert_leaf(root, label);
+		tree_unref(root);
+		root = new_root;
+		num_inserted++;
+	}
+	g_print("inserted %u nodes\n", num_inserted);
+	g_assert(tree_num_leaves(root) == dataset_num_labels(params->dataset));
+	dataset_gml_save(params->dataset, output_data_fname);
+	dataset_set_filename(params->dataset, output_data_fname);
+
+	*pdataset = params->dataset;
+	dataset_ref(*pdataset);
+	trees = g_ptr_array_new();
+	g_ptr_array_add(trees, root);
+	ensemble = ensemble_new(trees);
+	g_ptr_array_free(trees, TRUE);
+	tree_unref(root);
+	return ensemble;
+}
+
+/* weighted uniformly, or by each tree's share of their total posterior. */
+static Ensemble * ensemble_new(GPtrArray * trees) {
+	Ensemble * ensemble;
+	gdouble lognorm;
+
+	ensemble = g_new(Ensemble, 1);
+	ensemble->trees = g_ptr_array_new_with_free_func((GDestroyNotify)tree_unref);
+	ensemble->logweights = g_new(gdouble, trees->len);
+	for (guint mm = 0; mm < trees->len; mm++) {
+		Tree * tree = g_ptr_array_index(trees, mm);
+
+		tree_ref(tree);
+		g_ptr_array_add(ensemble->trees, tree);
+		if (ensemble_posterior) {
+			ensemble->logweights[mm] = tree_get_logprob(tree);
+		} else {
+			ensemble->logweights[mm] = 0.0;
+		}
+	}
+	lognorm = ensemble->logweights[0];
+	for (guint mm = 1; mm < trees->len; mm++) {
+		lognorm = log_add_exp(lognorm, ensemble->logweights[mm]);
+	}
+	for (guint mm = 0; mm < trees->len; mm++) {
+		ensemble->logweights[mm] -= lognorm;
+	}
+	return ensemble;
+}
+
+static void ensemble_free(Ensemble * ensemble) {
+	g_ptr_array_free(ensemble->trees, TRUE);
+	g_free(ensemble->logweights);
+	g_free(ensemble);
 }
 
 static void eval_test(Pair * root_timer, GIOChannel *io) {
@@ -130,7 +322,7 @@ static void eval_test(Pair * root_timer, GIOChannel *io) {
 	if (test_fname == NULL) {
 		return;
 	}
-	test = dataset_gml_load(test_fname);
+	test = dataset_gml_load_full(test_fname, dataset_symmetric);
 	root_timer_test = pair_new(root_timer, test);
 	save_pred(root_timer_test, io);
 	pair_free(root_timer_test);
@@ -139,7 +331,7 @@ static void eval_test(Pair * root_timer, GIOChannel *io) {
 
 static void save_pred(Pair * root_timer_data, GIOChannel * io) {
 	Pair * root_timer = root_timer_data->fst;
-	Tree * const tree = root_timer->fst;
+	Ensemble * const ensemble = root_timer->fst;
 	GTimer * timer = root_timer->snd;
 	Dataset * const dataset = root_timer_data->snd;
 	DatasetPairIter pairs;
@@ -149,9 +341,18 @@ static void save_pred(Pair * root_timer_data, GIOChannel * io) {
 	while (dataset_label_pairs_iter_next(&pairs, &src, &dst)) {
 		gboolean missing;
 		gboolean value = dataset_get(dataset, src, dst, &missing);
-		gdouble logpred_true = tree_logpredict(tree, src, dst, TRUE);
-		gdouble logpred_false = tree_logpredict(tree, src, dst, FALSE);
+		Tree * tree = g_ptr_array_index(ensemble->trees, 0);
+		gdouble logpred_true = ensemble->logweights[0] + tree_logpredict(tree, src, dst, TRUE);
+		gdouble logpred_false = ensemble->logweights[0] + tree_logpredict(tree, src, dst, FALSE);
+
 		g_assert(!missing);
+		for (guint mm = 1; mm < ensemble->trees->len; mm++) {
+			tree = g_ptr_array_index(ensemble->trees, mm);
+			logpred_true = log_add_exp(logpred_true,
+					ensemble->logweights[mm] + tree_logpredict(tree, src, dst, TRUE));
+			logpred_false = log_add_exp(logpred_false,
+					ensemble->logweights[mm] + tree_logpredict(tree, src, dst, FALSE));
+		}
 		io_printf(io, "%e,%s,%s,%s,%1.17e,%1.17e\n",
 				g_timer_elapsed(timer, NULL),
 				dataset_label_to_string(dataset, src),
@@ -162,6 +363,31 @@ static void save_pred(Pair * root_timer_data, GIOChannel * io) {
 	}
 }
 
+static void print_progress(const BuildProgress * progress, gpointer unused) {
+	gdouble hit_rate;
+
+	hit_rate = 0.0;
+	if (progress->sscache_lookups > 0) {
+		hit_rate = (gdouble)progress->sscache_hits/progress->sscache_lookups;
+	}
+	if (progress_json) {
+		g_print("{\"elapsed\": %.3f, \"restart\": %u, \"merges\": %u, \"left\": %u, "
+				"\"heap\": %u, \"sscache_entries\": %u, \"sscache_hit_rate\": %.4f, "
+				"\"lnbeta_hits\": %u, \"merges_per_sec\": %.1f, \"rss\": %" G_GSIZE_FORMAT "}\n",
+				progress->elapsed, progress->restart, progress->num_merges,
+				progress->num_left, progress->heap_size, progress->sscache_entries,
+				hit_rate, progress->lnbeta_hits, progress->merges_per_sec,
+				progress->rss);
+		return;
+	}
+	g_print("%.1fs: restart %u, %u merges, %u left, %u in heap, "
+			"sscache %u (%.1f%% hits), lnbeta hits %u, %.1f merges/s, rss %.1fMB\n",
+			progress->elapsed, progress->restart, progress->num_merges,
+			progress->num_left, progress->heap_size, progress->sscache_entries,
+			100.0*hit_rate, progress->lnbeta_hits, progress->merges_per_sec,
+			(gdouble)progress->rss/(1 << 20));
+}
+
 static void timer_save_io(GTimer * timer, GIOChannel * io) {
 	io_printf(io, "time: %es\n", g_timer_elapsed(timer, NULL));
 }
@@ -193,8 +419,9 @@ static void sample_save_hypers(Tree * root, GIOChannel * io) {
 				params->delta, params->lambda,
 				tree_get_logprob(root)
 			 );
-		params = params_sample(rng, params, eval_tree_params_logprob, root);
+		params_sample(rng, params, eval_tree_params_logprob, root);
 	}
+	g_rand_free(rng);
 }
 
 int main(int argc, char * argv[]) {
@@ -202,25 +429,67 @@ int main(int argc, char * argv[]) {
 	GTimer * timer;
 	Dataset * dataset;
 	gchar * train_fname;
+	Ensemble * ensemble;
 	Tree * root;
 	Pair * root_timer;
 	Pair * root_timer_train;
 
 	train_fname = parse_args(&argc, &argv);
 
-	if (sparse_greedy && merge_global_score) {
-		g_error("cannot combine sparse with global score at present");
+	if (max_candidates > 0 && (sparse_greedy || merge_global_score)) {
+		g_error("can only limit candidates per cluster in the dense, local score build");
+	}
+	if (max_candidates > 0 && heuristic_prune) {
+		g_error("cannot prune restarts heuristically when limiting candidates per cluster");
+	}
+	if (split_components && !sparse_greedy) {
+		g_error("can only build components apart in the sparse build");
+	}
+	if (time_budget < 0.0) {
+		g_error("time budget must not be negative");
+	}
+	if (resume && checkpoint_fname == NULL) {
+		g_error("need a checkpoint file to resume from");
+	}
+	if (checkpoint_fname != NULL && split_components) {
+		g_error("cannot checkpoint a build of components apart");
+	}
+	if (progress_interval < 0.0) {
+		g_error("progress interval must not be negative");
+	}
+	if (progress_json && progress_interval <= 0.0) {
+		g_error("need a progress interval to report progress as JSON");
+	}
+	if (checkpoint_interval < 0.0) {
+		g_error("checkpoint interval must not be negative");
+	}
+	if (coarsen && binary_only) {
+		g_error("cannot combine coarsening with binary only trees");
+	}
+	if (update_fname != NULL && checkpoint_fname != NULL) {
+		g_error("cannot checkpoint an update");
+	}
+	if (subsample > 0 && (coarsen || split_components || heuristic_prune || checkpoint_fname != NULL)) {
+		g_error("cannot subsample with coarsening, components, pruned restarts or checkpoints");
 	}
 
 	g_print("seed: %x\n", seed);
 	g_print("output prefix: %s\n", output_prefix);
 	rng = g_rand_new_with_seed(seed);
 	timer = g_timer_new();
-	dataset = dataset_gml_load(train_fname);
+	dataset = dataset_gml_load_full(train_fname, dataset_symmetric);
 
 	g_timer_start(timer);
-	root = run(rng, dataset);
+	if (update_fname != NULL) {
+		Dataset * delta = dataset;
+
+		ensemble = update(delta, &dataset);
+		dataset_unref(delta);
+	} else {
+		ensemble = run(rng, dataset);
+	}
 	g_timer_stop(timer);
+	root = g_ptr_array_index(ensemble->trees, 0);
 
 	io_stdout((IOFunc)timer_save_io, timer);
 	tree_println(root, "tree: ");
@@ -228,7 +497,7 @@ int main(int argc, char * argv[]) {
 	io_writefile(output_time_fname, (IOFunc)timer_save_io, timer);
 	tree_io_save(root, output_tree_fname);
 
-	root_timer = pair_new(root, timer);
+	root_timer = pair_new(ensemble, timer);
 	io_writefile(output_pred_fname, (IOFunc)eval_test, root_timer);
 
 	if (!disable_fit_file) {
@@ -246,10 +515,11 @@ int main(int argc, char * argv[]) {
 		bhcd_lua_shell(root);
 	}
 
-	tree_unref(root);
+	ensemble_free(ensemble);
 	g_free(output_tree_fname);
 	g_free(output_pred_fname);
 	g_free(output_time_fname);
+	g_free(output_data_fname);
 	dataset_unref(dataset);
 	g_timer_destroy(timer);
 	g_rand_free(rng);
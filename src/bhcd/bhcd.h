@@ -12,10 +12,12 @@
 #include "tree_io.h"
 #include "merge.h"
 #include "build.h"
+#include "checkpoint.h"
 #include "bitset.h"
 #include "labelset.h"
 #include "lua_bhcd.h"
 #include "lnbetacache.h"
 #include "minheap.h"
+#include "dheap.h"
 
 #endif
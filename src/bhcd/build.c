@@ -1,46 +1,287 @@
 #include "build.h"
 #include "islands.h"
 #include "merge.h"
-#include "minheap.h"
+#include "dheap.h"
+#include "sscache.h"
+#include "counts.h"
+#include "checkpoint.h"
+#include "subsample.h"
+#include "coarsen.h"
+#include "fingerprints.h"
+#include "progress.h"
 
 
 static const gboolean build_debug = FALSE;
 
+/* below this many merges to score, doing so on the calling thread is
+ * cheaper than waking up the workers.
+ */
+#define	BUILD_PARALLEL_MIN		64
+/* likewise for heapifying the initial merges */
+#define	BUILD_PARALLEL_HEAPIFY_MIN	(1 << 14)
+/* chunks handed out per worker, to even out absorbs into large trees */
+#define	BUILD_CHUNKS_PER_THREAD		4
+/* restarts run to the end before build_prune_estimate is trusted */
+#define	BUILD_PRUNE_MIN_COMPLETED	5
+
 typedef void (*InitMergesFunc)(Build *);
-typedef void (*AddMergesFunc)(Build *, Merge *);
+typedef void (*AddMergesFunc)(Build *, Merge *, guint);
 typedef void (*FiniMergesFunc)(Build *);
 
 struct Build_t {
 	gboolean verbose;
 	GRand * rng;
 	Params * params;
-	Tree * best_tree;
+	/* the best num_best_trees trees over all restarts, best first, and
+	 * the CheckpointLog of each.
+	 */
+	GPtrArray * best_trees;
+	GPtrArray * best_logs;
+	guint num_best_trees;
 	guint num_restarts;
 	guint cur_restart;
+	/* restarts run at once (see build_run_parallel) */
+	guint restart_threads;
+	/* if not 0, the build_run time budget in seconds, and its deadline
+	 * (g_get_monotonic_time) once running.
+	 */
+	gdouble time_budget;
+	gint64 deadline;
+	/* set if a tree was flattened with merges left (see build_finish) */
+	gboolean incomplete;
+	/* the build whose best trees a restart is up against: itself, or the
+	 * build it is a restart of. best_lock guards what the restarts share
+	 * of the latter.
+	 */
+	Build * top;
+	GMutex best_lock;
+	/* if set, abandon a restart once build_prune_estimate falls below the
+	 * worst tree kept by top. under best_lock, top holds that tree's
+	 * logprob, and the BuildGain of the restarts run to the end from each
+	 * size of forest on.
+	 */
+	gboolean prune_restarts;
+	gdouble best_logprob;
+	GArray * prune_gains;
+	/* the restarts begun, those abandoned and those run to the end, and
+	 * the time (usec) spent on the latter two.
+	 */
+	guint num_run;
+	guint num_pruned;
+	guint num_completed;
+	gint64 pruned_usec;
+	gint64 completed_usec;
+	/* see build_set_adaptive_restarts. under best_lock, top holds the
+	 * fingerprints (see fingerprints_merge) of the forests seen by the
+	 * restarts run to the end, and whether to begin any more.
+	 */
+	guint patience;
+	guint max_repeats;
+	gboolean skip_repeats;
+	GHashTable * seen;
+	gboolean stop_restarts;
+	/* the restarts that repeated an earlier one, and those in a row since
+	 * the best tree last got better.
+	 */
+	guint num_repeats;
+	guint since_better;
+	/* the seed of each restart, while build_run runs */
+	const guint32 * seeds;
+	/* if not NULL, takes a checkpoint every so often (see
+	 * build_checkpoint).
+	 */
+	CheckpointWriter * checkpoint_writer;
+	/* to carry on from (see build_set_resume), and the merges to redo at
+	 * the start of the next build_begin.
+	 */
+	Checkpoint * resume;
+	GArray * resume_log;
+	/* if not NULL, each restart reports to progress (see
+	 * build_set_progress), shared with its restarts and components, and
+	 * last reported at progress_mark.
+	 */
+	Progress * progress;
+	ProgressMark progress_mark;
 
 	/* work in progress storage */
 	GPtrArray * trees;
-	MinHeap * merges;
+	DHeap * merges;
+	GPtrArray * batch;
+	guint num_steps;
+	/* the merges so far, as CheckpointMerge */
+	GArray * merge_log;
+	/* if fingerprinting restarts, those of this one */
+	Fingerprints * fingerprints;
+	/* if pruning, the sum of the logprobs of the trees, the suffstats
+	 * between them, their number, and the value of the forest (see
+	 * build_forest_value) at each size so far.
+	 */
+	gdouble forest_logprob;
+	gpointer forest_between;
+	guint forest_size;
+	GArray * forest_values;
+	/* for each tree, the merges in the heap involving it */
+	GPtrArray * candidates;
+	/* if not 0, each tree keeps only its best max_candidates merges, and
+	 * those left without any are rescanned (see build_refill_candidates).
+	 */
+	guint max_candidates;
+	GArray * exhausted;
+	/* if max_candidates, the tree holding each label (by quark, G_MAXUINT
+	 * if none) and the labels in each tree, to count the offblocks of
+	 * the merges ranked without caching them (see build_score_chunk).
+	 */
+	GArray * label_trees;
+	GArray * tree_sizes;
+	/* if set, merge all reciprocal best pairs scoring at least
+	 * batch_min_score at once (see build_find_batch).
+	 */
+	gboolean batch_merges;
+	gdouble batch_min_score;
+	/* if set, start from a tree for each group of structurally
+	 * equivalent labels (see build_coarsen_trees), found once.
+	 */
+	gboolean coarsen;
+	GPtrArray * equivalent_labels;
+	/* if set, build each connected component on its own (see
+	 * build_split_components).
+	 */
+	gboolean split_components;
+	/* for the build of one component: its labels, and its edges (src,
+	 * dst consecutive). NULL for the whole dataset.
+	 */
+	GPtrArray * component_labels;
+	GPtrArray * component_edges;
+	/* if not 0, each restart merges only num_sample leaves drawn at random,
+	 * and then inserts those left out, kept in sample_rest in label order
+	 * (see build_set_subsample).
+	 */
+	guint num_sample;
+	GPtrArray * sample_rest;
 
 	InitMergesFunc init_merges;
 	AddMergesFunc add_merges;
 	FiniMergesFunc fini_merges;
 	gpointer merges_data;
+
+	/* scoring merges in parallel if num_threads > 1 (see
+	 * build_run_chunks).
+	 */
+	guint num_threads;
+	GThreadPool * pool;
+	GAsyncQueue * chunks_done;
+	/* the trees at cand_kks to merge with the trees at cand_trees, the
+	 * merges that built the former (if any), a sym_break for each, and the
+	 * result.
+	 */
+	GArray * cand_kks;
+	GArray * cand_trees;
+	GPtrArray * cand_parents;
+	GArray * cand_sym_breaks;
+	GPtrArray * cand_merges;
+};
+
+/* the most and least logprob gained from some size of forest on, over
+ * the restarts run to the end; -G_MAXDOUBLE and G_MAXDOUBLE if none was
+ * seen at that size.
+ */
+typedef struct {
+	gdouble most;
+	gdouble least;
+} BuildGain;
+
+typedef struct BuildChunk_t BuildChunk;
+typedef void (*BuildChunkFunc)(BuildChunk *, Build *);
+
+/* items begin..end-1 of some work shared out between threads */
+struct BuildChunk_t {
+	BuildChunkFunc func;
+	guint begin;
+	guint end;
+	/* in: a sym_break per item. out: a merge per item */
+	const gdouble * sym_breaks;
+	Merge ** merges;
+	/* build_score_chunk: merge the tree at each of kks with that at each
+	 * of trees. parents built the former, if not NULL.
+	 */
+	const guint * kks;
+	const guint * trees;
+	Merge ** parents;
+	/* build_partners_chunk: the best max_candidates partners of each tree */
+	guint * partners;
+	/* build_init_chunk: merge each of pairs (ii, jj consecutive), or all
+	 * pairs of trees if NULL. sums their offblock stats.
+	 */
+	const guint * pairs;
+	gpointer global_suffstats;
 };
 
-static void build_extract_best_tree(Build * build);
-static void build_greedy(Build * build);
+static void build_extract_best_tree(Build * build, gboolean stopped);
+static void build_offer_best_tree(Build * build, Tree * root, const CheckpointLog * log);
+static void build_log_merge(Build * build, Merge * merge);
+static void build_replay(Build * build, GArray * log);
+static guint build_replay_best(Build * build, guint32 * seeds);
+static gboolean build_checkpoint_due(Build * build);
+static void build_checkpoint(Build * build, guint restart, GArray * current);
+static void build_checkpoint_wait(Build * build);
+static void build_progress(Build * build);
+static void build_run_parallel(Build * build, const guint32 * seeds, guint first);
+static void build_restart_job(Build * restart, GAsyncQueue * done);
+static void build_split_components(Build * build);
+static guint build_find_component(guint * parent, guint ii);
+static Build * build_new_component(Build * build, guint32 seed);
+static void build_run_components(Build * build, GPtrArray * components);
+static gboolean build_past_deadline(Build * build);
+static void build_init_forest(Build * build, gpointer global_suffstats);
+static gdouble build_forest_value(Build * build);
+static void build_record_forest(Build * build);
+static void build_record_gains(Build * build, Tree * root);
+static gdouble build_prune_estimate(Build * build, GArray * gains);
+static gboolean build_prune_due(Build * build);
+static gboolean build_fingerprinting(Build * build);
+static void build_record_fingerprints(Build * build);
+static gboolean build_repeat_due(Build * build);
+static gboolean build_restarts_stopped(Build * build);
+static gdouble build_best_logprob(Build * build);
+static void build_adapt_restarts(Build * build, gdouble best_before);
 static void build_init_merges(Build * build);
-static void build_add_merges(Build * build, Merge * cur);
+static void build_add_merges(Build * build, Merge * cur, guint kk);
+static void build_set_tree_labels(Build * build, guint kk);
 static void build_fini_merges(Build * build);
 static void build_sparse_init_merges(Build * build);
-static void build_sparse_add_merges(Build * build, Merge * cur);
+static void build_sparse_add_merges(Build * build, Merge * cur, guint kk);
 static void build_sparse_fini_merges(Build * build);
+static void build_init_pairs(Build * build, const guint * pairs, guint num_pairs);
+static void build_sparse_global_suffstats(Build * build, gpointer global_suffstats, const guint * pairs, guint num_pairs);
+static void build_init_chunk(BuildChunk * chunk, Build * build);
+static void build_notify_chunk(BuildChunk * chunk, Build * build);
+static void build_heapify(Build * build);
+static void build_heapify_chunk(BuildChunk * chunk, Build * build);
+static void build_add_candidate(Build * build, Merge * cur, guint kk, guint ll);
+static void build_score_candidates(Build * build);
+static void build_score_chunk(BuildChunk * chunk, Build * build);
+static void build_keep_best_candidates(Build * build);
+static void build_init_partners(Build * build);
+static void build_partners_chunk(BuildChunk * chunk, Build * build);
+static void build_refill_candidates(Build * build);
+static void build_find_batch(Build * build, GPtrArray * batch);
+static void build_best_chunk(BuildChunk * chunk, Build * build);
+static gint build_cmp_batch(gconstpointer paa, gconstpointer pbb);
+static void build_merge_batch(Build * build, GPtrArray * batch);
+static void build_fill_batch_offblocks(Build * build, guint first);
+static BuildChunk * build_chunks_new(Build * build, BuildChunkFunc func, guint num_items, gboolean parallel, guint * num_chunks);
+static void build_run_chunks(Build * build, BuildChunk * chunks, guint num_chunks);
+static void build_chunk_job(BuildChunk * chunk, Build * build);
 static void build_init_trees(Build * build, Dataset * dataset);
+static void build_coarsen_trees(Build * build);
+static void build_compact_trees(Build * build);
 static void build_remove_tree(Build * build, guint ii);
+static void build_link_candidate(Build * build, Merge * merge);
+static void build_enq_candidate(Build * build, Merge * merge);
+static void build_unlink_candidate(Build * build, Merge * merge, guint ii);
 static void build_cleanup(Build * build);
 static void build_assert(Build * build);
-static void build_flatten_trees(Build * build);
+static void build_flatten_trees(Build * build, gboolean fill);
 static void build_println(Build * build);
 
 
@@ -54,11 +295,71 @@ Build * build_new(GRand *rng, Params * params, guint num_restarts, gboolean spar
 	params_set_sparse(params, sparse);
 	params_ref(params);
 	build->num_restarts = num_restarts;
+	build->cur_restart = 0;
+	build->restart_threads = 1;
+	build->time_budget = 0.0;
+	build->deadline = 0;
+	build->incomplete = FALSE;
+	build->top = build;
+	g_mutex_init(&build->best_lock);
+	build->prune_restarts = FALSE;
+	build->best_logprob = -G_MAXDOUBLE;
+	build->prune_gains = g_array_new(FALSE, FALSE, sizeof(BuildGain));
+	build->num_run = 0;
+	build->num_pruned = 0;
+	build->num_completed = 0;
+	build->pruned_usec = 0;
+	build->completed_usec = 0;
+	build->patience = 0;
+	build->max_repeats = 0;
+	build->skip_repeats = FALSE;
+	build->seen = fingerprints_seen_new();
+	build->stop_restarts = FALSE;
+	build->num_repeats = 0;
+	build->since_better = 0;
+	build->seeds = NULL;
+	build->checkpoint_writer = NULL;
+	build->resume = NULL;
+	build->resume_log = NULL;
+	build->progress = NULL;
+	progress_mark_init(&build->progress_mark);
 
 	build->trees = NULL;
 	build->merges = NULL;
-	build->best_tree = NULL;
+	build->batch = g_ptr_array_new();
+	build->num_steps = 0;
+	build->merge_log = g_array_new(FALSE, FALSE, sizeof(CheckpointMerge));
+	build->fingerprints = fingerprints_new();
+	build->forest_logprob = 0.0;
+	build->forest_between = NULL;
+	build->forest_size = 0;
+	build->forest_values = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	build->candidates = NULL;
+	build->max_candidates = 0;
+	build->exhausted = g_array_new(FALSE, FALSE, sizeof(guint));
+	build->label_trees = g_array_new(FALSE, FALSE, sizeof(guint));
+	build->tree_sizes = g_array_new(FALSE, FALSE, sizeof(guint));
+	build->best_trees = g_ptr_array_new_with_free_func((GDestroyNotify)tree_unref);
+	build->best_logs = g_ptr_array_new_with_free_func((GDestroyNotify)checkpoint_log_free);
+	build->num_best_trees = 1;
 	build->merges_data = NULL;
+	build->num_threads = 1;
+	build->pool = NULL;
+	build->chunks_done = NULL;
+	build->batch_merges = FALSE;
+	build->batch_min_score = 0.0;
+	build->coarsen = FALSE;
+	build->equivalent_labels = NULL;
+	build->split_components = FALSE;
+	build->component_labels = NULL;
+	build->component_edges = NULL;
+	build->num_sample = 0;
+	build->sample_rest = g_ptr_array_new();
+	build->cand_kks = g_array_new(FALSE, FALSE, sizeof(guint));
+	build->cand_trees = g_array_new(FALSE, FALSE, sizeof(guint));
+	build->cand_parents = g_ptr_array_new();
+	build->cand_sym_breaks = g_array_new(FALSE, FALSE, sizeof(gdouble));
+	build->cand_merges = g_ptr_array_new();
 	if (sparse) {
 		build->init_merges = build_sparse_init_merges;
 		build->add_merges = build_sparse_add_merges;
@@ -73,8 +374,42 @@ Build * build_new(GRand *rng, Params * params, guint num_restarts, gboolean spar
 
 void build_free(Build * build) {
 	build_cleanup(build);
+	build_set_num_threads(build, 1);
+	g_array_free(build->cand_kks, TRUE);
+	g_array_free(build->cand_trees, TRUE);
+	g_ptr_array_free(build->cand_parents, TRUE);
+	g_array_free(build->cand_sym_breaks, TRUE);
+	g_ptr_array_free(build->cand_merges, TRUE);
+	g_array_free(build->exhausted, TRUE);
+	g_array_free(build->label_trees, TRUE);
+	g_array_free(build->tree_sizes, TRUE);
+	g_ptr_array_free(build->batch, TRUE);
+	g_array_unref(build->merge_log);
+	g_ptr_array_free(build->best_logs, TRUE);
+	if (build->checkpoint_writer != NULL) {
+		checkpoint_writer_free(build->checkpoint_writer);
+	}
+	if (build->resume != NULL) {
+		checkpoint_free(build->resume);
+	}
+	if (build->equivalent_labels != NULL) {
+		g_ptr_array_unref(build->equivalent_labels);
+	}
+	if (build->component_labels != NULL) {
+		g_ptr_array_free(build->component_labels, TRUE);
+		g_ptr_array_free(build->component_edges, TRUE);
+	}
+	g_ptr_array_free(build->sample_rest, TRUE);
+	if (build->progress != NULL) {
+		progress_unref(build->progress);
+	}
 	params_unref(build->params);
-	tree_unref(build->best_tree);
+	g_ptr_array_free(build->best_trees, TRUE);
+	g_mutex_clear(&build->best_lock);
+	g_array_free(build->prune_gains, TRUE);
+	g_hash_table_unref(build->seen);
+	fingerprints_free(build->fingerprints);
+	g_array_free(build->forest_values, TRUE);
 	g_free(build);
 }
 
@@ -82,26 +417,40 @@ static void build_assert(Build * build) {
 	if (!build_debug) {
 		return;
 	}
-	if (build->merges != NULL && minheap_size(build->merges) > 1) {
-		MinHeap * check;
+	if (build->merges != NULL && dheap_size(build->merges) > 1) {
+		DHeap * check;
 		gdouble last_score;
 		Merge * cur;
 
-		check = minheap_copy(build->merges, minheap_elem_no_copy, minheap_elem_no_free);
-		cur = minheap_deq(check);
+		check = dheap_copy(build->merges);
+		cur = dheap_deq(check);
 		last_score = cur->score;
-		while (minheap_size(check) > 0) {
-			cur = minheap_deq(check);
+		while (dheap_size(check) > 0) {
+			cur = dheap_deq(check);
 			g_assert(last_score >= cur->score);
 			last_score = cur->score;
 		}
-		minheap_free(check);
+		dheap_free(check);
 	}
 }
 
 
 Tree * build_get_best_tree(Build * build) {
-	return build->best_tree;
+	if (build->best_trees->len == 0) {
+		return NULL;
+	}
+	return g_ptr_array_index(build->best_trees, 0);
+}
+
+/* keep the best num_trees trees found, rather than just the best. */
+void build_set_num_best_trees(Build * build, guint num_trees) {
+	g_assert(num_trees > 0);
+	build->num_best_trees = num_trees;
+}
+
+/* the best trees found, best first; owned by build. */
+GPtrArray * build_get_best_trees(Build * build) {
+	return build->best_trees;
 }
 
 
@@ -110,7 +459,104 @@ void build_set_verbose(Build * build, gboolean value) {
 	build->verbose = value;
 }
 
+/* keep only the best max_candidates merges of each tree in the heap,
+ * rather than one for every pair of trees, so the heap holds
+ * O(num_trees*max_candidates) merges. 0, the default, keeps them all and is
+ * exact. the merges kept are only ranked by local score, so this is for
+ * the dense, local score build only.
+ */
+void build_set_max_candidates(Build * build, guint max_candidates) {
+	g_assert(max_candidates == 0 || (!build->params->sparse && !build->params->global_score));
+	g_assert(max_candidates == 0 || !build->prune_restarts);
+	build->max_candidates = max_candidates;
+}
+
+/* each step, merge every pair of trees that are each other's best
+ * candidate, and score at least min_score, rather than just the best pair;
+ * the new trees' candidates are scored together. this is not the same as
+ * the greedy build, as a tree from one merge in the batch might have been a
+ * better partner for a tree in another, but it takes far fewer steps.
+ */
+void build_set_batch_merges(Build * build, gboolean value, gdouble min_score) {
+	g_assert(value == FALSE || value == TRUE);
+	build->batch_merges = value;
+	build->batch_min_score = min_score;
+}
+
+/* start from a flat tree for each group of structurally equivalent labels,
+ * rather than merging them a pair at a time.
+ */
+void build_set_coarsen(Build * build, gboolean value) {
+	g_assert(value == FALSE || value == TRUE);
+	g_assert(!value || !build->params->binary_only);
+	g_assert(!value || build->num_sample == 0);
+	build->coarsen = value;
+}
+
+/* in the sparse build, merges never join trees from different connected
+ * components, so build each component separately, the largest with
+ * num_threads threads while the rest share num_threads more, and hang
+ * them all from one root at the end as build_flatten_trees would.
+ */
+void build_set_split_components(Build * build, gboolean value) {
+	g_assert(value == FALSE || value == TRUE);
+	g_assert(!value || build->params->sparse);
+	g_assert(!value || build->num_sample == 0);
+	build->split_components = value;
+}
+
+/* for graphs too big to build whole: each restart merges only num_sample
+ * leaves, drawn at random from its rng, and then places the rest one at a
+ * time into the tree built by tree_insert_leaf, in label order. the
+ * counts along each insertion path are exact, so the tree and its logprob
+ * are as if built on all the labels, though the tree is likely worse than
+ * a full build. 0, the default, or at least the number of labels, builds
+ * on all of them. not with coarsen, components built apart, pruned
+ * restarts or checkpoints.
+ */
+void build_set_subsample(Build * build, guint num_sample) {
+	g_assert(num_sample == 0 || (!build->coarsen && !build->split_components));
+	g_assert(num_sample == 0 || (!build->prune_restarts && build->checkpoint_writer == NULL));
+	build->num_sample = num_sample;
+}
+
+/* score new candidates with num_threads threads. the trees built do not
+ * depend on num_threads. the lnbeta caches must not be lazy meanwhile, ie.
+ * do not change the hyperparameters in place during a build.
+ */
+void build_set_num_threads(Build * build, guint num_threads) {
+	GError * error;
+
+	g_assert(num_threads > 0);
+	if (build->pool != NULL) {
+		g_thread_pool_free(build->pool, FALSE, TRUE);
+		g_async_queue_unref(build->chunks_done);
+		build->pool = NULL;
+		build->chunks_done = NULL;
+	}
+	build->num_threads = num_threads;
+	if (num_threads == 1) {
+		return;
+	}
+	error = NULL;
+	build->pool = g_thread_pool_new((GFunc)build_chunk_job, build,
+			(gint)num_threads, TRUE, &error);
+	if (error != NULL) {
+		g_error("g_thread_pool_new: %s", error->message);
+	}
+	build->chunks_done = g_async_queue_new();
+}
+
 static void build_cleanup(Build * build) {
+	g_array_set_size(build->exhausted, 0);
+	g_array_set_size(build->label_trees, 0);
+	g_array_set_size(build->tree_sizes, 0);
+	fingerprints_reset(build->fingerprints);
+	if (build->forest_between != NULL) {
+		suffstats_unref(build->forest_between);
+		build->forest_between = NULL;
+		g_array_set_size(build->forest_values, 0);
+	}
 	if (build->merges_data != NULL) {
 		build->fini_merges(build);
 	}
@@ -119,16 +565,26 @@ static void build_cleanup(Build * build) {
 		build->trees = NULL;
 	}
 	if (build->merges != NULL) {
-		minheap_free(build->merges);
+		dheap_free(build->merges);
 		build->merges = NULL;
 	}
+	if (build->candidates != NULL) {
+		for (guint ii = 0; ii < build->candidates->len; ii++) {
+			GPtrArray * cands = g_ptr_array_index(build->candidates, ii);
+			if (cands != NULL) {
+				g_ptr_array_free(cands, TRUE);
+			}
+		}
+		g_ptr_array_free(build->candidates, TRUE);
+		build->candidates = NULL;
+	}
 }
 
 static void build_println(Build * build) {
 	guint ii;
 	Tree * tt;
 
-	g_print("%d in queue\n", minheap_size(build->merges));
+	g_print("%d in queue\n", dheap_size(build->merges));
 	for (ii = 0; ii < build->trees->len; ii++) {
 		tt = g_ptr_array_index(build->trees, ii);
 		if (tt != NULL) {
@@ -138,298 +594,1933 @@ static void build_println(Build * build) {
 	}
 }
 
+/* a restart after the first is skipped once past the deadline, or once
+ * build_set_adaptive_restarts says to stop; the one running then stops
+ * where it is.
+ */
 void build_once(Build * build) {
+	gint64 start;
+
+	if (build->cur_restart > 0 && (build_past_deadline(build) || build_restarts_stopped(build))) {
+		return;
+	}
+	build->num_run++;
+	start = g_get_monotonic_time();
+	build_begin(build);
+	while (!build_past_deadline(build)) {
+		if (build_prune_due(build)) {
+			/* heading for a worse tree: nothing to keep */
+			build_cleanup(build);
+			build->num_pruned++;
+			build->pruned_usec += g_get_monotonic_time() - start;
+			return;
+		}
+		if (build_repeat_due(build)) {
+			/* taken to end as the earlier restart did */
+			build_cleanup(build);
+			build->num_repeats++;
+			return;
+		}
+		if (build_step(build, 1) == 0) {
+			break;
+		}
+		if (build_checkpoint_due(build)) {
+			build_checkpoint(build, build->cur_restart, build->merge_log);
+		}
+		build_progress(build);
+	}
+	if (build->checkpoint_writer != NULL && build_get_num_merges(build) > 0) {
+		/* out of time: keep the merges so far to carry on from */
+		build_checkpoint_wait(build);
+		build_checkpoint(build, build->cur_restart, build->merge_log);
+		build_checkpoint_wait(build);
+	}
+	build_finish(build);
+	build->num_completed++;
+	build->completed_usec += g_get_monotonic_time() - start;
+}
+
+/* set up the trees and merges for one restart, drawing from build's rng. */
+void build_begin(Build * build) {
 	params_reset_cache(build->params);
+	if (build->progress != NULL) {
+		sscache_set_count_hits(build->params->sscache, TRUE);
+	}
 	build_init_trees(build, build->params->dataset);
+	if (build->num_sample > 0) {
+		subsample_trees(build->trees, build->num_sample, build->rng, build->sample_rest);
+	}
+	build->num_steps = 0;
+	progress_mark_init(&build->progress_mark);
+	/* the last restart's log may be among the best */
+	g_array_unref(build->merge_log);
+	build->merge_log = g_array_new(FALSE, FALSE, sizeof(CheckpointMerge));
+	if (build->split_components) {
+		build_split_components(build);
+		return;
+	}
+	if (build->coarsen) {
+		build_coarsen_trees(build);
+	}
+	if (build->resume_log != NULL) {
+		build_replay(build, build->resume_log);
+		g_array_unref(build->resume_log);
+		build->resume_log = NULL;
+	}
 	build->init_merges(build);
-	build_greedy(build);
-	build_extract_best_tree(build);
-	build_cleanup(build);
 }
 
-void build_run(Build * build) {
-	for (build->cur_restart = 0; build->cur_restart < build->num_restarts; build->cur_restart++) {
-		build_once(build);
+/* carry out the best merges left, until at least max_merges (or a batch,
+ * see build_set_batch_merges) are done. returns the number done: 0 once
+ * there are none left.
+ */
+guint build_step(Build * build, guint max_merges) {
+	GPtrArray * batch = build->batch;
+	guint num_merges;
+	Merge * cur;
+
+	num_merges = 0;
+	while (build->merges != NULL && dheap_size(build->merges) > 0
+			&& num_merges < max_merges) {
+		build_assert(build);
+		if (build->batch_merges) {
+			build_find_batch(build, batch);
+		}
+		if (batch->len == 0) {
+			g_ptr_array_add(batch, dheap_deq(build->merges));
+		}
+
+		for (guint bb = 0; bb < batch->len; bb++) {
+			cur = g_ptr_array_index(batch, bb);
+			/* merges involving removed trees are purged from the heap */
+			g_assert(g_ptr_array_index(build->trees, cur->ii) != NULL);
+			g_assert(g_ptr_array_index(build->trees, cur->jj) != NULL);
+
+			if (build_debug) {
+				merge_println(cur, "best merge: ");
+			}
+		}
+
+		build->num_steps++;
+		build_merge_batch(build, batch);
+		if (build->verbose && (build->num_steps < 100 || (build->num_steps % 100) == 0)) {
+			g_print("%d: ", build->num_steps);
+			build_println(build);
+		}
+		num_merges += batch->len;
+		for (guint bb = 0; bb < batch->len; bb++) {
+			merge_free(g_ptr_array_index(batch, bb));
+		}
+		g_ptr_array_set_size(batch, 0);
 	}
+	return num_merges;
 }
 
+/* the trees built so far, with NULL for those merged away; owned by build.
+ * only valid between build_begin and build_finish.
+ */
+GPtrArray * build_get_trees(Build * build) {
+	return build->trees;
+}
 
-static void build_init_trees(Build * build, Dataset * dataset) {
-	DatasetLabelIter iter;
-	gpointer label;
+/* the number of merges in the heap, ie. the candidates left. */
+guint build_get_num_merges(Build * build) {
+	if (build->merges == NULL) {
+		return 0;
+	}
+	return dheap_size(build->merges);
+}
 
-	g_assert(build->trees == NULL);
-	build->trees = g_ptr_array_new_full(dataset_num_labels(dataset), (GDestroyNotify)tree_unref);
-	dataset_labels_iter_init(dataset, &iter);
-	while (dataset_labels_iter_next(&iter, &label)) {
-		Tree * leaf = leaf_new(build->params, label);
-		g_ptr_array_add(build->trees, leaf);
+/* hang the trees left from one root, and offer it as the tree of this
+ * restart.
+ */
+void build_finish(Build * build) {
+	gboolean stopped;
+
+	stopped = build_get_num_merges(build) > 0;
+	if (stopped) {
+		build->incomplete = TRUE;
+	}
+	build_flatten_trees(build, stopped);
+	if (build->sample_rest->len > 0) {
+		g_ptr_array_index(build->trees, 0) = subsample_insert_rest(
+				g_ptr_array_index(build->trees, 0), build->sample_rest);
+	}
+	if (build->forest_between != NULL && !stopped) {
+		build_record_gains(build, g_ptr_array_index(build->trees, 0));
+	}
+	if (!stopped) {
+		build_record_fingerprints(build);
 	}
+	build_extract_best_tree(build, stopped);
+	build_cleanup(build);
 }
 
+/* stop the greedy merges of build_run once seconds have passed since it
+ * started, and flatten the trees so far. 0, the default, means no limit.
+ */
+void build_set_time_budget(Build * build, gdouble seconds) {
+	g_assert(seconds >= 0.0);
+	build->time_budget = seconds;
+}
 
-static void build_remove_tree(Build * build, guint ii) {
-	gpointer * tii;
+/* whether any tree built was flattened with merges left. */
+gboolean build_get_incomplete(Build * build) {
+	return build->incomplete;
+}
 
-	tii = &g_ptr_array_index(build->trees, ii);
-	tree_unref(*tii);
-	*tii = NULL;
+static gboolean build_past_deadline(Build * build) {
+	return build->deadline != 0 && g_get_monotonic_time() >= build->deadline;
 }
 
-static void build_init_merges(Build * build) {
-	MinHeapIter iter;
-	Merge * new_merge;
-	Tree * aa;
-	Tree * bb;
-	guint ii;
-	guint jj;
-	gpointer pmerge, global_suffstats;
+/* abandon a restart once an optimistic guess at where it is heading (see
+ * build_prune_estimate) is worse than the trees kept so far. a heuristic:
+ * the guess is no bound, so the restart that would have made the best
+ * tree may be among those abandoned. not with max_candidates, or
+ * components built apart, where it does nothing. with restart threads,
+ * which are abandoned depends on which finish first.
+ */
+void build_set_heuristic_prune(Build * build, gboolean value) {
+	g_assert(value == FALSE || value == TRUE);
+	g_assert(!value || build->max_candidates == 0);
+	g_assert(!value || build->num_sample == 0);
+	build->prune_restarts = value;
+}
 
-	g_assert(build->trees != NULL);
-	g_assert(build->merges == NULL);
-	g_assert(build->merges_data == NULL);
-	build->merges = minheap_new((build->trees->len*(build->trees->len-1))/2, merge_cmp_neg_score, (MinHeapFree)merge_free);
-	global_suffstats = suffstats_new_empty();
+/* the number of restarts abandoned by build_run. */
+guint build_get_num_pruned(Build * build) {
+	return build->num_pruned;
+}
 
-	for (ii = 0; ii < build->trees->len; ii++) {
-		aa = g_ptr_array_index(build->trees, ii);
-		for (jj = ii + 1; jj < build->trees->len; jj++) {
-			bb = g_ptr_array_index(build->trees, jj);
-			new_merge = merge_join(build->rng, NULL, build->params, ii, aa, jj, bb);
-			suffstats_add(global_suffstats, tree_get_suffstats(new_merge->tree));
-			/* make sure diagonal elements are not added */
-			suffstats_sub(global_suffstats, tree_get_suffstats(aa));
-			suffstats_sub(global_suffstats, tree_get_suffstats(bb));
-			minheap_enq(build->merges, new_merge);
-		}
-	}
-	if (build_debug) {
-		g_print("global stats: ");
-		suffstats_print(global_suffstats);
-		g_print("\n");
-	}
-	minheap_iter_init(build->merges, &iter);
-	while (minheap_iter_next(&iter, &pmerge)) {
-		new_merge = pmerge;
-		merge_notify_pair(new_merge, global_suffstats);
-		if (build_debug) {
-			merge_println(new_merge, "\tadd init merge: ");
-		}
+/* roughly the seconds the restarts abandoned would have taken to finish,
+ * going by those that did.
+ */
+gdouble build_get_pruned_saving(Build * build) {
+	gdouble saving;
+
+	if (build->num_completed == 0) {
+		return 0.0;
 	}
-	/* rebuild to reflect updated scores */
-	minheap_rebuild(build->merges);
-	suffstats_unref(global_suffstats);
+	saving = (gdouble)build->completed_usec/build->num_completed*build->num_pruned
+		- (gdouble)build->pruned_usec;
+	return MAX(saving, 0.0)/G_USEC_PER_SEC;
 }
 
-static void build_add_merges(Build * build, Merge * cur) {
-	Tree * tll;
-	Merge * new_merge;
-	guint ll, kk;
-
-	g_assert(build->trees != NULL);
-	g_assert(build->merges != NULL);
-	g_assert(build->merges_data == NULL);
-	kk = build->trees->len;
-	for (ll = 0; ll < build->trees->len; ll++) {
-		if (g_ptr_array_index(build->trees, ll) == NULL) {
-			continue;
-		}
+/* the forest of trees at the start of a restart, and the suffstats
+ * between them.
+ */
+static void build_init_forest(Build * build, gpointer global_suffstats) {
+	g_assert(build->forest_between == NULL);
+	build->forest_logprob = 0.0;
+	build->forest_size = 0;
+	for (guint ii = 0; ii < build->trees->len; ii++) {
+		Tree * tree = g_ptr_array_index(build->trees, ii);
 
-		tll = g_ptr_array_index(build->trees, ll);
-		new_merge = merge_best(build->rng, cur, build->params, kk, cur->tree, ll, tll);
-		if (build_debug) {
-			merge_println(new_merge, "\tadd merge: ");
+		if (tree != NULL) {
+			build->forest_logprob += tree_get_logprob(tree);
+			build->forest_size++;
 		}
-		minheap_enq(build->merges, new_merge);
 	}
+	build->forest_between = suffstats_copy(global_suffstats);
+	build_record_forest(build);
 }
 
-static void build_fini_merges(Build * build) {
-	return;
+/* the forest scores as a tree with one off block between all its trees.
+ * each merge adds its global score to it (see merge_calc_score), so it
+ * ends at the logprob of the final tree.
+ */
+static gdouble build_forest_value(Build * build) {
+	return build->forest_logprob
+		+ params_logprob_off(build->params, build->forest_between);
 }
 
-static void build_sparse_init_merges(Build * build) {
-	MinHeapIter iter;
-	Islands * islands;
-	Merge * new_merge;
-	GList * edges;
-	gpointer pmerge, global_suffstats;
+static void build_record_forest(Build * build) {
+	GArray * values = build->forest_values;
+	guint old_len = values->len;
 
-	g_assert(build->trees != NULL);
-	g_assert(build->merges == NULL);
-	g_assert(build->merges_data == NULL);
+	if (old_len <= build->forest_size) {
+		g_array_set_size(values, build->forest_size + 1);
+		for (guint kk = old_len; kk < values->len; kk++) {
+			g_array_index(values, gdouble, kk) = -G_MAXDOUBLE;
+		}
+	}
+	g_array_index(values, gdouble, build->forest_size) = build_forest_value(build);
+}
 
-	islands = islands_new(build->params->dataset, build->trees);
-	build->merges_data = islands;
-	edges = islands_get_edges(islands);
+/* what this restart gained from each size of forest on, to reach root. */
+static void build_record_gains(Build * build, Tree * root) {
+	Build * top = build->top;
+	GArray * values = build->forest_values;
+	GArray * gains;
 
-	build->merges = minheap_new(g_list_length(edges), merge_cmp_neg_score, (MinHeapFree)merge_free);
-	global_suffstats = suffstats_new_empty();
+	g_mutex_lock(&top->best_lock);
+	gains = top->prune_gains;
+	if (gains->len < values->len) {
+		guint old_len = gains->len;
 
-	for (GList * xx = edges; xx != NULL; xx = g_list_next(xx)) {
-		Pair * pair = xx->data;
-		guint ii = GPOINTER_TO_INT(pair->fst);
-		guint jj = GPOINTER_TO_INT(pair->snd);
-		Tree * aa = g_ptr_array_index(build->trees, ii);
-		Tree * bb = g_ptr_array_index(build->trees, jj);
-		g_assert(ii < build->trees->len);
-		g_assert(jj < build->trees->len);
-
-		new_merge = merge_join(build->rng, NULL, build->params, ii, aa, jj, bb);
-		suffstats_add(global_suffstats, tree_get_suffstats(new_merge->tree));
-		/* make sure diagonal elements are not added */
-		suffstats_sub(global_suffstats, tree_get_suffstats(aa));
-		suffstats_sub(global_suffstats, tree_get_suffstats(bb));
-		minheap_enq(build->merges, new_merge);
-	}
-	islands_get_edges_free(edges);
-	if (build_debug) {
-		g_print("global stats: ");
-		suffstats_print(global_suffstats);
-		g_print("\n");
+		g_array_set_size(gains, values->len);
+		for (guint kk = old_len; kk < gains->len; kk++) {
+			g_array_index(gains, BuildGain, kk).most = -G_MAXDOUBLE;
+			g_array_index(gains, BuildGain, kk).least = G_MAXDOUBLE;
+		}
 	}
-	minheap_iter_init(build->merges, &iter);
-	while (minheap_iter_next(&iter, &pmerge)) {
-		new_merge = pmerge;
-		merge_notify_pair(new_merge, global_suffstats);
-		if (build_debug) {
-			merge_println(new_merge, "\tadd init merge: ");
+	for (guint kk = 0; kk < values->len; kk++) {
+		gdouble value = g_array_index(values, gdouble, kk);
+		BuildGain * gain = &g_array_index(gains, BuildGain, kk);
+
+		if (value > -G_MAXDOUBLE) {
+			gain->most = MAX(gain->most, tree_get_logprob(root) - value);
+			gain->least = MIN(gain->least, tree_get_logprob(root) - value);
 		}
 	}
-	/* rebuild to reflect updated scores */
-	minheap_rebuild(build->merges);
-	suffstats_unref(global_suffstats);
+	g_mutex_unlock(&top->best_lock);
 }
 
-static void build_sparse_add_merges(Build * build, Merge * cur) {
-	Islands * islands;
-	Tree *tll;
-	Merge * new_merge;
-	GList * neigh;
-	guint ll, kk;
-
-	g_assert(build->trees != NULL);
-	g_assert(build->merges != NULL);
-	g_assert(build->merges_data != NULL);
-	islands = build->merges_data;
-	kk = build->trees->len;
+/* an estimate, not a bound, of the best logprob this restart can still
+ * reach: a sound bound is out of reach, as the merges gain more as the
+ * clusters grow. the restarts differ only in how they break ties, so go
+ * by those run to the end: take this one to gain the most any did from
+ * the same size of forest, plus how much that varied between them. while
+ * the restarts are all much alike, early on, that leaves plenty of room,
+ * but a restart may still beat it. G_MAXDOUBLE until one has gone through
+ * this size.
+ */
+static gdouble build_prune_estimate(Build * build, GArray * gains) {
+	BuildGain * gain;
 
-	islands_merge(islands, kk, cur->ii, cur->jj);
+	if (build->forest_size >= gains->len) {
+		return G_MAXDOUBLE;
+	}
+	gain = &g_array_index(gains, BuildGain, build->forest_size);
+	if (gain->most <= -G_MAXDOUBLE) {
+		return G_MAXDOUBLE;
+	}
+	return build_forest_value(build) + gain->most + (gain->most - gain->least);
+}
 
-	neigh = islands_get_neigh(islands, kk);
-	for (GList * xx = neigh; xx != NULL; xx = g_list_next(xx)) {
-		ll = GPOINTER_TO_INT(xx->data);
-		if (g_ptr_array_index(build->trees, ll) == NULL) {
-			continue;
-		}
+static gboolean build_prune_due(Build * build) {
+	Build * top = build->top;
+	gboolean due;
 
-		tll = g_ptr_array_index(build->trees, ll);
-		new_merge = merge_best(build->rng, cur, build->params, kk, cur->tree, ll, tll);
-		if (build_debug) {
-			merge_println(new_merge, "\tadd merge: ");
-		}
-		minheap_enq(build->merges, new_merge);
+	if (!build->prune_restarts || build->forest_between == NULL
+			|| top->num_completed < BUILD_PRUNE_MIN_COMPLETED) {
+		return FALSE;
 	}
-	islands_get_neigh_free(neigh);
+	g_mutex_lock(&top->best_lock);
+	due = build_prune_estimate(build, top->prune_gains) < top->best_logprob;
+	g_mutex_unlock(&top->best_lock);
+	return due;
 }
 
-static void build_sparse_fini_merges(Build * build) {
-	islands_free(build->merges_data);
-	build->merges_data = NULL;
+/* restarts differ only in how they break ties, so many build the same
+ * tree, if by other merges. with this, stop build_run once patience
+ * restarts in a row have not bettered the best tree, or once max_repeats
+ * have repeated an earlier restart (0 for no limit on either). with
+ * skip_repeats, abandon a restart as soon as its forest is one an earlier
+ * restart passed through: the two part after that only on exact ties,
+ * which the earlier one has as much chance to break well; each counts as
+ * a repeat. with restart threads, those already under way when the build
+ * stops run on, and which are repeats depends on which finish first.
+ */
+void build_set_adaptive_restarts(Build * build, guint patience, guint max_repeats, gboolean skip_repeats) {
+	g_assert(skip_repeats == FALSE || skip_repeats == TRUE);
+	build->patience = patience;
+	build->max_repeats = max_repeats;
+	build->skip_repeats = skip_repeats;
 }
 
-static void build_greedy(Build * build) {
-	Merge * cur;
-	guint iter;
+/* the number of restarts build_run began. */
+guint build_get_num_run(Build * build) {
+	return build->num_run;
+}
 
-	iter = 0;
-	while (minheap_size(build->merges) > 0) {
-		build_assert(build);
-		cur = minheap_deq(build->merges);
+/* the number of restarts found to repeat an earlier one (only counted
+ * with build_set_adaptive_restarts).
+ */
+guint build_get_num_repeats(Build * build) {
+	return build->num_repeats;
+}
 
-		/*
-		if (build_debug && len > 0) {
-			Merge * cur_next = g_sequence_get(g_sequence_get_begin_iter(build->merges));
-			g_assert(merge_cmp_neg_score(cur, cur_next, NULL) != 0);
-		}
-		*/
+static gboolean build_fingerprinting(Build * build) {
+	Build * top = build->top;
 
-		if (g_ptr_array_index(build->trees, cur->ii) == NULL ||
-		    g_ptr_array_index(build->trees, cur->jj) == NULL) {
-			goto again;
-		}
+	return top->patience > 0 || top->max_repeats > 0 || top->skip_repeats;
+}
 
-		if (build_debug) {
-			merge_println(cur, "best merge: ");
-		}
+/* note whether this restart, run to the end, repeated an earlier one,
+ * and keep its fingerprints for those after it (only the last, unless
+ * skipping repeats).
+ */
+static void build_record_fingerprints(Build * build) {
+	Build * top = build->top;
 
-		iter++;
-		build_remove_tree(build, cur->ii);
-		build_remove_tree(build, cur->jj);
-		build->add_merges(build, cur);
-		g_ptr_array_add(build->trees, cur->tree);
-		tree_ref(cur->tree);
-		if (build->verbose && (iter < 100 || (iter++ % 100) == 0)) {
-			g_print("%d: ", iter);
-			build_println(build);
-		}
-again:
-		merge_free(cur);
+	if (!build_fingerprinting(build)) {
+		return;
+	}
+	g_mutex_lock(&top->best_lock);
+	if (fingerprints_add_seen(build->fingerprints, top->seen, top->skip_repeats)) {
+		build->num_repeats++;
 	}
-	build_flatten_trees(build);
+	g_mutex_unlock(&top->best_lock);
 }
 
-static void build_flatten_trees(Build * build) {
-	/* we've agglomerated as much as we can by merging,
-	 * but in the sparse case, we might have more than one connected
-	 * component--so just connect them in a rose tree
-	 */
-	Tree * new_root;
-	Tree * child;
-	guint num_children;
+static gboolean build_repeat_due(Build * build) {
+	Build * top = build->top;
+	gboolean due;
 
-	new_root = branch_new(build->params);
-	num_children = 0;
-	for (guint ii = 0; ii < build->trees->len; ii++) {
-		child = g_ptr_array_index(build->trees, ii);
-		if (child == NULL) {
-			continue;
-		}
-		branch_add_child(new_root, child);
-		build_remove_tree(build, ii);
-		num_children++;
-	}
-	g_assert(num_children != 0);
-	if (num_children == 1) {
-		tree_ref(child);
-		tree_unref(new_root);
-		g_ptr_array_index(build->trees, 0) = child;
-	} else {
-		g_ptr_array_index(build->trees, 0) = new_root;
+	if (!top->skip_repeats) {
+		return FALSE;
 	}
+	g_mutex_lock(&top->best_lock);
+	due = fingerprints_seen(build->fingerprints, top->seen);
+	g_mutex_unlock(&top->best_lock);
+	return due;
 }
 
+static gboolean build_restarts_stopped(Build * build) {
+	Build * top = build->top;
+	gboolean stopped;
 
-static void build_extract_best_tree(Build * build) {
-	Tree * root;
+	g_mutex_lock(&top->best_lock);
+	stopped = top->stop_restarts;
+	g_mutex_unlock(&top->best_lock);
+	return stopped;
+}
 
-	g_assert(build->merges != NULL);
-	g_assert(build->trees != NULL);
+static gdouble build_best_logprob(Build * build) {
+	if (build->best_trees->len == 0) {
+		return -G_MAXDOUBLE;
+	}
+	return tree_get_logprob(g_ptr_array_index(build->best_trees, 0));
+}
 
-	root = g_ptr_array_index(build->trees, 0);
-	g_assert(root != NULL);
-	if (build->best_tree == NULL) {
-		build->best_tree = root;
-		tree_ref(build->best_tree);
-	} else if (tree_get_logprob(root) > tree_get_logprob(build->best_tree)) {
-		if (build->verbose) {
-			g_print("better(%d): ", build->cur_restart);
-			tree_println(root, "");
-		}
-		tree_unref(build->best_tree);
-		build->best_tree = root;
-		tree_ref(build->best_tree);
+/* after each restart, in order: whether to begin any more. */
+static void build_adapt_restarts(Build * build, gdouble best_before) {
+	if (build_best_logprob(build) > best_before) {
+		build->since_better = 0;
+	} else {
+		build->since_better++;
+	}
+	if ((build->patience > 0 && build->since_better >= build->patience)
+			|| (build->max_repeats > 0 && build->num_repeats >= build->max_repeats)) {
+		g_mutex_lock(&build->best_lock);
+		build->stop_restarts = TRUE;
+		g_mutex_unlock(&build->best_lock);
 	}
 }
 
+/* run num_restarts restarts at once. the best tree found does not depend
+ * on num_threads.
+ */
+void build_set_restart_threads(Build * build, guint num_threads) {
+	g_assert(num_threads > 0);
+	build->restart_threads = num_threads;
+}
+
+/* each restart draws from its own rng, seeded from build's, so restarts can
+ * be run in any order.
+ */
+void build_run(Build * build) {
+	GRand * rng;
+	guint32 * seeds;
+	guint first;
 
+	if (build->time_budget > 0.0) {
+		build->deadline = g_get_monotonic_time() + (gint64)(build->time_budget*G_USEC_PER_SEC);
+	}
+	if (build->progress != NULL) {
+		progress_start(build->progress);
+	}
+	seeds = g_new(guint32, build->num_restarts);
+	for (guint rr = 0; rr < build->num_restarts; rr++) {
+		seeds[rr] = g_rand_int(build->rng);
+	}
+	build->seeds = seeds;
+	first = 0;
+	if (build->resume != NULL) {
+		first = build_replay_best(build, seeds);
+	}
+	if (build->checkpoint_writer != NULL) {
+		checkpoint_writer_start(build->checkpoint_writer);
+	}
+	if (build->restart_threads > 1 && build->num_restarts - first > 1) {
+		build_run_parallel(build, seeds, first);
+	} else {
+		rng = build->rng;
+		for (build->cur_restart = first; build->cur_restart < build->num_restarts; build->cur_restart++) {
+			gdouble best_before = build_best_logprob(build);
+
+			if (build->cur_restart > 0 && build_restarts_stopped(build)) {
+				break;
+			}
+			build->rng = g_rand_new_with_seed(seeds[build->cur_restart]);
+			build_once(build);
+			g_rand_free(build->rng);
+			build_adapt_restarts(build, best_before);
+			if (build_checkpoint_due(build)) {
+				build_checkpoint(build, build->cur_restart + 1, NULL);
+			}
+		}
+		build->rng = rng;
+	}
+	if (build->checkpoint_writer != NULL) {
+		build_checkpoint_wait(build);
+		/* unless one stopped early, and left its own */
+		if (!build->incomplete) {
+			build_checkpoint(build, build->num_restarts, NULL);
+			build_checkpoint_wait(build);
+		}
+	}
+	build->seeds = NULL;
+	g_free(seeds);
+}
+
+/* write a checkpoint to fname every interval seconds of build_run, from
+ * which build_set_resume can carry on. the checkpoint holds the merges of
+ * the best trees so far and of the restart under way, so the trees can be
+ * rebuilt without the rest of the build; it is written by a thread of its
+ * own from a copy of the latter, skipping one if the last is still being
+ * written. with restart threads, checkpoints are only taken as restarts
+ * finish. not for split components.
+ */
+void build_set_checkpoint(Build * build, const gchar * fname, gdouble interval) {
+	g_assert(interval >= 0.0);
+	g_assert(fname == NULL || !build->split_components);
+	g_assert(fname == NULL || build->num_sample == 0);
+	if (build->checkpoint_writer != NULL) {
+		checkpoint_writer_free(build->checkpoint_writer);
+		build->checkpoint_writer = NULL;
+	}
+	if (fname != NULL) {
+		build->checkpoint_writer = checkpoint_writer_new(fname, interval);
+	}
+}
+
+/* carry on build_run from a checkpoint written by a build of the same
+ * dataset, num_restarts and settings: its best trees are rebuilt, and
+ * its restart under way continues from its merges, with the heap rebuilt
+ * from the trees so far. the rng state is not kept, so this restart draws
+ * new sym_breaks from its seed.
+ */
+void build_set_resume(Build * build, const gchar * fname) {
+	Checkpoint * checkpoint;
+
+	g_assert(!build->split_components);
+	checkpoint = checkpoint_load(build->params->dataset, fname);
+	if (checkpoint->num_labels != dataset_num_labels(build->params->dataset)) {
+		g_error("checkpoint `%s' has %u labels, but the dataset has %u",
+				fname, checkpoint->num_labels,
+				dataset_num_labels(build->params->dataset));
+	}
+	if (checkpoint->num_restarts != build->num_restarts
+			|| checkpoint->restart > build->num_restarts) {
+		g_error("checkpoint `%s' is of %u restarts, not %u",
+				fname, checkpoint->num_restarts, build->num_restarts);
+	}
+	if (build->resume != NULL) {
+		checkpoint_free(build->resume);
+	}
+	build->resume = checkpoint;
+}
+
+/* rebuild and offer the best trees of the checkpoint to resume, and set
+ * up the restart it was in the middle of, if any. returns the restart to
+ * carry on from.
+ */
+static guint build_replay_best(Build * build, guint32 * seeds) {
+	Checkpoint * checkpoint = build->resume;
+	guint first;
+
+	for (guint ii = 0; ii < checkpoint->best_logs->len; ii++) {
+		CheckpointLog * log = g_ptr_array_index(checkpoint->best_logs, ii);
+
+		params_reset_cache(build->params);
+		build_init_trees(build, build->params->dataset);
+		if (build->coarsen) {
+			build_coarsen_trees(build);
+		}
+		build_replay(build, log->merges);
+		build_flatten_trees(build, log->stopped);
+		build_offer_best_tree(build, g_ptr_array_index(build->trees, 0), log);
+		build_cleanup(build);
+	}
+	first = checkpoint->restart;
+	if (checkpoint->current != NULL && first < build->num_restarts) {
+		seeds[first] = checkpoint->seed;
+		build->resume_log = g_array_ref(checkpoint->current);
+	}
+	checkpoint_free(checkpoint);
+	build->resume = NULL;
+	return first;
+}
+
+/* redo the merges of log (see checkpoint_replay), and note the forest
+ * replayed to as if one merge.
+ */
+static void build_replay(Build * build, GArray * log) {
+	gboolean fingerprinting = build_fingerprinting(build);
+	guint64 forest = 0;
+
+	for (guint ii = 0; fingerprinting && ii < build->trees->len; ii++) {
+		forest -= fingerprints_tree(build->fingerprints, g_ptr_array_index(build->trees, ii));
+	}
+	checkpoint_replay(build->params, build->trees, log);
+	g_array_append_vals(build->merge_log, log->data, log->len);
+	build_compact_trees(build);
+	for (guint ii = 0; fingerprinting && ii < build->trees->len; ii++) {
+		forest += fingerprints_tree(build->fingerprints, g_ptr_array_index(build->trees, ii));
+	}
+	if (fingerprinting) {
+		fingerprints_add_forest(build->fingerprints, forest);
+	}
+}
+
+static gboolean build_checkpoint_due(Build * build) {
+	return build->checkpoint_writer != NULL
+		&& checkpoint_writer_due(build->checkpoint_writer);
+}
+
+/* hand a checkpoint of the best trees so far, and current (the merges of
+ * restart, if under way), to the checkpoint writer; unless it is still
+ * writing the last.
+ */
+static void build_checkpoint(Build * build, guint restart, GArray * current) {
+	Checkpoint * checkpoint;
+
+	if (!checkpoint_writer_claim(build->checkpoint_writer)) {
+		return;
+	}
+	checkpoint = checkpoint_new(build->params->dataset,
+			build->num_restarts, restart,
+			restart < build->num_restarts? build->seeds[restart]: 0);
+	if (current != NULL) {
+		checkpoint->current = g_array_sized_new(FALSE, FALSE, sizeof(CheckpointMerge), current->len);
+		g_array_append_vals(checkpoint->current, current->data, current->len);
+	}
+	for (guint ii = 0; ii < build->best_logs->len; ii++) {
+		checkpoint_add_best(checkpoint, g_ptr_array_index(build->best_logs, ii));
+	}
+	checkpoint_writer_push(build->checkpoint_writer, checkpoint);
+}
+
+/* until the last checkpoint is written */
+static void build_checkpoint_wait(Build * build) {
+	if (build->checkpoint_writer != NULL) {
+		checkpoint_writer_wait(build->checkpoint_writer);
+	}
+}
+
+/* have each restart call func with a BuildProgress every interval seconds
+ * while it merges, with user_data; or no longer, if func is NULL. with
+ * restart threads, or split components, each restart under way reports
+ * for itself, from its own thread, one at a time. the counts of cache
+ * hits cost a shared write per lookup, so are only kept while reporting.
+ */
+void build_set_progress(Build * build, gdouble interval, BuildProgressFunc func, gpointer user_data) {
+	g_assert(interval >= 0.0);
+	if (build->progress != NULL) {
+		progress_unref(build->progress);
+		build->progress = NULL;
+	}
+	if (func != NULL) {
+		build->progress = progress_new(interval, func, user_data);
+	}
+	lnbetacache_set_count_hits(build->params->logbeta_alpha_beta, func != NULL);
+	lnbetacache_set_count_hits(build->params->logbeta_delta_lambda, func != NULL);
+}
+
+static void build_progress(Build * build) {
+	BuildProgress progress;
+	guint num_trees;
+
+	if (build->progress == NULL || !progress_due(build->progress, &build->progress_mark)) {
+		return;
+	}
+	num_trees = 0;
+	for (guint ii = 0; ii < build->trees->len; ii++) {
+		if (g_ptr_array_index(build->trees, ii) != NULL) {
+			num_trees++;
+		}
+	}
+	progress.restart = build->cur_restart;
+	progress.num_merges = build->merge_log->len;
+	progress.num_left = num_trees > 0? num_trees - 1: 0;
+	progress.heap_size = build_get_num_merges(build);
+	sscache_get_stats(build->params->sscache, &progress.sscache_entries,
+			&progress.sscache_lookups, &progress.sscache_hits);
+	progress.lnbeta_hits = lnbetacache_get_num_hits(build->params->logbeta_alpha_beta)
+		+ lnbetacache_get_num_hits(build->params->logbeta_delta_lambda);
+	progress_report(build->progress, &build->progress_mark, &progress);
+}
+
+/* each restart is a build of its own, with its own params (and so sscache)
+ * and rng. they are reduced in order as they finish, as build_run would.
+ */
+static void build_run_parallel(Build * build, const guint32 * seeds, guint first) {
+	Build ** restarts;
+	gboolean * finished;
+	GThreadPool * pool;
+	GAsyncQueue * done;
+	GError * error;
+	guint next;
+
+	restarts = g_new(Build *, build->num_restarts);
+	finished = g_new0(gboolean, build->num_restarts);
+	done = g_async_queue_new();
+	error = NULL;
+	pool = g_thread_pool_new((GFunc)build_restart_job, done,
+			(gint)build->restart_threads, TRUE, &error);
+	if (error != NULL) {
+		g_error("g_thread_pool_new: %s", error->message);
+	}
+	for (guint rr = first; rr < build->num_restarts; rr++) {
+		Params * params = params_fork(build->params);
+		Build * restart = build_new(g_rand_new_with_seed(seeds[rr]), params,
+				1, build->params->sparse);
+
+		params_unref(params);
+		build_set_num_threads(restart, build->num_threads);
+		build_set_max_candidates(restart, build->max_candidates);
+		build_set_batch_merges(restart, build->batch_merges, build->batch_min_score);
+		build_set_coarsen(restart, build->coarsen);
+		build_set_split_components(restart, build->split_components);
+		build_set_subsample(restart, build->num_sample);
+		restart->prune_restarts = build->prune_restarts;
+		restart->top = build;
+		if (build->progress != NULL) {
+			restart->progress = progress_ref(build->progress);
+		}
+		restart->deadline = build->deadline;
+		restart->cur_restart = rr;
+		if (rr == first && build->resume_log != NULL) {
+			restart->resume_log = build->resume_log;
+			build->resume_log = NULL;
+		}
+		restarts[rr] = restart;
+		g_thread_pool_push(pool, restart, &error);
+		if (error != NULL) {
+			g_error("g_thread_pool_push: %s", error->message);
+		}
+	}
+
+	next = first;
+	for (guint rr = first; rr < build->num_restarts; rr++) {
+		Build * restart = g_async_queue_pop(done);
+
+		finished[restart->cur_restart] = TRUE;
+		while (next < build->num_restarts && finished[next]) {
+			gdouble best_before = build_best_logprob(build);
+			gboolean ran;
+
+			restart = restarts[next];
+			ran = restart->num_run > 0;
+			build->incomplete |= restart->incomplete;
+			build->num_run += restart->num_run;
+			build->num_repeats += restart->num_repeats;
+			build->num_pruned += restart->num_pruned;
+			build->num_completed += restart->num_completed;
+			build->pruned_usec += restart->pruned_usec;
+			build->completed_usec += restart->completed_usec;
+			if (build_get_best_tree(restart) != NULL) {
+				build_offer_best_tree(build, build_get_best_tree(restart),
+						g_ptr_array_index(restart->best_logs, 0));
+			}
+			if (ran) {
+				build_adapt_restarts(build, best_before);
+			}
+			g_rand_free(restart->rng);
+			build_free(restart);
+			next++;
+			if (build_checkpoint_due(build)) {
+				build_checkpoint(build, next, NULL);
+			}
+		}
+	}
+	g_thread_pool_free(pool, FALSE, TRUE);
+	g_async_queue_unref(done);
+	g_free(finished);
+	g_free(restarts);
+}
+
+static void build_restart_job(Build * restart, GAsyncQueue * done) {
+	build_once(restart);
+	g_async_queue_push(done, restart);
+}
+
+/* replace the leaves with a tree for each connected component: those of
+ * one leaf as they are, the rest from a build of their own.
+ */
+static void build_split_components(Build * build) {
+	/* stored missing cells join trees too, as in islands_new */
+	const gint kinds[] = { DATASET_ITER_TRUE, DATASET_ITER_MISSING };
+	guint num_kinds;
+	GHashTable * index;
+	DatasetPairIter pairs;
+	gpointer src, dst;
+	guint num_trees;
+	guint * parent;
+	guint * component;
+	GArray * sizes;
+	GPtrArray * components;
+	GPtrArray * trees;
+
+	num_trees = build->trees->len;
+	num_kinds = dataset_get_sparse(build->params->dataset, NULL)? G_N_ELEMENTS(kinds): 1;
+	index = g_hash_table_new(NULL, NULL);
+	for (guint ii = 0; ii < num_trees; ii++) {
+		gconstpointer label = leaf_get_label(g_ptr_array_index(build->trees, ii));
+		g_hash_table_insert(index, GINT_TO_POINTER(GPOINTER_TO_INT(label)), GUINT_TO_POINTER(ii));
+	}
+
+	/* union-find, linking the later root under the earlier */
+	parent = g_new(guint, num_trees);
+	for (guint ii = 0; ii < num_trees; ii++) {
+		parent[ii] = ii;
+	}
+	for (guint kk = 0; kk < num_kinds; kk++) {
+		dataset_label_pairs_iter_init_full(build->params->dataset, kinds[kk], &pairs);
+		while (dataset_label_pairs_iter_next(&pairs, &src, &dst)) {
+			guint ii = build_find_component(parent, GPOINTER_TO_UINT(g_hash_table_lookup(index, src)));
+			guint jj = build_find_component(parent, GPOINTER_TO_UINT(g_hash_table_lookup(index, dst)));
+
+			parent[MAX(ii, jj)] = MIN(ii, jj);
+		}
+	}
+
+	/* number the components in order of their first tree, which is their
+	 * root, and draw the seeds for those of more than one tree in that
+	 * order.
+	 */
+	component = g_new(guint, num_trees);
+	sizes = g_array_new(FALSE, TRUE, sizeof(guint));
+	for (guint ii = 0; ii < num_trees; ii++) {
+		guint rr = build_find_component(parent, ii);
+
+		if (rr == ii) {
+			component[ii] = sizes->len;
+			g_array_set_size(sizes, sizes->len + 1);
+		} else {
+			component[ii] = component[rr];
+		}
+		g_array_index(sizes, guint, component[ii])++;
+	}
+	components = g_ptr_array_sized_new(sizes->len);
+	for (guint cc = 0; cc < sizes->len; cc++) {
+		Build * cbuild = NULL;
+
+		if (g_array_index(sizes, guint, cc) > 1) {
+			cbuild = build_new_component(build, g_rand_int(build->rng));
+		}
+		g_ptr_array_add(components, cbuild);
+	}
+	g_array_free(sizes, TRUE);
+	for (guint ii = 0; ii < num_trees; ii++) {
+		Build * cbuild = g_ptr_array_index(components, component[ii]);
+		gconstpointer label = leaf_get_label(g_ptr_array_index(build->trees, ii));
+
+		if (cbuild != NULL) {
+			g_ptr_array_add(cbuild->component_labels, GINT_TO_POINTER(GPOINTER_TO_INT(label)));
+		}
+	}
+	for (guint kk = 0; kk < num_kinds; kk++) {
+		dataset_label_pairs_iter_init_full(build->params->dataset, kinds[kk], &pairs);
+		while (dataset_label_pairs_iter_next(&pairs, &src, &dst)) {
+			guint ii = GPOINTER_TO_UINT(g_hash_table_lookup(index, src));
+			Build * cbuild = g_ptr_array_index(components, component[ii]);
+
+			if (cbuild != NULL) {
+				g_ptr_array_add(cbuild->component_edges, src);
+				g_ptr_array_add(cbuild->component_edges, dst);
+			}
+		}
+	}
+	g_hash_table_unref(index);
+
+	build_run_components(build, components);
+
+	trees = g_ptr_array_new_full(components->len, (GDestroyNotify)tree_unref);
+	for (guint ii = 0; ii < num_trees; ii++) {
+		Build * cbuild = g_ptr_array_index(components, component[ii]);
+		Tree * root;
+
+		if (parent[ii] != ii) {
+			continue;
+		}
+		if (cbuild == NULL) {
+			root = g_ptr_array_index(build->trees, ii);
+		} else {
+			root = build_get_best_tree(cbuild);
+			/* let go of the component's params */
+			tree_set_params(root, build->params, TRUE);
+		}
+		tree_ref(root);
+		g_ptr_array_add(trees, root);
+	}
+	for (guint cc = 0; cc < components->len; cc++) {
+		Build * cbuild = g_ptr_array_index(components, cc);
+
+		if (cbuild != NULL) {
+			build->incomplete |= cbuild->incomplete;
+			g_rand_free(cbuild->rng);
+			build_free(cbuild);
+		}
+	}
+	g_ptr_array_free(components, TRUE);
+	g_free(component);
+	g_free(parent);
+	g_ptr_array_free(build->trees, TRUE);
+	build->trees = trees;
+}
+
+static guint build_find_component(guint * parent, guint ii) {
+	guint rr;
+
+	for (rr = ii; parent[rr] != rr; rr = parent[rr]) {
+	}
+	/* path compression */
+	while (parent[ii] != rr) {
+		guint next = parent[ii];
+		parent[ii] = rr;
+		ii = next;
+	}
+	return rr;
+}
+
+/* a build of one component, with its own params (and so sscache) and rng,
+ * to be filled in by build_split_components.
+ */
+static Build * build_new_component(Build * build, guint32 seed) {
+	Params * params;
+	Build * cbuild;
+
+	params = params_fork(build->params);
+	cbuild = build_new(g_rand_new_with_seed(seed), params, 1, TRUE);
+	params_unref(params);
+	build_set_batch_merges(cbuild, build->batch_merges, build->batch_min_score);
+	if (build->coarsen) {
+		if (build->equivalent_labels == NULL) {
+			build->equivalent_labels = dataset_equivalent_labels(build->params->dataset);
+		}
+		cbuild->coarsen = TRUE;
+		cbuild->equivalent_labels = g_ptr_array_ref(build->equivalent_labels);
+	}
+	cbuild->deadline = build->deadline;
+	if (build->progress != NULL) {
+		cbuild->progress = progress_ref(build->progress);
+	}
+	cbuild->component_labels = g_ptr_array_new();
+	cbuild->component_edges = g_ptr_array_new();
+	return cbuild;
+}
+
+/* the largest component on this thread, the rest on a pool. */
+static void build_run_components(Build * build, GPtrArray * components) {
+	GThreadPool * pool;
+	GAsyncQueue * done;
+	GError * error;
+	Build * largest;
+	guint num_pushed;
+
+	largest = NULL;
+	for (guint cc = 0; cc < components->len; cc++) {
+		Build * cbuild = g_ptr_array_index(components, cc);
+
+		if (cbuild != NULL && (largest == NULL ||
+				cbuild->component_labels->len > largest->component_labels->len)) {
+			largest = cbuild;
+		}
+	}
+	if (largest == NULL) {
+		return;
+	}
+
+	pool = NULL;
+	done = g_async_queue_new();
+	error = NULL;
+	if (build->num_threads > 1) {
+		pool = g_thread_pool_new((GFunc)build_restart_job, done,
+				(gint)build->num_threads, TRUE, &error);
+		if (error != NULL) {
+			g_error("g_thread_pool_new: %s", error->message);
+		}
+	}
+	num_pushed = 0;
+	for (guint cc = 0; pool != NULL && cc < components->len; cc++) {
+		Build * cbuild = g_ptr_array_index(components, cc);
+
+		if (cbuild == NULL || cbuild == largest) {
+			continue;
+		}
+		g_thread_pool_push(pool, cbuild, &error);
+		if (error != NULL) {
+			g_error("g_thread_pool_push: %s", error->message);
+		}
+		num_pushed++;
+	}
+
+	build_set_num_threads(largest, build->num_threads);
+	build_once(largest);
+	for (guint cc = 0; pool == NULL && cc < components->len; cc++) {
+		Build * cbuild = g_ptr_array_index(components, cc);
+
+		if (cbuild != NULL && cbuild != largest) {
+			build_once(cbuild);
+		}
+	}
+	for (guint pp = 0; pp < num_pushed; pp++) {
+		g_async_queue_pop(done);
+	}
+	if (pool != NULL) {
+		g_thread_pool_free(pool, FALSE, TRUE);
+	}
+	g_async_queue_unref(done);
+}
+
+
+static void build_init_trees(Build * build, Dataset * dataset) {
+	DatasetLabelIter iter;
+	gpointer label;
+
+	g_assert(build->trees == NULL);
+	if (build->component_labels != NULL) {
+		build->trees = g_ptr_array_new_full(build->component_labels->len, (GDestroyNotify)tree_unref);
+		for (guint ii = 0; ii < build->component_labels->len; ii++) {
+			Tree * leaf = leaf_new(build->params, g_ptr_array_index(build->component_labels, ii));
+			g_ptr_array_add(build->trees, leaf);
+		}
+		return;
+	}
+	build->trees = g_ptr_array_new_full(dataset_num_labels(dataset), (GDestroyNotify)tree_unref);
+	dataset_labels_iter_init(dataset, &iter);
+	while (dataset_labels_iter_next(&iter, &label)) {
+		Tree * leaf = leaf_new(build->params, label);
+		g_ptr_array_add(build->trees, leaf);
+	}
+}
+
+
+/* see coarsen_trees: the groups are found once. */
+static void build_coarsen_trees(Build * build) {
+	if (build->equivalent_labels == NULL) {
+		build->equivalent_labels = dataset_equivalent_labels(build->params->dataset);
+	}
+	coarsen_trees(build->params, build->trees, build->equivalent_labels);
+	build_compact_trees(build);
+}
+
+/* drop the trees merged away */
+static void build_compact_trees(Build * build) {
+	GPtrArray * trees;
+
+	trees = g_ptr_array_new_full(build->trees->len, (GDestroyNotify)tree_unref);
+	for (guint ii = 0; ii < build->trees->len; ii++) {
+		Tree * tree = g_ptr_array_index(build->trees, ii);
+
+		if (tree != NULL) {
+			tree_ref(tree);
+			g_ptr_array_add(trees, tree);
+		}
+	}
+	g_ptr_array_free(build->trees, TRUE);
+	build->trees = trees;
+}
+
+static void build_remove_tree(Build * build, guint ii) {
+	gpointer * tii;
+	GPtrArray * cands;
+
+	tii = &g_ptr_array_index(build->trees, ii);
+	tree_unref(*tii);
+	*tii = NULL;
+
+	if (build->candidates == NULL || ii >= build->candidates->len) {
+		return;
+	}
+	/* drop every merge involving ii now, rather than leaving them in the
+	 * heap until they are popped.
+	 */
+	cands = g_ptr_array_index(build->candidates, ii);
+	for (guint cc = 0; cc < cands->len; cc++) {
+		Merge * merge = g_ptr_array_index(cands, cc);
+		guint other = merge->ii == ii? merge->jj: merge->ii;
+
+		build_unlink_candidate(build, merge, other);
+		if (build->max_candidates > 0 &&
+				((GPtrArray *)g_ptr_array_index(build->candidates, other))->len == 0) {
+			g_array_append_val(build->exhausted, other);
+		}
+		/* otherwise, it is the merge being performed */
+		if (dheap_contains(build->merges, merge)) {
+			dheap_remove(build->merges, merge);
+			merge_free(merge);
+		}
+	}
+	g_ptr_array_free(cands, TRUE);
+	g_ptr_array_index(build->candidates, ii) = NULL;
+}
+
+static void build_link_candidate(Build * build, Merge * merge) {
+	GPtrArray * cands;
+
+	while (build->candidates->len <= MAX(merge->ii, merge->jj)) {
+		g_ptr_array_add(build->candidates, g_ptr_array_new());
+	}
+	cands = g_ptr_array_index(build->candidates, merge->ii);
+	merge->ii_index = cands->len;
+	g_ptr_array_add(cands, merge);
+	cands = g_ptr_array_index(build->candidates, merge->jj);
+	merge->jj_index = cands->len;
+	g_ptr_array_add(cands, merge);
+}
+
+/* highest score first, then highest sym_break */
+static void build_enq_candidate(Build * build, Merge * merge) {
+	build_link_candidate(build, merge);
+	dheap_enq(build->merges, -merge->score, -merge->sym_break, merge);
+}
+
+/* remove merge from the candidates of ii in O(1) */
+static void build_unlink_candidate(Build * build, Merge * merge, guint ii) {
+	GPtrArray * cands;
+	Merge * moved;
+	guint index;
+
+	cands = g_ptr_array_index(build->candidates, ii);
+	index = (merge->ii == ii? merge->ii_index: merge->jj_index);
+	g_assert(g_ptr_array_index(cands, index) == merge);
+	g_ptr_array_remove_index_fast(cands, index);
+	if (index < cands->len) {
+		moved = g_ptr_array_index(cands, index);
+		if (moved->ii == ii) {
+			moved->ii_index = index;
+		} else {
+			moved->jj_index = index;
+		}
+	}
+}
+
+/* score the merge of every pair of trees, or just the pairs given (ii, jj
+ * consecutive), against the global stats. then heapify them all at once.
+ */
+static void build_init_pairs(Build * build, const guint * pairs, guint num_pairs) {
+	BuildChunk * chunks;
+	guint num_chunks;
+	gdouble * sym_breaks;
+	Merge ** pending;
+	gpointer global_suffstats;
+
+	build->merges = dheap_new(num_pairs,
+			(DHeapFree)merge_free, G_STRUCT_OFFSET(Merge, heap_index));
+	build->candidates = g_ptr_array_sized_new(2*build->trees->len);
+
+	/* drawn up front and in order, so the merges do not depend on how the
+	 * pairs are split between threads.
+	 */
+	sym_breaks = g_new(gdouble, num_pairs);
+	for (guint pp = 0; pp < num_pairs; pp++) {
+		sym_breaks[pp] = g_rand_double(build->rng);
+	}
+	pending = g_new(Merge *, num_pairs);
+
+	chunks = build_chunks_new(build, build_init_chunk, num_pairs,
+			num_pairs >= BUILD_PARALLEL_MIN, &num_chunks);
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		chunks[cc].sym_breaks = sym_breaks;
+		chunks[cc].merges = pending;
+		chunks[cc].pairs = pairs;
+		chunks[cc].global_suffstats = suffstats_new_empty();
+	}
+	build_run_chunks(build, chunks, num_chunks);
+	global_suffstats = chunks[0].global_suffstats;
+	for (guint cc = 1; cc < num_chunks; cc++) {
+		suffstats_add(global_suffstats, chunks[cc].global_suffstats);
+		suffstats_unref(chunks[cc].global_suffstats);
+	}
+	if (pairs != NULL && (build->params->global_score || build->prune_restarts)) {
+		build_sparse_global_suffstats(build, global_suffstats, pairs, num_pairs);
+	}
+	if (build->prune_restarts) {
+		build_init_forest(build, global_suffstats);
+	}
+	g_free(sym_breaks);
+	if (build_debug) {
+		g_print("global stats: ");
+		suffstats_print(global_suffstats);
+		g_print("\n");
+	}
+
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		chunks[cc].func = build_notify_chunk;
+		chunks[cc].global_suffstats = global_suffstats;
+	}
+	build_run_chunks(build, chunks, num_chunks);
+	g_free(chunks);
+
+	for (guint pp = 0; pp < num_pairs; pp++) {
+		Merge * new_merge = pending[pp];
+
+		if (build_debug) {
+			merge_println(new_merge, "\tadd init merge: ");
+		}
+		build_link_candidate(build, new_merge);
+		dheap_append(build->merges, -new_merge->score, -new_merge->sym_break, new_merge);
+	}
+	build_heapify(build);
+	g_free(pending);
+	suffstats_unref(global_suffstats);
+}
+
+/* only the pairs with an edge or a missing cell between were scored (see
+ * islands_new), and the sparse lookup takes every cell of the rest to be
+ * a zero. so add as many as there are label pairs between two trees not
+ * among those scored. costs the number of trees and pairs, not the square
+ * of the former.
+ */
+static void build_sparse_global_suffstats(Build * build, gpointer global_suffstats, const guint * pairs, guint num_pairs) {
+	guint num_labels;
+	guint num_between;
+	gpointer between;
+
+	num_labels = 0;
+	/* label pairs between different trees: (n^2 - sum of sizes^2)/2 */
+	num_between = 0;
+	for (guint ii = 0; ii < build->trees->len; ii++) {
+		Tree * tree = g_ptr_array_index(build->trees, ii);
+
+		if (tree != NULL) {
+			guint num_leaves = tree_num_leaves(tree);
+			num_labels += num_leaves;
+			num_between -= num_leaves*num_leaves;
+		}
+	}
+	num_between += num_labels*num_labels;
+	num_between /= 2;
+	for (guint pp = 0; pp < num_pairs; pp++) {
+		num_between -= tree_num_leaves(g_ptr_array_index(build->trees, pairs[2*pp]))
+			*tree_num_leaves(g_ptr_array_index(build->trees, pairs[2*pp + 1]));
+	}
+	between = sscache_get_offblock_sparse(build->params->sscache, num_between);
+	suffstats_add(global_suffstats, between);
+	suffstats_unref(between);
+}
+
+static void build_init_chunk(BuildChunk * chunk, Build * build) {
+	guint num_trees = build->trees->len;
+	guint ii = 0;
+	guint jj = 0;
+
+	if (chunk->pairs == NULL && chunk->begin < chunk->end) {
+		/* row ii holds the num_trees-ii-1 pairs (ii, jj > ii) */
+		guint rest = chunk->begin;
+		while (rest >= num_trees - ii - 1) {
+			rest -= num_trees - ii - 1;
+			ii++;
+		}
+		jj = ii + 1 + rest;
+	}
+	for (guint pp = chunk->begin; pp < chunk->end; pp++) {
+		Tree * aa;
+		Tree * bb;
+		Merge * new_merge;
+
+		if (chunk->pairs != NULL) {
+			ii = chunk->pairs[2*pp];
+			jj = chunk->pairs[2*pp + 1];
+		}
+		g_assert(ii < num_trees);
+		g_assert(jj < num_trees);
+		aa = g_ptr_array_index(build->trees, ii);
+		bb = g_ptr_array_index(build->trees, jj);
+		/* the trees may be branches already (see build_coarsen_trees and
+		 * build_replay), so absorbs are candidates too.
+		 */
+		new_merge = merge_best(chunk->sym_breaks[pp], NULL, build->params, ii, aa, jj, bb);
+		/* the merged tree less the diagonal elements */
+		suffstats_add(chunk->global_suffstats, new_merge->ss_offblock);
+		chunk->merges[pp] = new_merge;
+		if (chunk->pairs == NULL && ++jj == num_trees) {
+			ii++;
+			jj = ii + 1;
+		}
+	}
+}
+
+static void build_notify_chunk(BuildChunk * chunk, Build * build) {
+	for (guint pp = chunk->begin; pp < chunk->end; pp++) {
+		merge_notify_pair(chunk->merges[pp], chunk->global_suffstats);
+	}
+}
+
+/* dheap_rebuild, with the subtrees shared out between the workers */
+static void build_heapify(Build * build) {
+	BuildChunk * chunks;
+	guint num_chunks;
+	guint num_roots;
+	guint first;
+
+	num_roots = 0;
+	if (build->pool != NULL && dheap_size(build->merges) >= BUILD_PARALLEL_HEAPIFY_MIN) {
+		num_roots = dheap_subtree_roots(build->merges,
+				build->num_threads*BUILD_CHUNKS_PER_THREAD, &first);
+	}
+	if (num_roots == 0) {
+		dheap_rebuild(build->merges);
+		return;
+	}
+	chunks = build_chunks_new(build, build_heapify_chunk, num_roots, TRUE, &num_chunks);
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		chunks[cc].begin += first;
+		chunks[cc].end += first;
+	}
+	build_run_chunks(build, chunks, num_chunks);
+	g_free(chunks);
+	dheap_rebuild_top(build->merges, first);
+}
+
+static void build_heapify_chunk(BuildChunk * chunk, Build * build) {
+	for (guint root = chunk->begin; root < chunk->end; root++) {
+		dheap_rebuild_subtree(build->merges, root);
+	}
+}
+
+static void build_init_merges(Build * build) {
+	guint num_trees;
+
+	g_assert(build->trees != NULL);
+	g_assert(build->merges == NULL);
+	g_assert(build->merges_data == NULL);
+	num_trees = build->trees->len;
+	if (build->max_candidates > 0) {
+		g_array_set_size(build->label_trees,
+				(guint)GPOINTER_TO_INT(dataset_get_max_label(build->params->dataset)) + 1);
+		for (guint ll = 0; ll < build->label_trees->len; ll++) {
+			g_array_index(build->label_trees, guint, ll) = G_MAXUINT;
+		}
+		g_array_set_size(build->tree_sizes, 0);
+		for (guint ii = 0; ii < num_trees; ii++) {
+			build_set_tree_labels(build, ii);
+		}
+	}
+	if (build->max_candidates > 0 && build->max_candidates < num_trees - 1) {
+		build_init_partners(build);
+		return;
+	}
+	build_init_pairs(build, NULL, (num_trees*(num_trees-1))/2);
+}
+
+/* the labels of the tree at kk are in it, for sscache_count_offblocks. */
+static void build_set_tree_labels(Build * build, guint kk) {
+	Labelset * labels = tree_get_labels(g_ptr_array_index(build->trees, kk));
+	LabelsetIter iter;
+	gpointer label;
+
+	if (build->tree_sizes->len <= kk) {
+		g_array_set_size(build->tree_sizes, kk + 1);
+	}
+	g_array_index(build->tree_sizes, guint, kk) = labelset_count(labels);
+	labelset_iter_init(&iter, labels);
+	while (labelset_iter_next(&iter, &label)) {
+		g_array_index(build->label_trees, guint, GPOINTER_TO_INT(label)) = kk;
+	}
+}
+
+/* only the pairs in the best max_candidates of either tree. */
+static void build_init_partners(Build * build) {
+	BuildChunk * chunks;
+	guint num_chunks;
+	guint num_trees;
+	guint max_cands;
+	guint * partners;
+	guint * pairs;
+	guint num_pairs;
+
+	num_trees = build->trees->len;
+	max_cands = build->max_candidates;
+	partners = g_new(guint, num_trees*max_cands);
+	chunks = build_chunks_new(build, build_partners_chunk, num_trees, TRUE, &num_chunks);
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		chunks[cc].partners = partners;
+	}
+	build_run_chunks(build, chunks, num_chunks);
+	g_free(chunks);
+
+	pairs = g_new(guint, 2*num_trees*max_cands);
+	num_pairs = 0;
+	for (guint ii = 0; ii < num_trees; ii++) {
+		for (guint pp = 0; pp < max_cands; pp++) {
+			guint jj = partners[ii*max_cands + pp];
+			gboolean dup = FALSE;
+
+			if (jj > ii) {
+				/* counted from jj's side instead */
+				for (guint qq = 0; qq < max_cands && !dup; qq++) {
+					dup = partners[jj*max_cands + qq] == ii;
+				}
+			}
+			if (!dup) {
+				pairs[2*num_pairs] = MIN(ii, jj);
+				pairs[2*num_pairs + 1] = MAX(ii, jj);
+				num_pairs++;
+			}
+		}
+	}
+	g_free(partners);
+	build_init_pairs(build, pairs, num_pairs);
+	g_free(pairs);
+}
+
+/* rank the partners of each tree by the score of their best merge; equal
+ * scores go to the lower index, so the result does not depend on the rng.
+ * the offblocks are counted, not cached, so as not to fill the sscache
+ * with all pairs of trees.
+ */
+static void build_partners_chunk(BuildChunk * chunk, Build * build) {
+	guint num_trees = build->trees->len;
+	guint max_cands = build->max_candidates;
+	DHeap * best;
+	Counts * row;
+
+	best = dheap_new(max_cands + 1, (DHeapFree)merge_free, DHEAP_NOT_INDEXED);
+	row = g_new(Counts, num_trees);
+	for (guint ii = chunk->begin; ii < chunk->end; ii++) {
+		Tree * aa = g_ptr_array_index(build->trees, ii);
+
+		sscache_count_offblocks(build->params->sscache, tree_get_labels(aa),
+				(guint *)build->label_trees->data, (guint *)build->tree_sizes->data,
+				num_trees, row);
+		for (guint jj = 0; jj < num_trees; jj++) {
+			Tree * bb = g_ptr_array_index(build->trees, jj);
+			Merge * merge;
+
+			if (jj == ii) {
+				continue;
+			}
+			merge = merge_best_offblock(0.0, NULL, build->params, ii, aa, jj, bb, &row[jj]);
+			/* worst on top */
+			dheap_enq(best, merge->score, -(gdouble)jj, merge);
+			if (dheap_size(best) > max_cands) {
+				merge_free(dheap_deq(best));
+			}
+		}
+		g_assert(dheap_size(best) == max_cands);
+		for (guint pp = 0; pp < max_cands; pp++) {
+			Merge * merge = dheap_deq(best);
+
+			/* an absorb into the partner swaps them */
+			chunk->partners[ii*max_cands + pp] = merge->ii == ii? merge->jj: merge->ii;
+			merge_free(merge);
+		}
+	}
+	g_free(row);
+	dheap_free(best);
+}
+
+/* cur->tree is at kk. trees after it are new too, and pick it up themselves. */
+static void build_add_merges(Build * build, Merge * cur, guint kk) {
+	guint ll;
+
+	g_assert(build->trees != NULL);
+	g_assert(build->merges != NULL);
+	g_assert(build->merges_data == NULL);
+	if (build->max_candidates > 0) {
+		build_set_tree_labels(build, kk);
+	}
+	for (ll = 0; ll < kk; ll++) {
+		if (g_ptr_array_index(build->trees, ll) == NULL) {
+			continue;
+		}
+		build_add_candidate(build, cur, kk, ll);
+	}
+}
+
+/* to be scored by build_score_candidates */
+static void build_add_candidate(Build * build, Merge * cur, guint kk, guint ll) {
+	g_array_append_val(build->cand_kks, kk);
+	g_array_append_val(build->cand_trees, ll);
+	g_ptr_array_add(build->cand_parents, cur);
+}
+
+/* merge each of cand_kks with each of cand_trees, and enqueue the best
+ * merge for each.
+ */
+static void build_score_candidates(Build * build) {
+	BuildChunk * chunks;
+	guint num_cands;
+	guint num_chunks;
+	Merge * new_merge;
+
+	num_cands = build->cand_trees->len;
+	/* drawn up front and in order, so the merges do not depend on how the
+	 * candidates are split between threads.
+	 */
+	g_array_set_size(build->cand_sym_breaks, num_cands);
+	for (guint cc = 0; cc < num_cands; cc++) {
+		g_array_index(build->cand_sym_breaks, gdouble, cc) = g_rand_double(build->rng);
+	}
+	g_ptr_array_set_size(build->cand_merges, (gint)num_cands);
+
+	chunks = build_chunks_new(build, build_score_chunk, num_cands,
+			num_cands >= BUILD_PARALLEL_MIN, &num_chunks);
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		chunks[cc].sym_breaks = (gdouble *)build->cand_sym_breaks->data;
+		chunks[cc].merges = (Merge **)build->cand_merges->pdata;
+		chunks[cc].kks = (guint *)build->cand_kks->data;
+		chunks[cc].trees = (guint *)build->cand_trees->data;
+		chunks[cc].parents = (Merge **)build->cand_parents->pdata;
+	}
+	build_run_chunks(build, chunks, num_chunks);
+	g_free(chunks);
+
+	if (build->max_candidates > 0) {
+		build_keep_best_candidates(build);
+		num_cands = build->cand_merges->len;
+	}
+	for (guint cc = 0; cc < num_cands; cc++) {
+		new_merge = g_ptr_array_index(build->cand_merges, cc);
+		if (build_debug) {
+			merge_println(new_merge, "\tadd merge: ");
+		}
+		build_enq_candidate(build, new_merge);
+	}
+	g_array_set_size(build->cand_kks, 0);
+	g_array_set_size(build->cand_trees, 0);
+	g_ptr_array_set_size(build->cand_parents, 0);
+}
+
+/* only reads the trees, so chunks can be scored concurrently. if
+ * max_candidates, the offblocks are counted rather than cached, a row for
+ * each kk, so only those of the merges kept end up in the sscache (see
+ * build_merge_batch).
+ */
+static void build_score_chunk(BuildChunk * chunk, Build * build) {
+	Counts * row = NULL;
+	guint row_kk = G_MAXUINT;
+
+	if (build->max_candidates > 0) {
+		row = g_new(Counts, build->trees->len);
+	}
+	for (guint cc = chunk->begin; cc < chunk->end; cc++) {
+		guint kk = chunk->kks[cc];
+		guint ll = chunk->trees[cc];
+		Tree * tkk = g_ptr_array_index(build->trees, kk);
+		Tree * tll = g_ptr_array_index(build->trees, ll);
+		gpointer offblock;
+
+		if (row == NULL) {
+			chunk->merges[cc] = merge_best(chunk->sym_breaks[cc], chunk->parents[cc],
+					build->params, kk, tkk, ll, tll);
+			continue;
+		}
+		if (kk != row_kk) {
+			sscache_count_offblocks(build->params->sscache, tree_get_labels(tkk),
+					(guint *)build->label_trees->data, (guint *)build->tree_sizes->data,
+					build->trees->len, row);
+			row_kk = kk;
+		}
+		/* the merges outlive the row */
+		offblock = suffstats_copy(&row[ll]);
+		chunk->merges[cc] = merge_best_offblock(chunk->sym_breaks[cc], chunk->parents[cc],
+				build->params, kk, tkk, ll, tll, offblock);
+		suffstats_unref(offblock);
+	}
+	g_free(row);
+}
+
+/* cut the cand_merges of each of cand_kks down to the best max_candidates. */
+static void build_keep_best_candidates(Build * build) {
+	GPtrArray * cands = build->cand_merges;
+	DHeap * best;
+	guint num_kept;
+	guint cc;
+
+	best = dheap_new(build->max_candidates + 1, (DHeapFree)merge_free, DHEAP_NOT_INDEXED);
+	num_kept = 0;
+	cc = 0;
+	while (cc < cands->len) {
+		guint kk = g_array_index(build->cand_kks, guint, cc);
+
+		/* the candidates of each kk are consecutive */
+		for (; cc < cands->len && g_array_index(build->cand_kks, guint, cc) == kk; cc++) {
+			Merge * merge = g_ptr_array_index(cands, cc);
+
+			/* worst on top */
+			dheap_enq(best, merge->score, merge->sym_break, merge);
+			if (dheap_size(best) > build->max_candidates) {
+				merge_free(dheap_deq(best));
+			}
+		}
+		/* cc is past those kept so far */
+		while (dheap_size(best) > 0) {
+			g_ptr_array_index(cands, num_kept++) = dheap_deq(best);
+		}
+	}
+	g_ptr_array_set_size(cands, (gint)num_kept);
+	dheap_free(best);
+}
+
+/* rescan each tree left without merges against all the others. */
+static void build_refill_candidates(Build * build) {
+	for (guint ee = 0; ee < build->exhausted->len; ee++) {
+		guint ll = g_array_index(build->exhausted, guint, ee);
+		Tree * tll = g_ptr_array_index(build->trees, ll);
+
+		if (tll == NULL || ((GPtrArray *)g_ptr_array_index(build->candidates, ll))->len > 0) {
+			/* merged away, or picked up a merge since */
+			continue;
+		}
+		for (guint mm = 0; mm < build->trees->len; mm++) {
+			if (mm == ll || g_ptr_array_index(build->trees, mm) == NULL) {
+				continue;
+			}
+			build_add_candidate(build, NULL, ll, mm);
+		}
+		build_score_candidates(build);
+	}
+	g_array_set_size(build->exhausted, 0);
+}
+
+/* split num_items between the workers if parallel, else one chunk for the
+ * calling thread.
+ */
+static BuildChunk * build_chunks_new(Build * build, BuildChunkFunc func, guint num_items, gboolean parallel, guint * num_chunks) {
+	BuildChunk * chunks;
+
+	*num_chunks = 1;
+	if (parallel && build->pool != NULL && num_items > 1) {
+		*num_chunks = MIN(num_items, build->num_threads*BUILD_CHUNKS_PER_THREAD);
+	}
+	chunks = g_new0(BuildChunk, *num_chunks);
+	for (guint cc = 0; cc < *num_chunks; cc++) {
+		chunks[cc].func = func;
+		chunks[cc].begin = (guint)(((guint64)cc*num_items)/ *num_chunks);
+		chunks[cc].end = (guint)(((guint64)(cc+1)*num_items)/ *num_chunks);
+	}
+	return chunks;
+}
+
+/* each chunk writes only its own items, so they may run concurrently. */
+static void build_run_chunks(Build * build, BuildChunk * chunks, guint num_chunks) {
+	GError * error;
+
+	if (num_chunks == 1) {
+		chunks[0].func(&chunks[0], build);
+		return;
+	}
+	error = NULL;
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		g_thread_pool_push(build->pool, &chunks[cc], &error);
+		if (error != NULL) {
+			g_error("g_thread_pool_push: %s", error->message);
+		}
+	}
+	/* wait for all chunks to be done */
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		g_async_queue_pop(build->chunks_done);
+	}
+}
+
+static void build_chunk_job(BuildChunk * chunk, Build * build) {
+	chunk->func(chunk, build);
+	g_async_queue_push(build->chunks_done, chunk);
+}
+
+static void build_fini_merges(Build * build) {
+	return;
+}
+
+static void build_sparse_init_merges(Build * build) {
+	Islands * islands;
+	guint * pairs;
+	guint num_pairs;
+
+	g_assert(build->trees != NULL);
+	g_assert(build->merges == NULL);
+	g_assert(build->merges_data == NULL);
+
+	if (build->component_edges != NULL) {
+		islands = islands_new_from_edges(build->component_edges, build->trees);
+	} else {
+		islands = islands_new(build->params->dataset, build->trees);
+	}
+	build->merges_data = islands;
+	pairs = islands_get_edges(islands, &num_pairs);
+	build_init_pairs(build, pairs, num_pairs);
+	g_free(pairs);
+}
+
+/* as build_add_merges, the trees after kk pick it up as a neighbour. */
+static void build_sparse_add_merges(Build * build, Merge * cur, guint kk) {
+	Islands * islands;
+	GArray * neigh;
+	guint ll;
+
+	g_assert(build->trees != NULL);
+	g_assert(build->merges != NULL);
+	g_assert(build->merges_data != NULL);
+	islands = build->merges_data;
+
+	islands_merge(islands, kk, cur->ii, cur->jj);
+
+	neigh = islands_get_neigh(islands, kk);
+	for (guint xx = 0; neigh != NULL && xx < neigh->len; xx++) {
+		ll = g_array_index(neigh, guint, xx);
+		if (ll > kk || g_ptr_array_index(build->trees, ll) == NULL) {
+			continue;
+		}
+		build_add_candidate(build, cur, kk, ll);
+	}
+}
+
+static void build_sparse_fini_merges(Build * build) {
+	islands_free(build->merges_data);
+	build->merges_data = NULL;
+}
+
+/* carry out the disjoint merges in batch, best first. */
+static void build_merge_batch(Build * build, GPtrArray * batch) {
+	Merge * cur;
+	guint64 * print;
+	guint first;
+
+	/* out of the heap first, so build_remove_tree leaves them be */
+	for (guint bb = 0; bb < batch->len; bb++) {
+		cur = g_ptr_array_index(batch, bb);
+		if (dheap_contains(build->merges, cur)) {
+			dheap_remove(build->merges, cur);
+		}
+		build_log_merge(build, cur);
+		if (build->forest_between != NULL) {
+			build->forest_logprob += cur->tree_score;
+			suffstats_sub(build->forest_between, cur->ss_offblock);
+			build->forest_size--;
+			build_record_forest(build);
+		}
+		print = NULL;
+		if (build_fingerprinting(build)) {
+			print = fingerprints_merge(build->fingerprints, cur->kind,
+					g_ptr_array_index(build->trees, cur->ii),
+					g_ptr_array_index(build->trees, cur->jj));
+		}
+		if (build->max_candidates > 0) {
+			/* counted by build_score_chunk, so not yet cached */
+			sscache_put_offblock(build->params->sscache,
+					tree_get_labels(g_ptr_array_index(build->trees, cur->ii)),
+					tree_get_labels(g_ptr_array_index(build->trees, cur->jj)),
+					cur->ss_offblock);
+		}
+		merge_materialize(cur,
+				g_ptr_array_index(build->trees, cur->ii),
+				g_ptr_array_index(build->trees, cur->jj));
+		if (print != NULL) {
+			fingerprints_add_tree(build->fingerprints, cur->tree, print);
+		}
+	}
+	for (guint bb = 0; bb < batch->len; bb++) {
+		cur = g_ptr_array_index(batch, bb);
+		build_remove_tree(build, cur->ii);
+		build_remove_tree(build, cur->jj);
+	}
+	first = build->trees->len;
+	for (guint bb = 0; bb < batch->len; bb++) {
+		cur = g_ptr_array_index(batch, bb);
+		g_ptr_array_add(build->trees, cur->tree);
+		tree_ref(cur->tree);
+	}
+	for (guint bb = 0; bb < batch->len; bb++) {
+		build->add_merges(build, g_ptr_array_index(batch, bb), first + bb);
+	}
+	if (batch->len > 1 && build->max_candidates == 0) {
+		build_fill_batch_offblocks(build, first);
+	}
+	build_score_candidates(build);
+	build_refill_candidates(build);
+}
+
+static void build_log_merge(Build * build, Merge * merge) {
+	CheckpointMerge entry;
+
+	entry.aa = GPOINTER_TO_INT(labelset_any_label(tree_get_labels(
+				g_ptr_array_index(build->trees, merge->ii))));
+	entry.bb = GPOINTER_TO_INT(labelset_any_label(tree_get_labels(
+				g_ptr_array_index(build->trees, merge->jj))));
+	entry.kind = merge->kind;
+	g_array_append_val(build->merge_log, entry);
+}
+
+/* the sscache works out the offblock of two trees from those of one with
+ * the halves of the other, which the greedy build has always seen before.
+ * not so for two trees new in the same batch: so, from those between their
+ * halves, fill in the later one's halves with the earlier one.
+ */
+static void build_fill_batch_offblocks(Build * build, guint first) {
+	SSCache * sscache = build->params->sscache;
+	Labelset * empty;
+
+	empty = labelset_new(build->params->dataset);
+	for (guint cc = 0; cc < build->cand_trees->len; cc++) {
+		guint ll = g_array_index(build->cand_trees, guint, cc);
+		Tree * tkk;
+		Tree * tll;
+
+		if (ll < first) {
+			continue;
+		}
+		tkk = g_ptr_array_index(build->trees, g_array_index(build->cand_kks, guint, cc));
+		tll = g_ptr_array_index(build->trees, ll);
+		sscache_get_offblock(sscache, tree_get_merge_left(tkk), empty,
+				tree_get_merge_left(tll), tree_get_merge_right(tll));
+		sscache_get_offblock(sscache, tree_get_merge_right(tkk), empty,
+				tree_get_merge_left(tll), tree_get_merge_right(tll));
+	}
+	labelset_unref(empty);
+}
+
+/* the merges that are the best candidate of both their trees, and score
+ * at least batch_min_score, best first. the best merge in the heap is
+ * among them, unless it scores less.
+ */
+static void build_find_batch(Build * build, GPtrArray * batch) {
+	BuildChunk * chunks;
+	guint num_chunks;
+	guint num_trees;
+	Merge ** best;
+
+	num_trees = build->candidates->len;
+	best = g_new(Merge *, num_trees);
+	chunks = build_chunks_new(build, build_best_chunk, num_trees,
+			num_trees >= BUILD_PARALLEL_MIN, &num_chunks);
+	for (guint cc = 0; cc < num_chunks; cc++) {
+		chunks[cc].merges = best;
+	}
+	build_run_chunks(build, chunks, num_chunks);
+	g_free(chunks);
+
+	for (guint ii = 0; ii < num_trees; ii++) {
+		Merge * merge = best[ii];
+
+		if (merge != NULL && merge->ii == ii && best[merge->jj] == merge
+				&& merge->score >= build->batch_min_score) {
+			g_ptr_array_add(batch, merge);
+		}
+	}
+	g_free(best);
+	g_ptr_array_sort(batch, build_cmp_batch);
+}
+
+/* the best candidate of each tree, in heap order */
+static void build_best_chunk(BuildChunk * chunk, Build * build) {
+	for (guint ii = chunk->begin; ii < chunk->end; ii++) {
+		GPtrArray * cands = g_ptr_array_index(build->candidates, ii);
+		Merge * best = NULL;
+
+		for (guint cc = 0; cands != NULL && cc < cands->len; cc++) {
+			Merge * merge = g_ptr_array_index(cands, cc);
+
+			if (best == NULL || merge_cmp_neg_score(merge, best) < 0) {
+				best = merge;
+			}
+		}
+		chunk->merges[ii] = best;
+	}
+}
+
+static gint build_cmp_batch(gconstpointer paa, gconstpointer pbb) {
+	return merge_cmp_neg_score(*(Merge * const *)paa, *(Merge * const *)pbb);
+}
+
+static void build_flatten_trees(Build * build, gboolean fill) {
+	/* we've agglomerated as much as we can by merging,
+	 * but in the sparse case, we might have more than one connected
+	 * component--so just connect them in a rose tree
+	 */
+	Tree * new_root;
+	Tree * child;
+	guint num_children;
+
+	/* stopped early (or replayed), the sscache need not hold the offblock
+	 * of the root so far with the next child (nor, if sparse, can it fall
+	 * back to none), so count just that one from the cells around the
+	 * child if fill is set: the degree of its labels, not the forest.
+	 */
+	new_root = branch_new(build->params);
+	num_children = 0;
+	for (guint ii = 0; ii < build->trees->len; ii++) {
+		child = g_ptr_array_index(build->trees, ii);
+		if (child == NULL) {
+			continue;
+		}
+		if (fill && num_children > 0) {
+			sscache_get_offblock_direct(build->params->sscache,
+					tree_get_labels(new_root), tree_get_labels(child));
+		}
+		branch_add_child(new_root, child);
+		build_remove_tree(build, ii);
+		num_children++;
+	}
+	g_assert(num_children != 0);
+	if (num_children == 1) {
+		tree_ref(child);
+		tree_unref(new_root);
+		g_ptr_array_index(build->trees, 0) = child;
+	} else {
+		g_ptr_array_index(build->trees, 0) = new_root;
+	}
+}
+
+
+static void build_extract_best_tree(Build * build, gboolean stopped) {
+	CheckpointLog log;
+	Tree * root;
+
+	g_assert(build->trees != NULL);
+
+	root = g_ptr_array_index(build->trees, 0);
+	g_assert(root != NULL);
+	log.restart = build->cur_restart;
+	log.stopped = stopped;
+	log.merges = build->merge_log;
+	build_offer_best_tree(build, root, &log);
+}
+
+/* log, of the merges that built root, must not change after. */
+static void build_offer_best_tree(Build * build, Tree * root, const CheckpointLog * log) {
+	GPtrArray * best = build->best_trees;
+	guint pos;
+
+	/* after any as good, so ties go to the earlier restart */
+	for (pos = best->len; pos > 0; pos--) {
+		if (tree_get_logprob(g_ptr_array_index(best, pos-1)) >= tree_get_logprob(root)) {
+			break;
+		}
+	}
+	if (pos >= build->num_best_trees) {
+		return;
+	}
+	if (pos == 0 && best->len > 0 && build->verbose) {
+		g_print("better(%d): ", log->restart);
+		tree_println(root, "");
+	}
+	if (best->len == build->num_best_trees) {
+		g_ptr_array_remove_index(best, best->len-1);
+		g_ptr_array_remove_index(build->best_logs, best->len);
+	}
+	g_ptr_array_add(best, NULL);
+	g_ptr_array_add(build->best_logs, NULL);
+	for (guint ii = best->len-1; ii > pos; ii--) {
+		g_ptr_array_index(best, ii) = g_ptr_array_index(best, ii-1);
+		g_ptr_array_index(build->best_logs, ii) = g_ptr_array_index(build->best_logs, ii-1);
+	}
+	g_ptr_array_index(best, pos) = root;
+	tree_ref(root);
+	g_ptr_array_index(build->best_logs, pos) = checkpoint_log_new(log->restart, log->stopped, log->merges);
+	if (tree_get_params(root) != build->params) {
+		/* from a parallel restart: let go of its params */
+		tree_set_params(root, build->params, TRUE);
+	}
+	if (best->len == build->num_best_trees) {
+		/* a restart must beat the worst tree kept to be kept */
+		g_mutex_lock(&build->best_lock);
+		build->best_logprob = tree_get_logprob(g_ptr_array_index(best, best->len-1));
+		g_mutex_unlock(&build->best_lock);
+	}
+}
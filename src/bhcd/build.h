@@ -9,11 +9,60 @@
 struct Build_t;
 typedef struct Build_t Build;
 
+/* a snapshot of a build under way, for build_set_progress */
+typedef struct {
+	/* the restart, and its merges done and (at most) left */
+	guint		restart;
+	guint		num_merges;
+	guint		num_left;
+	/* the candidate merges in the heap */
+	guint		heap_size;
+	/* the offblocks cached by the restart, their lookups and hits */
+	guint		sscache_entries;
+	guint		sscache_lookups;
+	guint		sscache_hits;
+	/* lookups answered from the lnbeta tables, over all restarts */
+	guint		lnbeta_hits;
+	/* seconds since build_run began, the merges per second since the
+	 * restart last reported, and the resident set size in bytes
+	 */
+	gdouble		elapsed;
+	gdouble		merges_per_sec;
+	gsize		rss;
+} BuildProgress;
+
+typedef void (*BuildProgressFunc)(const BuildProgress *, gpointer);
+
 Build * build_new(GRand *rng, Params * params, guint num_restarts, gboolean sparse);
 void build_free(Build *);
 void build_once(Build *build);
+void build_begin(Build * build);
+guint build_step(Build * build, guint max_merges);
+GPtrArray * build_get_trees(Build * build);
+guint build_get_num_merges(Build * build);
+void build_finish(Build * build);
 void build_run(Build * build);
 Tree * build_get_best_tree(Build * build);
+void build_set_num_best_trees(Build * build, guint num_trees);
+GPtrArray * build_get_best_trees(Build * build);
 void build_set_verbose(Build * build, gboolean value);
+void build_set_num_threads(Build * build, guint num_threads);
+void build_set_max_candidates(Build * build, guint max_candidates);
+void build_set_batch_merges(Build * build, gboolean value, gdouble min_score);
+void build_set_coarsen(Build * build, gboolean value);
+void build_set_split_components(Build * build, gboolean value);
+void build_set_subsample(Build * build, guint num_sample);
+void build_set_restart_threads(Build * build, guint num_threads);
+void build_set_time_budget(Build * build, gdouble seconds);
+gboolean build_get_incomplete(Build * build);
+void build_set_heuristic_prune(Build * build, gboolean value);
+guint build_get_num_pruned(Build * build);
+gdouble build_get_pruned_saving(Build * build);
+void build_set_adaptive_restarts(Build * build, guint patience, guint max_repeats, gboolean skip_repeats);
+guint build_get_num_run(Build * build);
+guint build_get_num_repeats(Build * build);
+void build_set_checkpoint(Build * build, const gchar * fname, gdouble interval);
+void build_set_resume(Build * build, const gchar * fname);
+void build_set_progress(Build * build, gdouble interval, BuildProgressFunc func, gpointer user_data);
 
 #endif /*BUILD_H*/
@@ -0,0 +1,401 @@
+#include <string.h>
+#include <glib/gstdio.h>
+#include "checkpoint.h"
+#include "islands.h"
+#include "sscache.h"
+#include "tokens.h"
+#include "util.h"
+
+/* writes checkpoints to fname every interval seconds (see
+ * build_set_checkpoint), on a thread of its own. next is when the next is
+ * due; busy is set from when one is claimed until it is written.
+ */
+struct CheckpointWriter_t {
+	gchar * fname;
+	gdouble interval;
+	gint64 next;
+	GThreadPool * pool;
+	gint busy;
+};
+
+static void checkpoint_save_io(Checkpoint * checkpoint, GIOChannel * io);
+static void checkpoint_save_log(GIOChannel * io, Dataset * dataset, GArray * log);
+static void checkpoint_save_label(GIOChannel * io, Dataset * dataset, gint32 label);
+static GArray * checkpoint_load_log(Tokens * toks, Dataset * dataset);
+static gint32 checkpoint_load_label(Tokens * toks, Dataset * dataset);
+static void checkpoint_replay_fill_init(Params * params, GPtrArray * trees, Islands * islands);
+static void checkpoint_replay_fill(Params * params, GPtrArray * trees, Islands * islands, guint kk);
+static void checkpoint_replay_fill_pair(Params * params, Tree * tree, Tree * other);
+static void checkpoint_writer_job(Checkpoint * checkpoint, CheckpointWriter * writer);
+
+
+Checkpoint * checkpoint_new(Dataset * dataset, guint num_restarts, guint restart, guint32 seed) {
+	Checkpoint * checkpoint;
+
+	checkpoint = g_new(Checkpoint, 1);
+	checkpoint->dataset = dataset;
+	dataset_ref(checkpoint->dataset);
+	checkpoint->num_labels = dataset_num_labels(dataset);
+	checkpoint->num_restarts = num_restarts;
+	checkpoint->restart = restart;
+	checkpoint->seed = seed;
+	checkpoint->current = NULL;
+	checkpoint->best_logs = g_ptr_array_new_with_free_func((GDestroyNotify)checkpoint_log_free);
+	return checkpoint;
+}
+
+void checkpoint_free(Checkpoint * checkpoint) {
+	if (checkpoint->current != NULL) {
+		g_array_unref(checkpoint->current);
+	}
+	g_ptr_array_free(checkpoint->best_logs, TRUE);
+	dataset_unref(checkpoint->dataset);
+	g_free(checkpoint);
+}
+
+/* merges is referenced, not copied: it must not change after. */
+CheckpointLog * checkpoint_log_new(guint restart, gboolean stopped, GArray * merges) {
+	CheckpointLog * log;
+
+	log = g_slice_new(CheckpointLog);
+	log->restart = restart;
+	log->stopped = stopped;
+	log->merges = g_array_ref(merges);
+	return log;
+}
+
+void checkpoint_log_free(CheckpointLog * log) {
+	g_array_unref(log->merges);
+	g_slice_free(CheckpointLog, log);
+}
+
+void checkpoint_add_best(Checkpoint * checkpoint, const CheckpointLog * log) {
+	g_ptr_array_add(checkpoint->best_logs,
+			checkpoint_log_new(log->restart, log->stopped, log->merges));
+}
+
+/* written to a temporary file first, so fname always holds a whole
+ * checkpoint.
+ */
+void checkpoint_save(Checkpoint * checkpoint, const gchar * fname) {
+	gchar * tmp_fname;
+
+	tmp_fname = g_strconcat(fname, ".tmp", NULL);
+	io_writefile(tmp_fname, (IOFunc)checkpoint_save_io, checkpoint);
+	if (g_rename(tmp_fname, fname) != 0) {
+		g_error("rename `%s' to `%s' failed", tmp_fname, fname);
+	}
+	g_free(tmp_fname);
+}
+
+static void checkpoint_save_io(Checkpoint * checkpoint, GIOChannel * io) {
+	io_printf(io, "checkpoint [\n");
+	io_printf(io, "\tlabels %u\n", checkpoint->num_labels);
+	io_printf(io, "\trestarts %u\n", checkpoint->num_restarts);
+	io_printf(io, "\trestart %u\n", checkpoint->restart);
+	io_printf(io, "\tseed %u\n", checkpoint->seed);
+	if (checkpoint->current != NULL) {
+		io_printf(io, "\tcurrent");
+		checkpoint_save_log(io, checkpoint->dataset, checkpoint->current);
+	}
+	for (guint ii = 0; ii < checkpoint->best_logs->len; ii++) {
+		CheckpointLog * log = g_ptr_array_index(checkpoint->best_logs, ii);
+
+		io_printf(io, "\tbest %u%s", log->restart, log->stopped? " stopped": "");
+		checkpoint_save_log(io, checkpoint->dataset, log->merges);
+	}
+	io_printf(io, "]\n");
+}
+
+/* a merge per line: the labels of each tree, and j(oin) or a(bsorb).
+ * quarks depend on the order strings were first seen, so the labels are
+ * written as strings, as tree_io does.
+ */
+static void checkpoint_save_log(GIOChannel * io, Dataset * dataset, GArray * log) {
+	io_printf(io, " [\n");
+	for (guint ii = 0; ii < log->len; ii++) {
+		CheckpointMerge * merge = &g_array_index(log, CheckpointMerge, ii);
+
+		io_printf(io, "\t\t");
+		checkpoint_save_label(io, dataset, merge->aa);
+		checkpoint_save_label(io, dataset, merge->bb);
+		io_printf(io, "%c\n", merge->kind == MERGE_JOIN? 'j': 'a');
+	}
+	io_printf(io, "\t]\n");
+}
+
+static void checkpoint_save_label(GIOChannel * io, Dataset * dataset, gint32 label) {
+	io_printf(io, "\"%s\" ", dataset_label_to_string(dataset, GINT_TO_POINTER(label)));
+}
+
+/* the labels of the merges must be those of dataset. */
+Checkpoint * checkpoint_load(Dataset * dataset, const gchar * fname) {
+	Checkpoint * checkpoint;
+	Tokens * toks;
+	gchar * next;
+
+	checkpoint = checkpoint_new(dataset, 0, 0, 0);
+	checkpoint->num_labels = 0;
+	toks = tokens_open(fname);
+	tokens_expect(toks, "checkpoint");
+	tokens_expect(toks, "[");
+	while (!tokens_peek_test(toks, "]")) {
+		next = tokens_next(toks);
+		if (strcmp(next, "labels") == 0) {
+			checkpoint->num_labels = (guint)tokens_next_int(toks);
+		} else if (strcmp(next, "restarts") == 0) {
+			checkpoint->num_restarts = (guint)tokens_next_int(toks);
+		} else if (strcmp(next, "restart") == 0) {
+			checkpoint->restart = (guint)tokens_next_int(toks);
+		} else if (strcmp(next, "seed") == 0) {
+			checkpoint->seed = (guint32)tokens_next_int(toks);
+		} else if (strcmp(next, "current") == 0) {
+			checkpoint->current = checkpoint_load_log(toks, dataset);
+		} else if (strcmp(next, "best") == 0) {
+			guint restart = (guint)tokens_next_int(toks);
+			gboolean stopped = FALSE;
+			GArray * merges;
+
+			if (tokens_peek_test(toks, "stopped")) {
+				tokens_expect(toks, "stopped");
+				stopped = TRUE;
+			}
+			merges = checkpoint_load_log(toks, dataset);
+			g_ptr_array_add(checkpoint->best_logs,
+					checkpoint_log_new(restart, stopped, merges));
+			g_array_unref(merges);
+		} else {
+			tokens_fail(toks, "unexpected token `%s'", next);
+		}
+		g_free(next);
+	}
+	tokens_expect(toks, "]");
+	tokens_expect_end(toks);
+	tokens_close(toks);
+	return checkpoint;
+}
+
+static GArray * checkpoint_load_log(Tokens * toks, Dataset * dataset) {
+	GArray * log;
+	gchar * kind;
+
+	log = g_array_new(FALSE, FALSE, sizeof(CheckpointMerge));
+	tokens_expect(toks, "[");
+	while (!tokens_peek_test(toks, "]")) {
+		CheckpointMerge merge;
+
+		merge.kind = MERGE_JOIN;
+		merge.aa = checkpoint_load_label(toks, dataset);
+		merge.bb = checkpoint_load_label(toks, dataset);
+		kind = tokens_next(toks);
+		if (strcmp(kind, "j") == 0) {
+			merge.kind = MERGE_JOIN;
+		} else if (strcmp(kind, "a") == 0) {
+			merge.kind = MERGE_ABSORB;
+		} else {
+			tokens_fail(toks, "unexpected merge kind `%s'", kind);
+		}
+		g_free(kind);
+		g_array_append_val(log, merge);
+	}
+	tokens_expect(toks, "]");
+	return log;
+}
+
+static gint32 checkpoint_load_label(Tokens * toks, Dataset * dataset) {
+	gchar * slabel;
+	gint32 label;
+
+	slabel = strip_quotes(tokens_next_quoted(toks));
+	if (!dataset_label_exists(dataset, slabel)) {
+		tokens_fail(toks, "unknown label `%s'", slabel);
+	}
+	label = GPOINTER_TO_INT(dataset_label_lookup(dataset, slabel));
+	g_free(slabel);
+	return label;
+}
+
+/* redo the merges of log on trees, those a build starts from (see
+ * build_init_trees and coarsen_trees), filling in the sscache as the
+ * greedy build would have. each merge names its trees by any of their
+ * labels. the trees merged away are left NULL, and the new ones added at
+ * the end.
+ */
+void checkpoint_replay(Params * params, GPtrArray * trees, GArray * log) {
+	GHashTable * index;
+	Islands * islands;
+
+	index = g_hash_table_new(NULL, NULL);
+	for (guint ii = 0; ii < trees->len; ii++) {
+		Tree * tree = g_ptr_array_index(trees, ii);
+
+		g_hash_table_insert(index, labelset_any_label(tree_get_labels(tree)),
+				GUINT_TO_POINTER(ii));
+	}
+	islands = NULL;
+	if (params->sparse) {
+		islands = islands_new(params->dataset, trees);
+	}
+	checkpoint_replay_fill_init(params, trees, islands);
+	for (guint mm = 0; mm < log->len; mm++) {
+		CheckpointMerge * entry = &g_array_index(log, CheckpointMerge, mm);
+		gpointer pii, pjj;
+		guint ii, jj, kk;
+		Tree * tree;
+
+		if (!g_hash_table_lookup_extended(index, GINT_TO_POINTER(entry->aa), NULL, &pii)
+				|| !g_hash_table_lookup_extended(index, GINT_TO_POINTER(entry->bb), NULL, &pjj)
+				|| pii == pjj) {
+			g_error("merge %u of checkpoint (%d, %d) does not match the dataset",
+					mm, entry->aa, entry->bb);
+		}
+		ii = GPOINTER_TO_UINT(pii);
+		jj = GPOINTER_TO_UINT(pjj);
+		tree = merge_tree_new(params, entry->kind,
+				g_ptr_array_index(trees, ii), g_ptr_array_index(trees, jj));
+		tree_unref(g_ptr_array_index(trees, ii));
+		g_ptr_array_index(trees, ii) = NULL;
+		tree_unref(g_ptr_array_index(trees, jj));
+		g_ptr_array_index(trees, jj) = NULL;
+		kk = trees->len;
+		g_ptr_array_add(trees, tree);
+
+		g_hash_table_remove(index, GINT_TO_POINTER(entry->aa));
+		g_hash_table_remove(index, GINT_TO_POINTER(entry->bb));
+		g_hash_table_insert(index, labelset_any_label(tree_get_labels(tree)),
+				GUINT_TO_POINTER(kk));
+		if (islands != NULL) {
+			islands_merge(islands, kk, ii, jj);
+		}
+		checkpoint_replay_fill(params, trees, islands, kk);
+	}
+	if (islands != NULL) {
+		islands_free(islands);
+	}
+	g_hash_table_unref(index);
+}
+
+/* fill in the offblocks of the initial pairs, as build_init_pairs would
+ * score them: each lookup goes the same way, so the sparse cache falls
+ * back to the same empty offblocks as the build that wrote the log.
+ */
+static void checkpoint_replay_fill_init(Params * params, GPtrArray * trees, Islands * islands) {
+	guint * edges;
+	guint num_edges;
+
+	if (islands == NULL) {
+		for (guint ii = 0; ii < trees->len; ii++) {
+			for (guint jj = ii + 1; jj < trees->len; jj++) {
+				checkpoint_replay_fill_pair(params, g_ptr_array_index(trees, ii),
+						g_ptr_array_index(trees, jj));
+			}
+		}
+		return;
+	}
+	edges = islands_get_edges(islands, &num_edges);
+	for (guint ee = 0; ee < num_edges; ee++) {
+		checkpoint_replay_fill_pair(params,
+				g_ptr_array_index(trees, edges[2*ee]),
+				g_ptr_array_index(trees, edges[2*ee + 1]));
+	}
+	g_free(edges);
+}
+
+/* fill in the offblocks of the tree at kk with the others, or with its
+ * neighbours in islands if not NULL, as scoring its merges would.
+ */
+static void checkpoint_replay_fill(Params * params, GPtrArray * trees, Islands * islands, guint kk) {
+	Tree * tree = g_ptr_array_index(trees, kk);
+	GArray * neigh;
+
+	if (islands == NULL) {
+		for (guint ll = 0; ll < trees->len; ll++) {
+			checkpoint_replay_fill_pair(params, tree, g_ptr_array_index(trees, ll));
+		}
+		return;
+	}
+	neigh = islands_get_neigh(islands, kk);
+	for (guint xx = 0; neigh != NULL && xx < neigh->len; xx++) {
+		checkpoint_replay_fill_pair(params, tree,
+				g_ptr_array_index(trees, g_array_index(neigh, guint, xx)));
+	}
+}
+
+static void checkpoint_replay_fill_pair(Params * params, Tree * tree, Tree * other) {
+	if (other == NULL || other == tree) {
+		return;
+	}
+	sscache_get_offblock(params->sscache,
+			tree_get_merge_left(tree), tree_get_merge_right(tree),
+			tree_get_merge_left(other), tree_get_merge_right(other));
+}
+
+CheckpointWriter * checkpoint_writer_new(const gchar * fname, gdouble interval) {
+	CheckpointWriter * writer;
+
+	g_assert(interval >= 0.0);
+	writer = g_new(CheckpointWriter, 1);
+	writer->fname = g_strdup(fname);
+	writer->interval = interval;
+	writer->next = 0;
+	writer->pool = NULL;
+	writer->busy = 0;
+	return writer;
+}
+
+/* after the last checkpoint is written */
+void checkpoint_writer_free(CheckpointWriter * writer) {
+	checkpoint_writer_wait(writer);
+	g_free(writer->fname);
+	g_free(writer);
+}
+
+/* the first is due interval seconds from now */
+void checkpoint_writer_start(CheckpointWriter * writer) {
+	writer->next = g_get_monotonic_time() + (gint64)(writer->interval*G_USEC_PER_SEC);
+}
+
+gboolean checkpoint_writer_due(CheckpointWriter * writer) {
+	return g_get_monotonic_time() >= writer->next;
+}
+
+/* whether the writer is free to take a checkpoint, which must then be
+ * given to checkpoint_writer_push; FALSE while it is writing the last.
+ */
+gboolean checkpoint_writer_claim(CheckpointWriter * writer) {
+	return g_atomic_int_compare_and_exchange(&writer->busy, 0, 1);
+}
+
+/* write checkpoint, which is taken, on the writer's thread. */
+void checkpoint_writer_push(CheckpointWriter * writer, Checkpoint * checkpoint) {
+	GError * error;
+
+	g_assert(g_atomic_int_get(&writer->busy) == 1);
+	error = NULL;
+	if (writer->pool == NULL) {
+		writer->pool = g_thread_pool_new((GFunc)checkpoint_writer_job, writer,
+				1, TRUE, &error);
+		if (error != NULL) {
+			g_error("g_thread_pool_new: %s", error->message);
+		}
+	}
+	g_thread_pool_push(writer->pool, checkpoint, &error);
+	if (error != NULL) {
+		g_error("g_thread_pool_push: %s", error->message);
+	}
+	checkpoint_writer_start(writer);
+}
+
+static void checkpoint_writer_job(Checkpoint * checkpoint, CheckpointWriter * writer) {
+	checkpoint_save(checkpoint, writer->fname);
+	checkpoint_free(checkpoint);
+	g_atomic_int_set(&writer->busy, 0);
+}
+
+/* until the last checkpoint is written */
+void checkpoint_writer_wait(CheckpointWriter * writer) {
+	if (writer->pool != NULL) {
+		g_thread_pool_free(writer->pool, FALSE, TRUE);
+		writer->pool = NULL;
+	}
+}
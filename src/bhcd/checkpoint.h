@@ -0,0 +1,63 @@
+#ifndef	CHECKPOINT_H
+#define	CHECKPOINT_H
+
+#include <glib.h>
+#include "merge.h"
+#include "dataset.h"
+
+/* one merge of a build, naming each tree by any of its labels (see
+ * labelset_any_label), so it can be redone from the same initial trees.
+ * the labels are quarks here, but saved as strings.
+ */
+typedef struct {
+	gint32		aa;
+	gint32		bb;
+	MergeKind	kind;
+} CheckpointMerge;
+
+/* the merges of a restart, and whether it stopped with merges left (so
+ * its trees were hung from the root with their offblocks filled in).
+ */
+typedef struct {
+	guint		restart;
+	gboolean	stopped;
+	GArray *	merges;
+} CheckpointLog;
+
+/* the progress of build_run: the merges of each best tree so far, and of
+ * the restart under way.
+ */
+typedef struct {
+	/* whose labels the merges name */
+	Dataset *	dataset;
+	guint		num_labels;
+	guint		num_restarts;
+	/* the restart under way, or next if current is NULL, and its seed */
+	guint		restart;
+	guint32		seed;
+	/* of CheckpointMerge, and of CheckpointLog */
+	GArray *	current;
+	GPtrArray *	best_logs;
+} Checkpoint;
+
+Checkpoint * checkpoint_new(Dataset * dataset, guint num_restarts, guint restart, guint32 seed);
+void checkpoint_free(Checkpoint *);
+CheckpointLog * checkpoint_log_new(guint restart, gboolean stopped, GArray * merges);
+void checkpoint_log_free(CheckpointLog *);
+void checkpoint_add_best(Checkpoint *, const CheckpointLog * log);
+void checkpoint_save(Checkpoint *, const gchar * fname);
+Checkpoint * checkpoint_load(Dataset * dataset, const gchar * fname);
+void checkpoint_replay(Params * params, GPtrArray * trees, GArray * log);
+
+struct CheckpointWriter_t;
+typedef struct CheckpointWriter_t CheckpointWriter;
+
+CheckpointWriter * checkpoint_writer_new(const gchar * fname, gdouble interval);
+void checkpoint_writer_free(CheckpointWriter *);
+void checkpoint_writer_start(CheckpointWriter *);
+gboolean checkpoint_writer_due(CheckpointWriter *);
+gboolean checkpoint_writer_claim(CheckpointWriter *);
+void checkpoint_writer_push(CheckpointWriter *, Checkpoint * checkpoint);
+void checkpoint_writer_wait(CheckpointWriter *);
+
+#endif /*CHECKPOINT_H*/
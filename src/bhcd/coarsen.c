@@ -0,0 +1,127 @@
+#include "coarsen.h"
+#include "sscache.h"
+
+static void coarsen_fill_offblocks(Params * params, GPtrArray * trees, Tree * tree);
+static void coarsen_fill_neighbour_offblocks(Params * params, GPtrArray * trees, GHashTable * index, guint kk);
+
+
+/* replace the leaves in trees of each of groups of equivalent labels (see
+ * dataset_equivalent_labels) with a branch holding them all, at the place
+ * of the first, leaving NULL at those of the rest. the offblocks the build
+ * goes on to look up are filled in as the branches are put together.
+ */
+void coarsen_trees(Params * params, GPtrArray * trees, GPtrArray * groups) {
+	GHashTable * index;
+	GArray * members;
+
+	index = g_hash_table_new(NULL, NULL);
+	for (guint ii = 0; ii < trees->len; ii++) {
+		gconstpointer label = leaf_get_label(g_ptr_array_index(trees, ii));
+		g_hash_table_insert(index, GINT_TO_POINTER(GPOINTER_TO_INT(label)), GUINT_TO_POINTER(ii));
+	}
+	members = g_array_new(FALSE, FALSE, sizeof(guint));
+	for (guint gg = 0; gg < groups->len; gg++) {
+		GPtrArray * group = g_ptr_array_index(groups, gg);
+		Tree * branch;
+
+		/* a component's build only holds some of the labels */
+		g_array_set_size(members, 0);
+		for (guint ll = 0; ll < group->len; ll++) {
+			gpointer pii;
+
+			if (g_hash_table_lookup_extended(index, g_ptr_array_index(group, ll), NULL, &pii)) {
+				guint ii = GPOINTER_TO_UINT(pii);
+				g_array_append_val(members, ii);
+			}
+		}
+		if (members->len < 2) {
+			continue;
+		}
+
+		branch = branch_new(params);
+		for (guint mm = 0; mm < members->len; mm++) {
+			guint ii = g_array_index(members, guint, mm);
+			Tree * leaf = g_ptr_array_index(trees, ii);
+
+			g_ptr_array_index(trees, ii) = NULL;
+			if (!params->sparse) {
+				coarsen_fill_offblocks(params, trees, leaf);
+			} else if (mm > 0) {
+				sscache_get_offblock_direct(params->sscache,
+						tree_get_labels(branch), tree_get_labels(leaf));
+			}
+			branch_add_child(branch, leaf);
+			tree_unref(leaf);
+			if (!params->sparse && mm > 0) {
+				coarsen_fill_offblocks(params, trees, branch);
+			}
+		}
+		g_ptr_array_index(trees, g_array_index(members, guint, 0)) = branch;
+		if (params->sparse) {
+			guint kk = g_array_index(members, guint, 0);
+
+			for (guint ll = 0; ll < group->len; ll++) {
+				gpointer label = g_ptr_array_index(group, ll);
+
+				if (g_hash_table_contains(index, label)) {
+					g_hash_table_insert(index, label, GUINT_TO_POINTER(kk));
+				}
+			}
+			coarsen_fill_neighbour_offblocks(params, trees, index, kk);
+		}
+	}
+	g_array_free(members, TRUE);
+	g_hash_table_unref(index);
+}
+
+/* as build_fill_batch_offblocks: fill in tree with every other tree as it
+ * is added, so the halves of each are there when needed. dense only: the
+ * sparse build uses coarsen_fill_neighbour_offblocks.
+ */
+static void coarsen_fill_offblocks(Params * params, GPtrArray * trees, Tree * tree) {
+	for (guint ii = 0; ii < trees->len; ii++) {
+		Tree * other = g_ptr_array_index(trees, ii);
+
+		if (other == NULL) {
+			continue;
+		}
+		sscache_get_offblock(params->sscache,
+				tree_get_merge_left(other), tree_get_merge_right(other),
+				tree_get_merge_left(tree), tree_get_merge_right(tree));
+	}
+}
+
+/* the sparse cache falls back to an empty offblock for trees with no
+ * cells between them, so a branch only needs its offblocks with the trees
+ * around it, counted directly. index maps each label to the tree at kk
+ * holding it.
+ */
+static void coarsen_fill_neighbour_offblocks(Params * params, GPtrArray * trees, GHashTable * index, guint kk) {
+	Tree * tree = g_ptr_array_index(trees, kk);
+	GHashTable * done;
+	LabelsetIter iter;
+	gpointer label;
+
+	done = g_hash_table_new(NULL, NULL);
+	labelset_iter_init(&iter, tree_get_labels(tree));
+	while (labelset_iter_next(&iter, &label)) {
+		GPtrArray * neighbours = dataset_label_neighbours(params->dataset, label);
+
+		for (guint nn = 0; nn < neighbours->len; nn++) {
+			gpointer pii;
+			guint ii;
+
+			if (!g_hash_table_lookup_extended(index, g_ptr_array_index(neighbours, nn), NULL, &pii)) {
+				continue;
+			}
+			ii = GPOINTER_TO_UINT(pii);
+			if (ii == kk || g_hash_table_contains(done, pii)) {
+				continue;
+			}
+			g_hash_table_add(done, pii);
+			sscache_get_offblock_direct(params->sscache, tree_get_labels(tree),
+					tree_get_labels(g_ptr_array_index(trees, ii)));
+		}
+	}
+	g_hash_table_unref(done);
+}
@@ -0,0 +1,11 @@
+#ifndef	COARSEN_H
+#define	COARSEN_H
+
+#include <glib.h>
+#include "params.h"
+#include "tree.h"
+
+void coarsen_trees(Params * params, GPtrArray * trees, GPtrArray * groups);
+
+
+#endif /*COARSEN_H*/
@@ -6,16 +6,22 @@
 #define	DATASET_VALUE_TO_INT(pp)	(GPOINTER_TO_INT(pp) - DATASET_VALUE_SHIFT)
 #define	DATASET_INT_TO_VALUE(ii)	(GINT_TO_POINTER(ii + DATASET_VALUE_SHIFT))
 
-gboolean dataset_symmetric = FALSE;
 
 struct Dataset_t {
-	guint		ref_count;
+	/* atomic: every labelset refs the dataset */
+	gint		ref_count;
 	gchar *		filename;
 	gint		omitted;
 	gboolean	keep_diag;
+	/* only the cell with src <= dst is kept */
+	gboolean	symmetric;
 	GQuark		max_qlabel;
 	GHashTable *	labels;
 	GHashTable *	cells;
+	/* built once, on first use (see dataset_label_neighbours): the labels
+	 * each label shares a stored cell with.
+	 */
+	GHashTable *	neighbours;
 };
 
 
@@ -31,6 +37,14 @@ static guint dataset_key_hash(gconstpointer);
 static gboolean dataset_key_eq(gconstpointer, gconstpointer);
 static gint dataset_label_cmp(gconstpointer, gconstpointer);
 static void dataset_set_full(Dataset *, gpointer, gpointer, gint);
+static guint64 dataset_mix64(guint64);
+static guint64 dataset_cell_hash(Dataset *, GQuark, gint, guint);
+static GPtrArray * dataset_neighbours_of(GHashTable *, GQuark);
+static gboolean dataset_neighbours_reverse(Dataset *, const Dataset_Key *);
+static void dataset_neighbours_link(GHashTable *, const Dataset_Key *, gboolean);
+
+/* the neighbours of a label with no stored cells */
+static GPtrArray dataset_no_neighbours = { NULL, 0 };
 
 Dataset* dataset_new(void) {
 	Dataset * data = g_new(Dataset, 1);
@@ -38,6 +52,7 @@ Dataset* dataset_new(void) {
 	data->filename = NULL;
 	data->omitted = -1;
 	data->keep_diag = FALSE;
+	data->symmetric = FALSE;
 	data->cells = g_hash_table_new_full(
 				dataset_key_hash,
 				dataset_key_eq,
@@ -51,21 +66,23 @@ Dataset* dataset_new(void) {
 				NULL,
 				NULL
 			);
+	data->neighbours = NULL;
 	return data;
 }
 
 void dataset_ref(Dataset* dataset) {
-	dataset->ref_count++;
+	g_atomic_int_inc(&dataset->ref_count);
 }
 
 void dataset_unref(Dataset* dataset) {
-	if (dataset->ref_count <= 1) {
+	if (g_atomic_int_dec_and_test(&dataset->ref_count)) {
 		g_hash_table_unref(dataset->cells);
 		g_hash_table_unref(dataset->labels);
+		if (dataset->neighbours != NULL) {
+			g_hash_table_unref(dataset->neighbours);
+		}
 		g_free(dataset->filename);
 		g_free(dataset);
-	} else {
-		dataset->ref_count--;
 	}
 }
 
@@ -92,6 +109,16 @@ void dataset_set_keep_diagonal(Dataset * dataset, gboolean keep_diag){
 	dataset->keep_diag = keep_diag;
 }
 
+/* treat the cells src, dst and dst, src as one. */
+void dataset_set_symmetric(Dataset * dataset, gboolean symmetric) {
+	g_assert(g_hash_table_size(dataset->cells) == 0);
+	dataset->symmetric = symmetric;
+}
+
+gboolean dataset_get_symmetric(Dataset * dataset) {
+	return dataset->symmetric;
+}
+
 gboolean dataset_get_sparse(Dataset * dataset, gboolean * omitted) {
 	if (omitted != NULL) {
 		*omitted = dataset->omitted;
@@ -162,13 +189,116 @@ static void dataset_set_full(Dataset * dataset, gpointer src, gpointer dst, gint
 
 	key = dataset_key(dataset, src, dst);
 	if (value == dataset->omitted) {
-		g_hash_table_remove(dataset->cells, key);
+		if (g_hash_table_remove(dataset->cells, key) &&
+		    dataset->neighbours != NULL && !dataset_neighbours_reverse(dataset, key)) {
+			dataset_neighbours_link(dataset->neighbours, key, FALSE);
+		}
 		dataset_key_free(key);
 		return;
 	}
+	if (dataset->neighbours != NULL && !g_hash_table_contains(dataset->cells, key) &&
+	    !dataset_neighbours_reverse(dataset, key)) {
+		dataset_neighbours_link(dataset->neighbours, key, TRUE);
+	}
 	g_hash_table_replace(dataset->cells, key, DATASET_INT_TO_VALUE(value));
 }
 
+/* the labels and stored cells of delta, added to dataset. cells delta
+ * leaves out are left alone in dataset.
+ */
+void dataset_add(Dataset * dataset, Dataset * delta) {
+	GHashTableIter iter;
+	gpointer pkey, pvalue;
+
+	g_hash_table_iter_init(&iter, delta->labels);
+	while (g_hash_table_iter_next(&iter, &pkey, NULL)) {
+		dataset_label_create(dataset, g_quark_to_string(GPOINTER_TO_INT(pkey)));
+	}
+	g_hash_table_iter_init(&iter, delta->cells);
+	while (g_hash_table_iter_next(&iter, &pkey, &pvalue)) {
+		const Dataset_Key * key = pkey;
+
+		dataset_set_full(dataset,
+				GINT_TO_POINTER(key->src),
+				GINT_TO_POINTER(key->dst),
+				DATASET_VALUE_TO_INT(pvalue));
+	}
+}
+
+/* the labels sharing a stored cell with label, in either direction. so
+ * with the omitted value, they give the whole row and column of label in
+ * time with its degree. the index of all labels is built whole by the
+ * first call, once even if several threads make it; after that lookups
+ * only read, so may run concurrently, though not with changes to dataset.
+ * the array belongs to dataset.
+ */
+GPtrArray * dataset_label_neighbours(Dataset * dataset, gconstpointer label) {
+	GPtrArray * neighbours;
+
+	dataset_label_assert(dataset, label);
+	if (g_once_init_enter(&dataset->neighbours)) {
+		GHashTable * index;
+		GHashTableIter iter;
+		gpointer pkey;
+
+		index = g_hash_table_new_full(NULL, NULL, NULL,
+				(GDestroyNotify)g_ptr_array_unref);
+		g_hash_table_iter_init(&iter, dataset->cells);
+		while (g_hash_table_iter_next(&iter, &pkey, NULL)) {
+			const Dataset_Key * key = pkey;
+
+			/* list a pair stored both ways once */
+			if (key->src < key->dst || !dataset_neighbours_reverse(dataset, key)) {
+				dataset_neighbours_link(index, key, TRUE);
+			}
+		}
+		g_once_init_leave(&dataset->neighbours, index);
+	}
+	neighbours = g_hash_table_lookup(dataset->neighbours, label);
+	if (neighbours == NULL) {
+		return &dataset_no_neighbours;
+	}
+	return neighbours;
+}
+
+/* for changes to the index: creates the entry of qlabel if missing. */
+static GPtrArray * dataset_neighbours_of(GHashTable * index, GQuark qlabel) {
+	GPtrArray * neighbours;
+
+	neighbours = g_hash_table_lookup(index, GINT_TO_POINTER(qlabel));
+	if (neighbours == NULL) {
+		neighbours = g_ptr_array_new();
+		g_hash_table_insert(index, GINT_TO_POINTER(qlabel), neighbours);
+	}
+	return neighbours;
+}
+
+/* is the cell opposite key stored too? */
+static gboolean dataset_neighbours_reverse(Dataset * dataset, const Dataset_Key * key) {
+	Dataset_Key reverse = { .src = key->dst, .dst = key->src };
+
+	return !dataset->symmetric && g_hash_table_contains(dataset->cells, &reverse);
+}
+
+static void dataset_neighbours_link(GHashTable * index, const Dataset_Key * key, gboolean link) {
+	GPtrArray * src;
+	GPtrArray * dst;
+
+	if (key->src == key->dst) {
+		return;
+	}
+	src = dataset_neighbours_of(index, key->src);
+	dst = dataset_neighbours_of(index, key->dst);
+	if (link) {
+		g_ptr_array_add(src, GINT_TO_POINTER(key->dst));
+		g_ptr_array_add(dst, GINT_TO_POINTER(key->src));
+	} else {
+		g_ptr_array_remove_fast(src, GINT_TO_POINTER(key->dst));
+		g_ptr_array_remove_fast(dst, GINT_TO_POINTER(key->src));
+	}
+}
+
+
 guint dataset_num_labels(Dataset * dataset) {
 	return g_hash_table_size(dataset->labels);
 }
@@ -263,6 +393,125 @@ gboolean dataset_label_pairs_iter_next(DatasetPairIter *iter, gpointer * psrc, g
 }
 
 
+static guint64 dataset_mix64(guint64 xx) {
+	/* splitmix64 finaliser */
+	xx = (xx ^ (xx >> 30))*G_GUINT64_CONSTANT(0xbf58476d1ce4e5b9);
+	xx = (xx ^ (xx >> 27))*G_GUINT64_CONSTANT(0x94d049bb133111eb);
+	return xx ^ (xx >> 31);
+}
+
+/* a cell of the row (dir 0) or column (dir 1) of some label, less one
+ * holding the omitted value, so cells left out count for nothing.
+ */
+static guint64 dataset_cell_hash(Dataset * dataset, GQuark other, gint value, guint dir) {
+	guint64 cell = ((guint64)other << 3) | dir;
+
+	return dataset_mix64(cell | ((guint64)(value + 1) << 1))
+		- dataset_mix64(cell | ((guint64)(dataset->omitted + 1) << 1));
+}
+
+/* groups of two or more structurally equivalent labels: their rows and
+ * columns agree off the cells between them, which all hold the same value.
+ * found by hashing each label's row and column with those cells counted as
+ * each value in turn. a hash collision would only group labels that are
+ * not quite equivalent, never give a wrong tree.
+ */
+GPtrArray * dataset_equivalent_labels(Dataset * dataset) {
+	static const gint values[] = { FALSE, TRUE, -1 };
+	GPtrArray * groups;
+	GPtrArray * labels;
+	GHashTable * index;
+	GHashTableIter iter;
+	gpointer pkey, pvalue;
+	guint64 * hashes;
+	gboolean * grouped;
+	DatasetLabelIter label_iter;
+	gpointer label;
+
+	labels = g_ptr_array_sized_new(dataset_num_labels(dataset));
+	index = g_hash_table_new(NULL, NULL);
+	dataset_labels_iter_init(dataset, &label_iter);
+	while (dataset_labels_iter_next(&label_iter, &label)) {
+		g_hash_table_insert(index, label, GUINT_TO_POINTER(labels->len));
+		g_ptr_array_add(labels, label);
+	}
+	hashes = g_new0(guint64, labels->len);
+	grouped = g_new0(gboolean, labels->len);
+
+	g_hash_table_iter_init(&iter, dataset->cells);
+	while (g_hash_table_iter_next(&iter, &pkey, &pvalue)) {
+		const Dataset_Key * key = pkey;
+		gint value = DATASET_VALUE_TO_INT(pvalue);
+		guint src = GPOINTER_TO_UINT(g_hash_table_lookup(index, GINT_TO_POINTER(key->src)));
+		guint dst = GPOINTER_TO_UINT(g_hash_table_lookup(index, GINT_TO_POINTER(key->dst)));
+
+		if (key->src == key->dst) {
+			if (dataset->keep_diag) {
+				hashes[src] += dataset_cell_hash(dataset, 0, value, 0);
+			}
+			continue;
+		}
+		hashes[src] += dataset_cell_hash(dataset, key->dst, value, 0);
+		hashes[dst] += dataset_cell_hash(dataset, key->src, value, 1);
+		if (dataset->symmetric) {
+			hashes[dst] += dataset_cell_hash(dataset, key->src, value, 0);
+			hashes[src] += dataset_cell_hash(dataset, key->dst, value, 1);
+		}
+	}
+
+	groups = g_ptr_array_new_with_free_func((GDestroyNotify)g_ptr_array_unref);
+	for (guint vv = 0; vv < G_N_ELEMENTS(values); vv++) {
+		GHashTable * by_hash;
+		GPtrArray * found;
+		guint64 * keys;
+
+		/* the cells between a group count as values[vv] */
+		keys = g_new(guint64, labels->len);
+		by_hash = g_hash_table_new(g_int64_hash, g_int64_equal);
+		found = g_ptr_array_new();
+		for (guint ll = 0; ll < labels->len; ll++) {
+			GQuark qlabel = (GQuark)GPOINTER_TO_INT(g_ptr_array_index(labels, ll));
+			GPtrArray * group;
+
+			if (grouped[ll]) {
+				continue;
+			}
+			keys[ll] = hashes[ll]
+				+ dataset_cell_hash(dataset, qlabel, values[vv], 0)
+				+ dataset_cell_hash(dataset, qlabel, values[vv], 1);
+			group = g_hash_table_lookup(by_hash, &keys[ll]);
+			if (group == NULL) {
+				group = g_ptr_array_new();
+				g_hash_table_insert(by_hash, &keys[ll], group);
+				g_ptr_array_add(found, group);
+			}
+			g_ptr_array_add(group, g_ptr_array_index(labels, ll));
+		}
+		for (guint gg = 0; gg < found->len; gg++) {
+			GPtrArray * group = g_ptr_array_index(found, gg);
+
+			if (group->len < 2) {
+				g_ptr_array_unref(group);
+				continue;
+			}
+			for (guint ll = 0; ll < group->len; ll++) {
+				grouped[GPOINTER_TO_UINT(g_hash_table_lookup(index,
+						g_ptr_array_index(group, ll)))] = TRUE;
+			}
+			g_ptr_array_add(groups, group);
+		}
+		g_ptr_array_free(found, TRUE);
+		g_hash_table_unref(by_hash);
+		g_free(keys);
+	}
+	g_free(grouped);
+	g_free(hashes);
+	g_hash_table_unref(index);
+	g_ptr_array_free(labels, TRUE);
+	return groups;
+}
+
+
 void dataset_label_assert(Dataset *dataset, gconstpointer label) {
 	g_assert(g_hash_table_lookup_extended(dataset->labels, label, NULL, NULL));
 }
@@ -296,6 +545,15 @@ gpointer dataset_label_lookup(Dataset * dataset, const gchar * slabel) {
 	return label;
 }
 
+/* as dataset_label_lookup, but for labels that may not be there. */
+gboolean dataset_label_exists(Dataset * dataset, const gchar * slabel) {
+	GQuark qlabel;
+
+	qlabel = g_quark_try_string(slabel);
+	return qlabel != 0 && g_hash_table_lookup_extended(dataset->labels,
+			GINT_TO_POINTER(qlabel), NULL, NULL);
+}
+
 const gchar * dataset_label_to_string(Dataset * dataset, gconstpointer label) {
 	dataset_label_assert(dataset, label);
 	return g_quark_to_string(GPOINTER_TO_INT(label));
@@ -370,7 +628,7 @@ static Dataset_Key * dataset_key(Dataset * dd, gconstpointer psrc, gconstpointer
 
 	src = GPOINTER_TO_INT(psrc);
 	dst = GPOINTER_TO_INT(pdst);
-	if (dataset_symmetric && src > dst) {
+	if (dd->symmetric && src > dst) {
 		GQuark tmp = src;
 		src = dst;
 		dst = tmp;
@@ -35,12 +35,15 @@ const gchar * dataset_get_filename(Dataset *);
 void dataset_set_filename(Dataset *, const gchar *);
 void dataset_set_omitted(Dataset *, gboolean omitted);
 void dataset_set_keep_diagonal(Dataset *, gboolean);
+void dataset_set_symmetric(Dataset *, gboolean);
+gboolean dataset_get_symmetric(Dataset *);
 gboolean dataset_get_sparse(Dataset *, gboolean *omitted);
 
 void dataset_set(Dataset *, gpointer, gpointer, gboolean);
 void dataset_set_missing(Dataset *, gpointer, gpointer);
 gboolean dataset_is_missing(Dataset *, gpointer, gpointer);
 gboolean dataset_get(Dataset *, gconstpointer, gconstpointer, gboolean *);
+void dataset_add(Dataset *, Dataset *);
 
 /* labels on rows/columns */
 void dataset_label_assert(Dataset *, gconstpointer);
@@ -49,13 +52,17 @@ void dataset_labels_iter_init(Dataset *, DatasetLabelIter *);
 gboolean dataset_labels_iter_next(DatasetLabelIter *, gpointer *);
 gpointer dataset_label_create(Dataset *, const gchar *);
 gpointer dataset_label_lookup(Dataset *, const gchar *);
+gboolean dataset_label_exists(Dataset *, const gchar *);
 gpointer dataset_get_max_label(Dataset *);
 const gchar * dataset_label_to_string(Dataset *, gconstpointer);
+GPtrArray * dataset_label_neighbours(Dataset *, gconstpointer);
 
 void dataset_label_pairs_iter_init(Dataset *, DatasetPairIter *);
 void dataset_label_pairs_iter_init_full(Dataset *, gint, DatasetPairIter *);
 gboolean dataset_label_pairs_iter_next(DatasetPairIter *, gpointer *, gpointer *);
 
+GPtrArray * dataset_equivalent_labels(Dataset *);
+
 void dataset_println(Dataset *, const gchar *);
 void dataset_tostring(Dataset *, GString *);
 
@@ -8,6 +8,10 @@ static void parse_node(Tokens * toks, Dataset * dd, GHashTable * id_labels);
 static void parse_edge(Tokens * toks, Dataset * dd, GHashTable * id_labels);
 
 Dataset * dataset_gml_load(const gchar *fname) {
+	return dataset_gml_load_full(fname, FALSE);
+}
+
+Dataset * dataset_gml_load_full(const gchar *fname, gboolean symmetric) {
 	Dataset * dd;
 	Tokens * toks;
 	GHashTable * id_labels;
@@ -15,6 +19,7 @@ Dataset * dataset_gml_load(const gchar *fname) {
 
 	id_labels = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	dd = dataset_new();
+	dataset_set_symmetric(dd, symmetric);
 	dataset_set_filename(dd, fname);
 	toks = tokens_open(fname);
 	while (tokens_has_next(toks)) {
@@ -4,6 +4,7 @@
 #include "dataset.h"
 
 Dataset * dataset_gml_load(const gchar *fname);
+Dataset * dataset_gml_load_full(const gchar *fname, gboolean symmetric);
 void dataset_gml_save(Dataset * dataset, const gchar *fname);
 void dataset_gml_save_io(Dataset * dataset, GIOChannel * io);
 void dataset_adj_save_io(Dataset * dataset, GIOChannel * io);
@@ -0,0 +1,146 @@
+#include "fingerprints.h"
+
+/* the fingerprints of a restart (see build_set_adaptive_restarts): of the
+ * forest after each merge so far, and of each tree merged so far still in
+ * the forest (by Tree, not referenced).
+ */
+struct Fingerprints_t {
+	GArray * forests;
+	GHashTable * trees;
+};
+
+static guint64 fingerprints_mix(guint64 xx);
+static guint64 fingerprints_unmix(guint64 xx);
+
+
+Fingerprints * fingerprints_new(void) {
+	Fingerprints * prints;
+
+	prints = g_new(Fingerprints, 1);
+	prints->forests = g_array_new(FALSE, FALSE, sizeof(guint64));
+	prints->trees = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+	return prints;
+}
+
+void fingerprints_free(Fingerprints * prints) {
+	g_array_free(prints->forests, TRUE);
+	g_hash_table_unref(prints->trees);
+	g_free(prints);
+}
+
+/* forget the restart, once its trees are let go. */
+void fingerprints_reset(Fingerprints * prints) {
+	g_array_set_size(prints->forests, 0);
+	g_hash_table_remove_all(prints->trees);
+}
+
+/* splitmix64's finaliser, and its inverse. */
+static guint64 fingerprints_mix(guint64 xx) {
+	xx = (xx ^ (xx >> 30))*0xbf58476d1ce4e5b9ULL;
+	xx = (xx ^ (xx >> 27))*0x94d049bb133111ebULL;
+	return xx ^ (xx >> 31);
+}
+
+static guint64 fingerprints_unmix(guint64 xx) {
+	xx = (xx ^ (xx >> 31) ^ (xx >> 62))*0x319642b2d24d8ec3ULL;
+	xx = (xx ^ (xx >> 27) ^ (xx >> 54))*0x96de1b173f119089ULL;
+	return xx ^ (xx >> 30) ^ (xx >> 60);
+}
+
+/* a hash of the labels and shape of tree, but not of the order of the
+ * children: that of a branch is fingerprints_mix of the sum of its
+ * children's. many orders of merges make the same tree, and all get the
+ * same.
+ */
+guint64 fingerprints_tree(Fingerprints * prints, Tree * tree) {
+	guint64 * print;
+	guint64 sum;
+
+	print = g_hash_table_lookup(prints->trees, tree);
+	if (print != NULL) {
+		return *print;
+	}
+	if (tree_is_leaf(tree)) {
+		return fingerprints_mix(GPOINTER_TO_SIZE(leaf_get_label(tree)) + 1);
+	}
+	/* one of the initial trees (see coarsen_trees) */
+	sum = 0;
+	for (GList * child = branch_get_children(tree); child != NULL; child = g_list_next(child)) {
+		sum += fingerprints_tree(prints, child->data);
+	}
+	return fingerprints_mix(sum);
+}
+
+/* the fingerprint of the forest is the sum of those of its trees, less
+ * that of the initial forest, which all restarts share. update it for a
+ * merge of kind of aa and bb, before it is made (which may change aa in
+ * place), and return that of the new tree to give fingerprints_add_tree
+ * once it is.
+ */
+guint64 * fingerprints_merge(Fingerprints * prints, MergeKind kind, Tree * aa, Tree * bb) {
+	guint64 print_aa = fingerprints_tree(prints, aa);
+	guint64 print_bb = fingerprints_tree(prints, bb);
+	guint64 * print = g_new(guint64, 1);
+	guint64 forest = 0;
+
+	if (kind == MERGE_JOIN) {
+		*print = fingerprints_mix(print_aa + print_bb);
+	} else {
+		/* bb one more child of aa */
+		*print = fingerprints_mix(fingerprints_unmix(print_aa) + print_bb);
+	}
+	g_hash_table_remove(prints->trees, aa);
+	g_hash_table_remove(prints->trees, bb);
+	if (prints->forests->len > 0) {
+		forest = g_array_index(prints->forests, guint64, prints->forests->len - 1);
+	}
+	forest += *print - print_aa - print_bb;
+	g_array_append_val(prints->forests, forest);
+	return print;
+}
+
+/* print, from fingerprints_merge, is taken. */
+void fingerprints_add_tree(Fingerprints * prints, Tree * tree, guint64 * print) {
+	g_hash_table_insert(prints->trees, tree, print);
+}
+
+/* as if the forest were reached by one merge (see build_replay). */
+void fingerprints_add_forest(Fingerprints * prints, guint64 forest) {
+	g_array_append_val(prints->forests, forest);
+}
+
+/* a set of forest fingerprints, for those below. */
+GHashTable * fingerprints_seen_new(void) {
+	return g_hash_table_new_full(g_int64_hash, g_int64_equal, g_free, NULL);
+}
+
+/* whether the forest so far is in seen. */
+gboolean fingerprints_seen(Fingerprints * prints, GHashTable * seen) {
+	GArray * forests = prints->forests;
+
+	if (forests->len == 0) {
+		return FALSE;
+	}
+	return g_hash_table_contains(seen, &g_array_index(forests, guint64, forests->len - 1));
+}
+
+/* add the forest so far to seen, or every forest so far if all, and
+ * return whether the former was there already. one with no merges of its
+ * own is never seen.
+ */
+gboolean fingerprints_add_seen(Fingerprints * prints, GHashTable * seen, gboolean all) {
+	GArray * forests = prints->forests;
+	gboolean found;
+
+	if (forests->len == 0) {
+		return FALSE;
+	}
+	found = fingerprints_seen(prints, seen);
+	for (guint kk = all? 0: forests->len - 1; kk < forests->len; kk++) {
+		guint64 * print = g_new(guint64, 1);
+
+		*print = g_array_index(forests, guint64, kk);
+		g_hash_table_add(seen, print);
+	}
+	return found;
+}
@@ -0,0 +1,23 @@
+#ifndef	FINGERPRINTS_H
+#define	FINGERPRINTS_H
+
+#include <glib.h>
+#include "merge.h"
+#include "tree.h"
+
+struct Fingerprints_t;
+typedef struct Fingerprints_t Fingerprints;
+
+Fingerprints * fingerprints_new(void);
+void fingerprints_free(Fingerprints *);
+void fingerprints_reset(Fingerprints *);
+guint64 fingerprints_tree(Fingerprints *, Tree * tree);
+guint64 * fingerprints_merge(Fingerprints *, MergeKind kind, Tree * aa, Tree * bb);
+void fingerprints_add_tree(Fingerprints *, Tree * tree, guint64 * print);
+void fingerprints_add_forest(Fingerprints *, guint64 forest);
+GHashTable * fingerprints_seen_new(void);
+gboolean fingerprints_seen(Fingerprints *, GHashTable * seen);
+gboolean fingerprints_add_seen(Fingerprints *, GHashTable * seen, gboolean all);
+
+
+#endif /*FINGERPRINTS_H*/
@@ -2,181 +2,320 @@
 #include "util.h"
 #include "tree.h"
 
+/* the neighbours of each tree, by index, as a sorted GArray of guint;
+ * NULL for trees merged away or without any.
+ */
 struct Islands_t {
 	gboolean debug;
-	GHashTable * neigh;
+	GPtrArray * neigh;
 };
 
-static void islands_add_edge_directed(Islands *islands, guint ii, guint jj);
+static GArray * islands_hood(Islands * islands, guint ii, gboolean create);
+static void islands_append_edge(Islands * islands, guint ii, guint jj);
+static void islands_tidy(Islands * islands);
+static void islands_insert(GArray * hood, guint kk);
+static void islands_remove(GArray * hood, guint kk);
+static gboolean islands_find(GArray * hood, guint kk, guint * pos);
 
 
-Islands * islands_new(Dataset * dataset, GPtrArray *trees) {
+static void islands_hood_free(GArray * hood) {
+	if (hood != NULL) {
+		g_array_unref(hood);
+	}
+}
+
+static Islands * islands_alloc(void) {
 	Islands * islands;
-	gpointer src, dst;
-	DatasetPairIter pairs;
+
+	islands = g_new(Islands,1);
+	islands->debug = FALSE;
+	islands->neigh = g_ptr_array_new_with_free_func((GDestroyNotify)islands_hood_free);
+	return islands;
+}
+
+static GHashTable * islands_labels_to_trees(GPtrArray * trees) {
 	GHashTable * labels_to_trees;
+
+	/* the trees need not be leaves (see build_coarsen_trees) */
+	labels_to_trees = g_hash_table_new(NULL, NULL);
+	for (guint ii = 0; ii < trees->len; ii++) {
+		LabelsetIter iter;
+		gpointer label;
+
+		labelset_iter_init(&iter, tree_get_labels(g_ptr_array_index(trees, ii)));
+		while (labelset_iter_next(&iter, &label)) {
+			g_hash_table_insert(labels_to_trees, label, GINT_TO_POINTER(ii));
+		}
+	}
+	return labels_to_trees;
+}
+
+/* edges to labels in none of the trees (see build_set_subsample) are left
+ * out.
+ */
+static void islands_add_label_edge(Islands * islands, GHashTable * labels_to_trees, gpointer src, gpointer dst) {
 	gpointer pp;
 	gpointer qq;
 	guint ii;
 	guint jj;
 
-	islands = g_new(Islands,1);
-	islands->debug = FALSE;
-	islands->neigh = g_hash_table_new_full(NULL, NULL, NULL, (GDestroyNotify)g_hash_table_unref);
-
-	labels_to_trees = g_hash_table_new(NULL, NULL);
-	for (ii = 0; ii < trees->len; ii++) {
-		gconstpointer label = leaf_get_label(g_ptr_array_index(trees, ii));
-		g_hash_table_insert(labels_to_trees, GINT_TO_POINTER(GPOINTER_TO_INT(label)), GINT_TO_POINTER(ii));
+	if (!g_hash_table_lookup_extended(labels_to_trees, src, NULL, &pp)
+			|| !g_hash_table_lookup_extended(labels_to_trees, dst, NULL, &qq)) {
+		return;
+	}
+	ii = GPOINTER_TO_INT(pp);
+	jj = GPOINTER_TO_INT(qq);
+	if (ii != jj) {
+		islands_append_edge(islands, ii, jj);
 	}
+}
 
+Islands * islands_new(Dataset * dataset, GPtrArray *trees) {
+	Islands * islands;
+	gpointer src, dst;
+	DatasetPairIter pairs;
+	GHashTable * labels_to_trees;
+
+	islands = islands_alloc();
+	labels_to_trees = islands_labels_to_trees(trees);
 	dataset_label_pairs_iter_init_full(dataset, DATASET_ITER_TRUE, &pairs);
 	while (dataset_label_pairs_iter_next(&pairs, &src, &dst)) {
-		pp = g_hash_table_lookup(labels_to_trees, src);
-		ii = GPOINTER_TO_INT(pp);
-		qq = g_hash_table_lookup(labels_to_trees, dst);
-		jj = GPOINTER_TO_INT(qq);
-		islands_add_edge(islands, ii, jj);
-	}
-	/*
-	 * a ``correct'' but ineffective sparse rule
-	dataset_label_pairs_iter_init_full(dataset, DATASET_ITER_MISSING, &pairs);
-	while (dataset_label_pairs_iter_next(&pairs, &src, &dst)) {
-		pp = g_hash_table_lookup(labels_to_trees, src);
-		ii = GPOINTER_TO_INT(pp);
-		qq = g_hash_table_lookup(labels_to_trees, dst);
-		jj = GPOINTER_TO_INT(qq);
-		islands_add_edge(islands, ii, jj);
+		islands_add_label_edge(islands, labels_to_trees, src, dst);
+	}
+	/* the sparse offblock of two trees never scored together counts all
+	 * their cells as zeros (see sscache_get_offblock_sparse), so stored
+	 * missing cells have to be between neighbours too. (if those left out
+	 * are the missing ones, that is wrong anyway.)
+	 */
+	if (dataset_get_sparse(dataset, NULL)) {
+		dataset_label_pairs_iter_init_full(dataset, DATASET_ITER_MISSING, &pairs);
+		while (dataset_label_pairs_iter_next(&pairs, &src, &dst)) {
+			islands_add_label_edge(islands, labels_to_trees, src, dst);
+		}
+	}
+	g_hash_table_unref(labels_to_trees);
+	islands_tidy(islands);
+
+	return islands;
+}
+
+/* as islands_new, but from just the edges given (src, dst labels
+ * consecutive), which must all be between labels of trees.
+ */
+Islands * islands_new_from_edges(GPtrArray * edges, GPtrArray * trees) {
+	Islands * islands;
+	GHashTable * labels_to_trees;
+
+	islands = islands_alloc();
+	labels_to_trees = islands_labels_to_trees(trees);
+	for (guint ee = 0; ee+1 < edges->len; ee += 2) {
+		islands_add_label_edge(islands, labels_to_trees,
+				g_ptr_array_index(edges, ee),
+				g_ptr_array_index(edges, ee+1));
 	}
-	*/
 	g_hash_table_unref(labels_to_trees);
+	islands_tidy(islands);
 
 	return islands;
 }
 
 void islands_free(Islands *islands) {
-	g_hash_table_unref(islands->neigh);
+	g_ptr_array_free(islands->neigh, TRUE);
 	g_free(islands);
 }
 
-void islands_add_edge(Islands *islands, guint ii, guint jj) {
-	islands_add_edge_directed(islands, ii, jj);
-	islands_add_edge_directed(islands, jj, ii);
+static GArray * islands_hood(Islands * islands, guint ii, gboolean create) {
+	GArray * hood;
+
+	if (ii >= islands->neigh->len) {
+		if (!create) {
+			return NULL;
+		}
+		g_ptr_array_set_size(islands->neigh, (gint)ii + 1);
+	}
+	hood = g_ptr_array_index(islands->neigh, ii);
+	if (hood == NULL && create) {
+		hood = g_array_new(FALSE, FALSE, sizeof(guint));
+		g_ptr_array_index(islands->neigh, ii) = hood;
+	}
+	return hood;
 }
 
-static void islands_add_edge_directed(Islands *islands, guint ii, guint jj) {
-	gpointer hood;
-	gpointer pp = GINT_TO_POINTER(ii);
-	gpointer qq = GINT_TO_POINTER(jj);
+/* unsorted, and perhaps twice: see islands_tidy. */
+static void islands_append_edge(Islands * islands, guint ii, guint jj) {
+	g_array_append_val(islands_hood(islands, ii, TRUE), jj);
+	g_array_append_val(islands_hood(islands, jj, TRUE), ii);
+}
+
+static gint islands_cmp(gconstpointer paa, gconstpointer pbb) {
+	const guint aa = *(const guint *)paa;
+	const guint bb = *(const guint *)pbb;
+
+	return aa < bb? -1: (aa > bb? 1: 0);
+}
+
+/* sort each neighbourhood, dropping repeats. */
+static void islands_tidy(Islands * islands) {
+	for (guint ii = 0; ii < islands->neigh->len; ii++) {
+		GArray * hood = g_ptr_array_index(islands->neigh, ii);
+		guint len;
+
+		if (hood == NULL) {
+			continue;
+		}
+		g_array_sort(hood, islands_cmp);
+		len = 0;
+		for (guint xx = 0; xx < hood->len; xx++) {
+			guint kk = g_array_index(hood, guint, xx);
+
+			if (len == 0 || g_array_index(hood, guint, len-1) != kk) {
+				g_array_index(hood, guint, len++) = kk;
+			}
+		}
+		g_array_set_size(hood, len);
+	}
+}
 
-	if (!g_hash_table_lookup_extended(islands->neigh, pp, NULL, &hood)) {
-		hood = g_hash_table_new(NULL, NULL);
-		g_hash_table_insert(islands->neigh, pp, hood);
+/* where kk is in hood, or would go. */
+static gboolean islands_find(GArray * hood, guint kk, guint * pos) {
+	guint lo = 0;
+	guint hi = hood->len;
+
+	while (lo < hi) {
+		guint mid = lo + (hi - lo)/2;
+
+		if (g_array_index(hood, guint, mid) < kk) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	*pos = lo;
+	return lo < hood->len && g_array_index(hood, guint, lo) == kk;
+}
+
+static void islands_insert(GArray * hood, guint kk) {
+	guint pos;
+
+	if (!islands_find(hood, kk, &pos)) {
+		g_array_insert_val(hood, pos, kk);
+	}
+}
+
+static void islands_remove(GArray * hood, guint kk) {
+	guint pos;
+
+	if (islands_find(hood, kk, &pos)) {
+		g_array_remove_index(hood, pos);
 	}
-	g_hash_table_insert(hood, qq, qq);
+}
+
+void islands_add_edge(Islands *islands, guint ii, guint jj) {
+	islands_insert(islands_hood(islands, ii, TRUE), jj);
+	islands_insert(islands_hood(islands, jj, TRUE), ii);
 	if (islands->debug) {
-		g_print("island: %u -> %u\n", ii, jj);
+		g_print("island: %u -- %u\n", ii, jj);
 	}
 }
 
+/* mm takes over the neighbours of ii and jj: the two sorted lists are
+ * merged into one, and each neighbour swaps ii and jj for mm.
+ */
 void islands_merge(Islands * islands, guint mm, guint ii, guint jj) {
-	gpointer pp = GINT_TO_POINTER(ii);
-	gpointer qq = GINT_TO_POINTER(jj);
-	gpointer rr = GINT_TO_POINTER(mm);
-	GHashTable * hood_ii = g_hash_table_lookup(islands->neigh, pp);
-	GHashTable * hood_jj = g_hash_table_lookup(islands->neigh, qq);
-	GHashTable * hood_rr;
-	GList * elems_ii;
-	GList * elems_jj;
-
-	/* go through the neighbours of ii and jj, removing ii and jj, and
-	 * adding mm.
-	 */
-	elems_ii = g_hash_table_get_keys(hood_ii);
-	for (GList * xx = elems_ii; xx != NULL; xx = g_list_next(xx)) {
-		gpointer kk = xx->data;
-		GHashTable * hood_kk = g_hash_table_lookup(islands->neigh, kk);
-		if (kk == pp || kk == qq) {
-			continue;
-		}
-		g_hash_table_remove(hood_kk, pp);
-		g_hash_table_remove(hood_kk, qq);
-		g_hash_table_insert(hood_kk, rr, rr);
-		if (islands->debug) {
-			g_print("merge: %d: added %u\n", GPOINTER_TO_INT(kk), mm);
+	GArray * hood_ii = islands_hood(islands, ii, FALSE);
+	GArray * hood_jj = islands_hood(islands, jj, FALSE);
+	GArray * hood_mm;
+	guint xx, yy;
+
+	g_assert(hood_ii != NULL && hood_jj != NULL);
+	hood_mm = g_array_sized_new(FALSE, FALSE, sizeof(guint), hood_ii->len + hood_jj->len);
+	xx = yy = 0;
+	while (xx < hood_ii->len || yy < hood_jj->len) {
+		guint kk;
+
+		if (yy >= hood_jj->len || (xx < hood_ii->len
+				&& g_array_index(hood_ii, guint, xx) <= g_array_index(hood_jj, guint, yy))) {
+			kk = g_array_index(hood_ii, guint, xx++);
+			if (yy < hood_jj->len && g_array_index(hood_jj, guint, yy) == kk) {
+				yy++;
+			}
+		} else {
+			kk = g_array_index(hood_jj, guint, yy++);
 		}
-	}
-	elems_jj = g_hash_table_get_keys(hood_jj);
-	for (GList * xx = elems_jj; xx != NULL; xx = g_list_next(xx)) {
-		gpointer kk = xx->data;
-		GHashTable * hood_kk = g_hash_table_lookup(islands->neigh, kk);
-		if (kk == pp || kk == qq) {
+		if (kk == ii || kk == jj) {
 			continue;
 		}
-		g_hash_table_remove(hood_kk, pp);
-		g_hash_table_remove(hood_kk, qq);
-		g_hash_table_insert(hood_kk, rr, rr);
+		g_array_append_val(hood_mm, kk);
+	}
+	for (guint kk = 0; kk < hood_mm->len; kk++) {
+		GArray * hood_kk = islands_hood(islands, g_array_index(hood_mm, guint, kk), FALSE);
+
+		islands_remove(hood_kk, ii);
+		islands_remove(hood_kk, jj);
+		islands_insert(hood_kk, mm);
 		if (islands->debug) {
-			g_print("merge: %d: added %u\n", GPOINTER_TO_INT(kk), mm);
+			g_print("merge: %u: added %u\n", g_array_index(hood_mm, guint, kk), mm);
 		}
 	}
-	/* create a new entry for mm, which consists of the concatonation of the
-	 * neighbourhoods of pp and qq
-	 */
-	g_list_free(elems_ii);
-	hood_rr = hood_ii;
-	g_hash_table_ref(hood_ii);
-	for (GList * xx = elems_jj; xx != NULL; xx = g_list_next(xx)) {
-		gpointer kk = xx->data;
-		if (kk == pp || kk == qq) {
-			continue;
-		}
-		g_hash_table_insert(hood_rr, kk, kk);
+	g_ptr_array_index(islands->neigh, ii) = NULL;
+	g_ptr_array_index(islands->neigh, jj) = NULL;
+	g_array_unref(hood_ii);
+	g_array_unref(hood_jj);
+	if (mm >= islands->neigh->len) {
+		g_ptr_array_set_size(islands->neigh, (gint)mm + 1);
 	}
-	g_list_free(elems_jj);
-	g_hash_table_remove(hood_rr, pp);
-	g_hash_table_remove(hood_rr, qq);
-	g_hash_table_insert(islands->neigh, rr, hood_rr);
-
-	/* finally remove ii and jj completely. */
-	g_hash_table_remove(islands->neigh, pp);
-	g_hash_table_remove(islands->neigh, qq);
+	g_assert(g_ptr_array_index(islands->neigh, mm) == NULL);
+	g_ptr_array_index(islands->neigh, mm) = hood_mm;
 	if (islands->debug) {
 		g_print("island: merge %u %u -> %u\n", ii, jj, mm);
 	}
 }
 
-GList * islands_get_neigh(Islands * islands, guint ii) {
-	GHashTable * hood;
-	gpointer pp = GINT_TO_POINTER(ii);
+/* the neighbours of ii, sorted: NULL if none. owned by islands, and only
+ * valid until it next changes.
+ */
+GArray * islands_get_neigh(Islands * islands, guint ii) {
+	GArray * hood = islands_hood(islands, ii, FALSE);
 
-	hood = g_hash_table_lookup(islands->neigh, pp);
 	if (islands->debug) {
-		g_print("get neighbours %u: %u\n", ii, g_hash_table_size(hood));
+		g_print("get neighbours %u: %u\n", ii, hood == NULL? 0: hood->len);
 	}
-	if (hood == NULL) {
-		return NULL;
-	}
-	return g_hash_table_get_keys(hood);
+	return hood;
 }
 
-void islands_get_neigh_free(GList * neighhood) {
-	g_list_free(neighhood);
-}
+/* each pair of neighbours once, lower index first, consecutive in an
+ * array to g_free; the number of pairs in num_edges.
+ */
+guint * islands_get_edges(Islands * islands, guint * num_edges) {
+	guint * edges;
+	guint num;
 
+	num = 0;
+	for (guint ii = 0; ii < islands->neigh->len; ii++) {
+		GArray * hood = g_ptr_array_index(islands->neigh, ii);
+		guint pos;
 
-GList * islands_get_edges(Islands * islands) {
-	GList * edges = NULL;
-	GList * elems_ii = g_hash_table_get_keys(islands->neigh);
-	for (GList * xx = elems_ii; xx != NULL; xx = g_list_next(xx)) {
-		for (GList * yy = g_list_next(xx); yy != NULL; yy = g_list_next(yy)) {
-			edges = g_list_prepend(edges, pair_new(xx->data, yy->data));
+		if (hood != NULL) {
+			islands_find(hood, ii + 1, &pos);
+			num += hood->len - pos;
 		}
 	}
-	g_list_free(elems_ii);
-	return edges;
-}
+	edges = g_new(guint, 2*num + 1);
+	num = 0;
+	for (guint ii = 0; ii < islands->neigh->len; ii++) {
+		GArray * hood = g_ptr_array_index(islands->neigh, ii);
+		guint pos;
 
-void islands_get_edges_free(GList * edges) {
-	g_list_free_full(edges, (GDestroyNotify)pair_free);
+		if (hood == NULL) {
+			continue;
+		}
+		islands_find(hood, ii + 1, &pos);
+		for (; pos < hood->len; pos++) {
+			edges[2*num] = ii;
+			edges[2*num + 1] = g_array_index(hood, guint, pos);
+			num++;
+		}
+	}
+	*num_edges = num;
+	return edges;
 }
@@ -8,12 +8,11 @@ struct Islands_t;
 typedef struct Islands_t Islands;
 
 Islands * islands_new(Dataset *, GPtrArray * trees);
+Islands * islands_new_from_edges(GPtrArray * edges, GPtrArray * trees);
 void islands_add_edge(Islands *, guint, guint);
 void islands_merge(Islands *, guint, guint, guint);
-GList * islands_get_neigh(Islands *, guint);
-void islands_get_neigh_free(GList *);
-GList * islands_get_edges(Islands *);
-void islands_get_edges_free(GList *);
+GArray * islands_get_neigh(Islands *, guint);
+guint * islands_get_edges(Islands *, guint * num_edges);
 void islands_free(Islands *);
 
 
@@ -2,7 +2,8 @@
 #include "labelset.h"
 
 struct Labelset_t {
-	guint ref_count;
+	/* atomic: labelsets of live trees are shared by scoring threads */
+	gint ref_count;
 	Bitset * bits;
 	Dataset * dataset;
 };
@@ -40,16 +41,14 @@ Labelset * labelset_copy(Labelset *other) {
 
 
 void labelset_ref(Labelset * lset) {
-	lset->ref_count++;
+	g_atomic_int_inc(&lset->ref_count);
 }
 
 void labelset_unref(Labelset * lset) {
-	if (lset->ref_count <= 1) {
+	if (g_atomic_int_dec_and_test(&lset->ref_count)) {
 		dataset_unref(lset->dataset);
 		bitset_unref(lset->bits);
 		g_slice_free(Labelset, lset);
-	} else {
-		lset->ref_count--;
 	}
 }
 
@@ -1,54 +1,133 @@
 #include "merge.h"
 #include "sscache.h"
 #include "counts.h"
+#include "dheap.h"
+#include "util.h"
 
 static const gboolean merge_debug = FALSE;
-gboolean merge_global_score = FALSE;
 
 static void merge_notify_parent(Merge * merge, gpointer global_suffstats, gpointer ss_aa, gpointer ss_bb);
-static void merge_calc_score(Merge * merge);
+static void merge_calc_score(Merge * merge, gpointer ss_aa, gpointer ss_bb);
+static Merge * merge_new_score_only(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, MergeKind kind, gpointer offblock);
 
 
-Merge * merge_new(GRand * rng, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, Tree * mm) {
+static gpointer merge_get_offblock(Params * params, Tree * aa, Tree * bb) {
+	return sscache_get_offblock(params->sscache,
+			tree_get_merge_left(aa),
+			tree_get_merge_right(aa),
+			tree_get_merge_left(bb),
+			tree_get_merge_right(bb));
+}
+
+static Merge * merge_alloc(gdouble sym_break, Params * params, guint ii, guint jj, MergeKind kind, gpointer offblock) {
 	Merge * merge;
 
 	merge = g_slice_new(Merge);
 	merge->ii = ii;
 	merge->jj = jj;
-	merge->tree = mm;
-	tree_ref(merge->tree);
+	merge->kind = kind;
+	merge->params = params;
+	merge->tree = NULL;
+	merge->ss_on = NULL;
+	merge->ss_offblock = offblock;
+	suffstats_ref(merge->ss_offblock);
+	merge->ss_all = NULL;
+	merge->sym_break = sym_break;
+	merge->heap_index = DHEAP_NO_INDEX;
+	merge->ii_index = 0;
+	merge->jj_index = 0;
+	return merge;
+}
 
-	merge->tree_score = tree_get_logprob(merge->tree)
+static void merge_init_score(Merge * merge, Merge * parent, Tree * aa, Tree * bb, gdouble logprob) {
+	merge->tree_score = logprob
 	       		- tree_get_logprob(aa)
 			- tree_get_logprob(bb);
-
-	merge->ss_offblock = sscache_get_offblock(params->sscache,
-			tree_get_merge_left(aa),
-			tree_get_merge_right(aa),
-			tree_get_merge_left(bb),
-			tree_get_merge_right(bb));
-	suffstats_ref(merge->ss_offblock);
-	merge->ss_all = NULL;
-	merge->ss_parent = NULL;
-	merge->ss_self = NULL;
-	merge->sym_break = g_rand_double(rng);
 	if (parent != NULL && parent->ss_all != NULL) {
 		merge_notify_parent(merge, parent->ss_all, tree_get_suffstats(aa), tree_get_suffstats(bb));
+	} else {
+		merge_calc_score(merge, NULL, NULL);
+	}
+}
+
+/* a merge into an already built tree mm */
+Merge * merge_new(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, Tree * mm) {
+	Merge * merge;
+
+	merge = merge_alloc(sym_break, params, ii, jj, MERGE_JOIN, merge_get_offblock(params, aa, bb));
+	merge->tree = mm;
+	tree_ref(merge->tree);
+	merge->ss_on = tree_get_suffstats(merge->tree);
+	suffstats_ref(merge->ss_on);
+	merge_init_score(merge, parent, aa, bb, tree_get_logprob(merge->tree));
+	return merge;
+}
+
+/* a merge scored from the children alone; the tree is only built by
+ * merge_materialize.
+ */
+static Merge * merge_new_score_only(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, MergeKind kind, gpointer offblock) {
+	Merge * merge;
+	Counts ss_on = { .ref_count = 1, .num_ones = 0, .num_total = 0 };
+	gdouble logprob;
+
+	merge = merge_alloc(sym_break, params, ii, jj, kind, offblock);
+	if (kind == MERGE_JOIN) {
+		logprob = tree_logprob_join(aa, bb, merge->ss_offblock, &ss_on);
+	} else {
+		logprob = tree_logprob_absorb(aa, bb, merge->ss_offblock, &ss_on);
 	}
-	merge_calc_score(merge);
+	if (params->global_score) {
+		merge->ss_on = suffstats_copy(&ss_on);
+	}
+	merge_init_score(merge, parent, aa, bb, logprob);
 	return merge;
 }
 
+/* the tree a merge of kind makes of aa and bb. the sscache must be able
+ * to find their offblock. an absorb may reuse aa (see
+ * branch_add_child_copy), which is then only good for tree_unref.
+ */
+Tree * merge_tree_new(Params * params, MergeKind kind, Tree * aa, Tree * bb) {
+	Tree * tree;
+
+	if (kind == MERGE_ABSORB) {
+		return branch_add_child_copy(aa, bb);
+	}
+	tree = branch_new(params);
+	branch_add_child(tree, aa);
+	branch_add_child(tree, bb);
+	return tree;
+}
+
+/* build the merged tree from the trees at ii and jj; as merge_tree_new,
+ * aa may go into it.
+ */
+Tree * merge_materialize(Merge * merge, Tree * aa, Tree * bb) {
+	gdouble logprob_before = 0.0;
+
+	if (merge->tree != NULL) {
+		return merge->tree;
+	}
+	if (merge_debug) {
+		logprob_before = tree_get_logprob(aa) + tree_get_logprob(bb);
+	}
+	merge->tree = merge_tree_new(merge->params, merge->kind, aa, bb);
+	if (merge_debug) {
+		assert_eqfloat(merge->tree_score,
+			tree_get_logprob(merge->tree) - logprob_before,
+			EQFLOAT_DEFAULT_PREC);
+	}
+	return merge->tree;
+}
+
 void merge_free(Merge * merge) {
 	suffstats_unref(merge->ss_offblock);
 	if (merge->ss_all != NULL) {
 		suffstats_unref(merge->ss_all);
 	}
-	if (merge->ss_parent != NULL) {
-		suffstats_unref(merge->ss_parent);
-	}
-	if (merge->ss_self != NULL) {
-		suffstats_unref(merge->ss_self);
+	if (merge->ss_on != NULL) {
+		suffstats_unref(merge->ss_on);
 	}
 	tree_unref(merge->tree);
 	g_slice_free(Merge, merge);
@@ -61,42 +140,44 @@ void merge_notify_pair(Merge * merge, gpointer global_suffstats) {
 }
 
 static void merge_notify_parent(Merge * merge, gpointer global_suffstats, gpointer ss_aa, gpointer ss_bb) {
-	/* if we're just doing the local score, we do not need to compute all
-	 * these bits
-	 */
-	if (!merge_global_score) {
-		return;
+	/* if we're just doing the local score, we do not need the total */
+	if (merge->params->global_score) {
+		merge->ss_all = global_suffstats;
+		suffstats_ref(merge->ss_all);
 	}
-
-	merge->ss_all = global_suffstats;
-	suffstats_ref(merge->ss_all);
-
-	if (ss_aa == NULL && ss_bb == NULL) {
-		merge->ss_parent = merge->ss_all;
-		suffstats_ref(merge->ss_parent);
-	} else {
-		merge->ss_parent = suffstats_copy(merge->ss_all);
-		suffstats_sub(merge->ss_parent, ss_aa);
-		suffstats_sub(merge->ss_parent, ss_bb);
-	}
-
-	merge->ss_self = suffstats_copy(merge->ss_all);
-	suffstats_sub(merge->ss_self, tree_get_suffstats(merge->tree));
-	merge_calc_score(merge);
+	merge_calc_score(merge, ss_aa, ss_bb);
 }
 
-static void merge_calc_score(Merge * merge) {
+/* the global score counts the cells outside the merged tree, and those
+ * outside aa and bb, as off blocks. both are the one shared total less the
+ * counts of the trees themselves, so they are worked out here on the stack
+ * rather than kept with every merge.
+ */
+static void merge_calc_score(Merge * merge, gpointer ss_aa, gpointer ss_bb) {
 	Params * params;
+	Counts ss_self;
+	Counts ss_parent;
 
-	params = tree_get_params(merge->tree);
-	if (!merge_global_score || merge->ss_parent == NULL) {
+	params = merge->params;
+	if (!params->global_score || merge->ss_all == NULL) {
 		/* local score */
 		merge->score = merge->tree_score - params_logprob_offscore(params, merge->ss_offblock);
-	} else {
-		merge->score = merge->tree_score
-			+ params_logprob_offscore(params, merge->ss_self)
-			- params_logprob_offscore(params, merge->ss_parent);
+		return;
+	}
+	/* not in the forest once merged */
+	ss_self = *(Counts *)merge->ss_all;
+	suffstats_sub(&ss_self, merge->ss_on);
+	/* not in the forest before */
+	ss_parent = *(Counts *)merge->ss_all;
+	if (ss_aa != NULL) {
+		suffstats_sub(&ss_parent, ss_aa);
 	}
+	if (ss_bb != NULL) {
+		suffstats_sub(&ss_parent, ss_bb);
+	}
+	merge->score = merge->tree_score
+		+ params_logprob_offscore(params, &ss_self)
+		- params_logprob_offscore(params, &ss_parent);
 }
 
 void merge_println(const Merge * merge, const gchar * prefix) {
@@ -110,57 +191,49 @@ void merge_println(const Merge * merge, const gchar * prefix) {
 
 void merge_tostring(const Merge * merge, GString * out) {
 	g_string_append_printf(out, "%03d + %03d (%2.2e/%1.2e)-> ", merge->ii, merge->jj, merge->score, merge->sym_break);
-	if (merge_debug && merge->ss_parent != NULL) {
-		gpointer ss_tree = tree_get_suffstats(merge->tree);
-		Params * params = tree_get_params(merge->tree);
-		g_string_append_printf(out, "[total tree score: %e, new tree score: %e(%d,%d), self score: %e(%d,%d), parent score: %e(%d,%d), off score %e(%d,%d)]",
+	if (merge_debug && merge->ss_all != NULL) {
+		gpointer ss_tree = merge->ss_on;
+		Params * params = merge->params;
+		g_string_append_printf(out, "[total tree score: %e, new tree counts: (%d,%d), all counts: (%d,%d), off score %e(%d,%d)]",
 				merge->tree_score,
-				tree_get_logprob(merge->tree),
 				((Counts *)ss_tree)->num_ones,
 				((Counts *)ss_tree)->num_total,
-				params_logprob_offscore(params, merge->ss_self),
-				((Counts *)merge->ss_self)->num_ones,
-				((Counts *)merge->ss_self)->num_total,
-				params_logprob_offscore(params, merge->ss_parent),
-				((Counts *)merge->ss_parent)->num_ones,
-				((Counts *)merge->ss_parent)->num_total,
+				((Counts *)merge->ss_all)->num_ones,
+				((Counts *)merge->ss_all)->num_total,
 				params_logprob_offscore(params, merge->ss_offblock),
 				((Counts *)merge->ss_offblock)->num_ones,
 				((Counts *)merge->ss_offblock)->num_total
 		       );
 	}
-	tree_tostring(merge->tree, out);
+	if (merge->tree != NULL) {
+		tree_tostring(merge->tree, out);
+	} else {
+		g_string_append(out, merge->kind == MERGE_JOIN? "(join)": "(absorb)");
+	}
 }
 
-Merge * merge_join(GRand * rng, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
-	Tree * tree;
-	Merge * merge;
+Merge * merge_join(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
+	return merge_join_offblock(sym_break, parent, params, ii, aa, jj, bb,
+			merge_get_offblock(params, aa, bb));
+}
 
-	tree = branch_new(params);
-	branch_add_child(tree, aa);
-	branch_add_child(tree, bb);
-	merge = merge_new(rng, parent, params, ii, aa, jj, bb, tree);
-	tree_unref(tree);
-	return merge;
+/* as merge_join, with the offblock of aa and bb given rather than looked
+ * up; it need not be in the sscache.
+ */
+Merge * merge_join_offblock(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, gpointer offblock) {
+	return merge_new_score_only(sym_break, parent, params, ii, aa, jj, bb, MERGE_JOIN, offblock);
 }
 
-Merge * merge_absorb(GRand * rng, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
+Merge * merge_absorb(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
 	/* absorb bb as a child of aa */
-	Tree * tree;
-	Merge * merge;
-
 	if (tree_is_leaf(aa) || params->binary_only) {
 		return NULL;
 	}
-
-	tree = tree_copy(aa);
-	branch_add_child(tree, bb);
-	merge = merge_new(rng, parent, params, ii, aa, jj, bb, tree);
-	tree_unref(tree);
-	return merge;
+	return merge_new_score_only(sym_break, parent, params, ii, aa, jj, bb, MERGE_ABSORB,
+			merge_get_offblock(params, aa, bb));
 }
 
-Merge * merge_collapse(GRand * rng, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
+Merge * merge_collapse(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
 	/* make children of aa and children of bb all children of a new node */
 	Tree * tree;
 	Merge * merge;
@@ -177,32 +250,45 @@ Merge * merge_collapse(GRand * rng, Merge * parent, Params * params, guint ii, T
 	for (child = branch_get_children(bb); child != NULL; child = g_list_next(child)) {
 		branch_add_child(tree, child->data);
 	}
-	merge = merge_new(rng, parent, params, ii, aa, jj, bb, tree);
+	merge = merge_new(sym_break, parent, params, ii, aa, jj, bb, tree);
 	tree_unref(tree);
 	return merge;
 }
 
-Merge * merge_best(GRand * rng, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
-	Merge * merge;
+static Merge * merge_better(Merge * best_merge, Merge * merge) {
+	if (merge == NULL) {
+		return best_merge;
+	}
+	if (merge->score > best_merge->score) {
+		merge_free(best_merge);
+		return merge;
+	}
+	merge_free(merge);
+	return best_merge;
+}
+
+/* the three candidates share one offblock lookup and one sym_break, so
+ * the result depends only on the trees and sym_break. safe to call from
+ * several threads at once, provided parent and the trees are not modified.
+ */
+Merge * merge_best(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb) {
+	return merge_best_offblock(sym_break, parent, params, ii, aa, jj, bb,
+			merge_get_offblock(params, aa, bb));
+}
+
+/* as merge_join_offblock, for merge_best. */
+Merge * merge_best_offblock(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, gpointer offblock) {
 	Merge * best_merge;
 
-	best_merge = merge_join(rng, parent, params, ii, aa, jj, bb);
-	merge = merge_absorb(rng, parent, params, ii, aa, jj, bb);
-	if (merge != NULL) {
-		if (merge->score > best_merge->score) {
-			merge_free(best_merge);
-			best_merge = merge;
-		} else {
-			merge_free(merge);
+	best_merge = merge_new_score_only(sym_break, parent, params, ii, aa, jj, bb, MERGE_JOIN, offblock);
+	if (!params->binary_only) {
+		if (!tree_is_leaf(aa)) {
+			best_merge = merge_better(best_merge,
+				merge_new_score_only(sym_break, parent, params, ii, aa, jj, bb, MERGE_ABSORB, offblock));
 		}
-	}
-	merge = merge_absorb(rng, parent, params, jj, bb, ii, aa);
-	if (merge != NULL) {
-		if (merge->score > best_merge->score) {
-			merge_free(best_merge);
-			best_merge = merge;
-		} else {
-			merge_free(merge);
+		if (!tree_is_leaf(bb)) {
+			best_merge = merge_better(best_merge,
+				merge_new_score_only(sym_break, parent, params, jj, bb, ii, aa, MERGE_ABSORB, offblock));
 		}
 	}
 	return best_merge;
@@ -5,33 +5,51 @@
 #include "params.h"
 #include "tree.h"
 
+typedef enum {
+	/* a new branch with children aa and bb */
+	MERGE_JOIN,
+	/* bb added as a child of (a copy of) aa */
+	MERGE_ABSORB
+} MergeKind;
+
 typedef struct {
 	guint ii;
 	guint jj;
+	MergeKind kind;
+	/* not referenced */
+	Params * params;
+	/* the merged tree: only built by merge_materialize */
 	Tree * tree;
 	gdouble tree_score;
 	gdouble score;
 	/* break equal scores at random */
 	gdouble sym_break;
+	/* suff stats of the merged tree, kept for the global score */
+	gpointer ss_on;
 	/* suff stats between leaves of this tree */
 	gpointer ss_offblock;
-	/* suff stats for all */
+	/* suff stats between all the initial trees: one total, shared */
 	gpointer ss_all;
-	/* suff stats for elements not in parent forest */
-	gpointer ss_parent;
-	/* suff stats for elements not in forest at time of creation */
-	gpointer ss_self;
+	/* position in the heap of candidates (see dheap_new) */
+	guint heap_index;
+	/* positions in the candidate lists of ii and jj (see build.c) */
+	guint ii_index;
+	guint jj_index;
 } Merge;
 
 
-Merge * merge_new(GRand * rng, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, Tree * mm);
+Merge * merge_new(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, Tree * mm);
 void merge_free(Merge * merge);
 void merge_notify_pair(Merge *, gpointer);
+Tree * merge_materialize(Merge * merge, Tree * aa, Tree * bb);
+Tree * merge_tree_new(Params * params, MergeKind kind, Tree * aa, Tree * bb);
 
-Merge * merge_best(GRand *, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
-Merge * merge_absorb(GRand *, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
-Merge * merge_join(GRand *, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
-Merge * merge_collapse(GRand *, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
+Merge * merge_best(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
+Merge * merge_best_offblock(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, gpointer offblock);
+Merge * merge_absorb(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
+Merge * merge_join(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
+Merge * merge_join_offblock(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb, gpointer offblock);
+Merge * merge_collapse(gdouble sym_break, Merge * parent, Params * params, guint ii, Tree * aa, guint jj, Tree * bb);
 
 void merge_println(const Merge * merge, const gchar * prefix);
 void merge_tostring(const Merge * merge, GString * out);
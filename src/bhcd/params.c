@@ -3,8 +3,8 @@
 #include "counts.h"
 #include "params.h"
 
-// allocate at most ~1GB for the cache.
-#define	MAX_CACHE_SIZE	11585
+// counts up to this are served from the lngamma tables (~32MB per cache).
+#define	MAX_CACHE_SIZE	(1 << 20)
 
 typedef void (*ParamsSetFunc)(Params *, gdouble);
 
@@ -13,7 +13,6 @@ static void params_set_alpha(Params *, gdouble);
 static void params_set_beta(Params *, gdouble);
 static void params_set_delta(Params *, gdouble);
 static void params_set_lambda(Params *, gdouble);
-static Params * params_copy(const Params * );
 
 typedef struct {
 	gdouble lower;
@@ -25,25 +24,32 @@ static const ParamsSpec params_spec_alpha  = { .lower = 0.0, .upper = 1.0, .set_
 static const ParamsSpec params_spec_beta   = { .lower = 0.0, .upper = 1.0, .set_value = params_set_beta   };
 static const ParamsSpec params_spec_delta  = { .lower = 0.0, .upper = 1.0, .set_value = params_set_delta  };
 static const ParamsSpec params_spec_lambda = { .lower = 0.0, .upper = 1.0, .set_value = params_set_lambda };
-static const guint max_cached_count = 100;
 
 
 Params * params_new(Dataset * dataset, gdouble gamma, gdouble alpha, gdouble beta, gdouble delta, gdouble lambda) {
+	guint num_labels;
 	guint cache_size;
 	Params * params = g_new(Params, 1);
 	params->ref_count = 1;
+	params->version = 0;
 
 	params->dataset = dataset;
 	dataset_ref(dataset);
 	params->sscache = sscache_new(dataset, FALSE);
 
 	params->binary_only = FALSE;
+	params->global_score = FALSE;
 
 	params_set_gamma(params, gamma);
 
-	cache_size = dataset_num_labels(dataset);
-	if (cache_size > MAX_CACHE_SIZE) {
+	/* no block holds more than one count per ordered pair of labels, plus
+	 * one for predictions.
+	 */
+	num_labels = dataset_num_labels(dataset);
+	if (num_labels >= 1024) {
 		cache_size = MAX_CACHE_SIZE;
+	} else {
+		cache_size = MIN(num_labels*num_labels + 2, MAX_CACHE_SIZE);
 	}
 	/* SEE ALSO: params_set_alpha, params_set_beta */
 	params->alpha = alpha;
@@ -58,14 +64,21 @@ Params * params_new(Dataset * dataset, gdouble gamma, gdouble alpha, gdouble bet
 	return params;
 }
 
-static Params * params_copy(const Params * orig) {
-	Params * params;
+/* a copy with its own sscache, so that it can be built with on another
+ * thread. the lnbeta tables are shared with params, so neither may have
+ * its hyperparameters changed while both are in use.
+ */
+Params * params_fork(Params * params) {
+	Params * fork;
 
-	params = params_new(orig->dataset, orig->gamma,
-			orig->alpha, orig->beta,
-			orig->delta, orig->lambda);
-	params->binary_only = orig->binary_only;
-	return params;
+	fork = g_new(Params, 1);
+	*fork = *params;
+	fork->ref_count = 1;
+	dataset_ref(fork->dataset);
+	fork->sscache = sscache_new(fork->dataset, fork->sparse);
+	lnbetacache_ref(fork->logbeta_alpha_beta);
+	lnbetacache_ref(fork->logbeta_delta_lambda);
+	return fork;
 }
 
 void params_reset_cache(Params *params) {
@@ -102,28 +115,36 @@ Params * params_default(Dataset * dataset) {
 }
 
 static void params_set_gamma(Params * params, gdouble gamma) {
+	params->version++;
 	params->gamma = gamma;
 	params->loggamma = gsl_sf_log(1.0 - gamma);
 }
 
+/* the setters below reuse the existing lnbeta tables, which recompute only
+ * the entries subsequently looked up.
+ */
 static void params_set_alpha(Params * params, gdouble alpha) {
+	params->version++;
 	params->alpha = alpha;
-	params->logbeta_alpha_beta = lnbetacache_new(params->alpha, params->beta, max_cached_count);
+	lnbetacache_set_hypers(params->logbeta_alpha_beta, params->alpha, params->beta);
 }
 
 static void params_set_beta(Params * params, gdouble beta) {
+	params->version++;
 	params->beta = beta;
-	params->logbeta_alpha_beta = lnbetacache_new(params->alpha, params->beta, max_cached_count);
+	lnbetacache_set_hypers(params->logbeta_alpha_beta, params->alpha, params->beta);
 }
 
 static void params_set_delta(Params * params, gdouble delta) {
+	params->version++;
 	params->delta = delta;
-	params->logbeta_delta_lambda = lnbetacache_new(params->delta, params->lambda, max_cached_count);
+	lnbetacache_set_hypers(params->logbeta_delta_lambda, params->delta, params->lambda);
 }
 
 static void params_set_lambda(Params * params, gdouble lambda) {
+	params->version++;
 	params->lambda = lambda;
-	params->logbeta_delta_lambda = lnbetacache_new(params->delta, params->lambda, max_cached_count);
+	lnbetacache_set_hypers(params->logbeta_delta_lambda, params->delta, params->lambda);
 }
 
 gdouble params_logprob_on(Params * params, gpointer pcounts) {
@@ -185,12 +206,10 @@ gdouble params_logpred_off(Params * params, gpointer pcounts, gboolean value) {
 }
 
 
-static Params * params_sample_full(GRand * rng, const Params * orig, gdouble cur, const ParamsSpec * spec, ParamsProbFunc func, gpointer user_data) {
-	Params * params;
+static void params_sample_full(GRand * rng, Params * params, gdouble cur, const ParamsSpec * spec, ParamsProbFunc func, gpointer user_data) {
 	gdouble lower, upper;
 	gdouble yy, prop;
 
-	params = params_copy(orig);
 	lower = spec->lower;
 	upper = spec->upper;
 	yy = gsl_sf_log(g_rand_double(rng)) + func(params, user_data);
@@ -199,7 +218,7 @@ static Params * params_sample_full(GRand * rng, const Params * orig, gdouble cur
 		prop = g_rand_double_range(rng, lower, upper);
 		spec->set_value(params, prop);
 		if (yy < func(params, user_data)) {
-			goto out;
+			return;
 		}
 		if (prop < cur) {
 			lower = prop;
@@ -207,23 +226,20 @@ static Params * params_sample_full(GRand * rng, const Params * orig, gdouble cur
 			upper = prop;
 		}
 	}
-out:
-	return params;
 }
 
 
-Params * params_sample(GRand * rng, Params * params, ParamsProbFunc func, gpointer user_data) {
-	Params * new_params;
-
-	new_params = params;
+/* slice sample the hyperparameters in place. func must recompute anything
+ * it caches when params->version changes (tree_set_params does).
+ */
+void params_sample(GRand * rng, Params * params, ParamsProbFunc func, gpointer user_data) {
 	for (guint ministep = 0; ministep < 10; ministep++) {
-		new_params = params_sample_full(rng, new_params, params->gamma,      &params_spec_gamma, func, user_data);
-		new_params = params_sample_full(rng, new_params, new_params->alpha,  &params_spec_alpha, func, user_data);
-		new_params = params_sample_full(rng, new_params, new_params->beta,   &params_spec_beta, func, user_data);
-		new_params = params_sample_full(rng, new_params, new_params->delta,  &params_spec_delta, func, user_data);
-		new_params = params_sample_full(rng, new_params, new_params->lambda, &params_spec_lambda, func, user_data);
+		params_sample_full(rng, params, params->gamma,  &params_spec_gamma, func, user_data);
+		params_sample_full(rng, params, params->alpha,  &params_spec_alpha, func, user_data);
+		params_sample_full(rng, params, params->beta,   &params_spec_beta, func, user_data);
+		params_sample_full(rng, params, params->delta,  &params_spec_delta, func, user_data);
+		params_sample_full(rng, params, params->lambda, &params_spec_lambda, func, user_data);
 	}
-	return new_params;
 }
 
 
@@ -10,9 +10,13 @@ typedef struct {
 	/* private: */
 	guint		ref_count;
 	/* public: */
+	/* bumped whenever a hyperparameter changes */
+	guint		version;
 	Dataset *	dataset;
 	SSCache *	sscache;
 	gboolean	binary_only;
+	/* score merges against the whole forest, not just the pair */
+	gboolean	global_score;
 	gboolean	sparse;
 
 	gdouble		gamma;
@@ -33,6 +37,7 @@ typedef gdouble (*ParamsProbFunc)(Params *, gpointer);
 
 Params * params_new(Dataset * dataset, gdouble gamma, gdouble alpha, gdouble beta, gdouble delta, gdouble lambda);
 Params * params_default(Dataset * dataset);
+Params * params_fork(Params *);
 void params_reset_cache(Params *);
 void params_set_sparse(Params *, gboolean);
 void params_ref(Params * params);
@@ -44,6 +49,6 @@ gdouble params_logprob_on(Params *, gpointer);
 gdouble params_logpred_off(Params *, gpointer, gboolean);
 gdouble params_logpred_on(Params *, gpointer, gboolean);
 
-Params * params_sample(GRand * rng, Params * params, ParamsProbFunc func, gpointer user_data);
+void params_sample(GRand * rng, Params * params, ParamsProbFunc func, gpointer user_data);
 
 #endif
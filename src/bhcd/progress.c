@@ -0,0 +1,79 @@
+#include "progress.h"
+#include "util.h"
+
+/* reports to func every interval seconds, shared by the restarts and
+ * components of a build (see build_set_progress), which report one at a
+ * time under lock. start is when build_run began.
+ */
+struct Progress_t {
+	gint ref_count;
+	BuildProgressFunc func;
+	gpointer data;
+	gdouble interval;
+	gint64 start;
+	GMutex lock;
+};
+
+
+Progress * progress_new(gdouble interval, BuildProgressFunc func, gpointer user_data) {
+	Progress * progress;
+
+	g_assert(interval >= 0.0);
+	g_assert(func != NULL);
+	progress = g_new(Progress, 1);
+	progress->ref_count = 1;
+	progress->func = func;
+	progress->data = user_data;
+	progress->interval = interval;
+	progress->start = g_get_monotonic_time();
+	g_mutex_init(&progress->lock);
+	return progress;
+}
+
+/* restarts may be let go on their own threads */
+Progress * progress_ref(Progress * progress) {
+	g_atomic_int_inc(&progress->ref_count);
+	return progress;
+}
+
+void progress_unref(Progress * progress) {
+	if (g_atomic_int_dec_and_test(&progress->ref_count)) {
+		g_mutex_clear(&progress->lock);
+		g_free(progress);
+	}
+}
+
+void progress_start(Progress * progress) {
+	progress->start = g_get_monotonic_time();
+}
+
+/* a build about to begin merging */
+void progress_mark_init(ProgressMark * mark) {
+	mark->usec = g_get_monotonic_time();
+	mark->num_merges = 0;
+}
+
+gboolean progress_due(Progress * progress, const ProgressMark * mark) {
+	return g_get_monotonic_time() >= mark->usec + (gint64)(progress->interval*G_USEC_PER_SEC);
+}
+
+/* fill in the times and memory of report, which the build filled in the
+ * rest of, and report it.
+ */
+void progress_report(Progress * progress, ProgressMark * mark, BuildProgress * report) {
+	gint64 now;
+
+	now = g_get_monotonic_time();
+	report->elapsed = (gdouble)(now - progress->start)/G_USEC_PER_SEC;
+	report->merges_per_sec = 0.0;
+	if (now > mark->usec) {
+		report->merges_per_sec = (gdouble)(report->num_merges - mark->num_merges)
+			/ ((gdouble)(now - mark->usec)/G_USEC_PER_SEC);
+	}
+	report->rss = mem_resident();
+	g_mutex_lock(&progress->lock);
+	progress->func(report, progress->data);
+	g_mutex_unlock(&progress->lock);
+	mark->usec = now;
+	mark->num_merges = report->num_merges;
+}
@@ -0,0 +1,27 @@
+#ifndef	PROGRESS_H
+#define	PROGRESS_H
+
+#include <glib.h>
+#include "build.h"
+
+struct Progress_t;
+typedef struct Progress_t Progress;
+
+/* when a build (one restart or component) last reported, and its merges
+ * done then.
+ */
+typedef struct {
+	gint64	usec;
+	guint	num_merges;
+} ProgressMark;
+
+Progress * progress_new(gdouble interval, BuildProgressFunc func, gpointer user_data);
+Progress * progress_ref(Progress *);
+void progress_unref(Progress *);
+void progress_start(Progress *);
+void progress_mark_init(ProgressMark * mark);
+gboolean progress_due(Progress *, const ProgressMark * mark);
+void progress_report(Progress *, ProgressMark * mark, BuildProgress * report);
+
+
+#endif /*PROGRESS_H*/
@@ -7,13 +7,34 @@ static const gboolean cache_debug = FALSE;
 static const gboolean cache_symmetric = FALSE;
 static const gboolean cache_disable_offblock = FALSE;
 
+/* lookups and fills may come from several threads at once (see build.c).
+ * the offblocks are split by key hash into shards, each with its own lock,
+ * so threads filling in different entries rarely wait for each other.
+ * entries are never removed while the cache is alive, so the suffstats
+ * returned stay valid after the lock is dropped.
+ */
+#define	SSCACHE_SHARD_BITS	6
+#define	SSCACHE_NUM_SHARDS	(1 << SSCACHE_SHARD_BITS)
+
+typedef struct {
+	GRWLock		lock;
+	GHashTable *	offblocks;
+	/* if counting, the lookups of offblocks, and those found */
+	gint		lookups;
+	gint		hits;
+	/* keep the locks of neighbouring shards off each other's cache line */
+	gchar		pad[64 - sizeof(GRWLock) - sizeof(GHashTable *) - 2*sizeof(gint)];
+} SSCacheShard;
+
 struct SSCache_t {
 	guint		ref_count;
 	gboolean	enable_sparse;
+	gboolean	count_hits;
 	Dataset *	dataset;
 	Labelset *	emptyset;
+	GRWLock		labels_lock;
 	GHashTable *	suffstats_labels;
-	GHashTable *	suffstats_offblocks;
+	SSCacheShard	shards[SSCACHE_NUM_SHARDS];
 };
 
 
@@ -27,6 +48,9 @@ static Offblock_Key * offblock_key_new(Labelset * fst, Labelset * snd);
 static void offblock_key_free(gpointer pkey);
 static gboolean offblock_key_equal(gconstpointer paa, gconstpointer pbb);
 static guint offblock_key_hash(gconstpointer pkey);
+static SSCacheShard * sscache_shard(SSCache *cache, const Offblock_Key * key);
+static gpointer sscache_offblocks_lookup(SSCache *cache, const Offblock_Key * key);
+static gpointer sscache_offblocks_insert(SSCache *cache, Offblock_Key * key, gpointer suffstats);
 static gpointer sscache_lookup_offblock_sparse(SSCache *cache, Labelset * kk, Labelset * zz);
 static gpointer sscache_lookup_offblock_merge(SSCache *cache, Labelset * xx, Labelset * yy_left, Labelset * yy_right);
 static gpointer sscache_lookup_offblock_simple(SSCache *cache, Labelset * xx, Labelset * yy);
@@ -39,20 +63,31 @@ SSCache * sscache_new(Dataset *dataset, gboolean sparse) {
 	cache = g_new(SSCache, 1);
 	cache->ref_count = 1;
 	cache->enable_sparse = sparse;
+	cache->count_hits = FALSE;
 	cache->dataset = dataset;
 	dataset_ref(cache->dataset);
 	cache->emptyset = labelset_new(cache->dataset);
+	g_rw_lock_init(&cache->labels_lock);
 	cache->suffstats_labels = g_hash_table_new_full(NULL, NULL, NULL, suffstats_unref);
-	cache->suffstats_offblocks = g_hash_table_new_full(
-			offblock_key_hash, offblock_key_equal,
-			offblock_key_free, suffstats_unref);
+	for (guint ii = 0; ii < SSCACHE_NUM_SHARDS; ii++) {
+		g_rw_lock_init(&cache->shards[ii].lock);
+		cache->shards[ii].lookups = 0;
+		cache->shards[ii].hits = 0;
+		cache->shards[ii].offblocks = g_hash_table_new_full(
+				offblock_key_hash, offblock_key_equal,
+				offblock_key_free, suffstats_unref);
+	}
 	return cache;
 }
 
 void sscache_unref(SSCache *cache) {
 	if (cache->ref_count <= 1) {
 		g_hash_table_unref(cache->suffstats_labels);
-		g_hash_table_unref(cache->suffstats_offblocks);
+		g_rw_lock_clear(&cache->labels_lock);
+		for (guint ii = 0; ii < SSCACHE_NUM_SHARDS; ii++) {
+			g_hash_table_unref(cache->shards[ii].offblocks);
+			g_rw_lock_clear(&cache->shards[ii].lock);
+		}
 		labelset_unref(cache->emptyset);
 		dataset_unref(cache->dataset);
 		g_free(cache);
@@ -63,9 +98,14 @@ void sscache_unref(SSCache *cache) {
 
 gpointer sscache_get_label(SSCache *cache, gconstpointer label) {
 	gpointer suffstats;
-
-	if (!g_hash_table_lookup_extended(cache->suffstats_labels,
-				label, NULL, &suffstats)) {
+	gboolean found;
+
+	g_rw_lock_reader_lock(&cache->labels_lock);
+	found = g_hash_table_lookup_extended(cache->suffstats_labels,
+				label, NULL, &suffstats);
+	g_rw_lock_reader_unlock(&cache->labels_lock);
+	if (!found) {
+		gpointer existing;
 		gboolean missing;
 		gboolean value;
 
@@ -78,12 +118,89 @@ gpointer sscache_get_label(SSCache *cache, gconstpointer label) {
 		/* the ptr2int int2ptr dance is to express that we are really
 		 * respecting the const annotation above... oh gcc.
 		 */
-		g_hash_table_insert(cache->suffstats_labels,
-				GINT_TO_POINTER(GPOINTER_TO_INT(label)),
-				suffstats);
+		g_rw_lock_writer_lock(&cache->labels_lock);
+		if (g_hash_table_lookup_extended(cache->suffstats_labels,
+					label, NULL, &existing)) {
+			/* another thread got here first */
+			suffstats_unref(suffstats);
+			suffstats = existing;
+		} else {
+			g_hash_table_insert(cache->suffstats_labels,
+					GINT_TO_POINTER(GPOINTER_TO_INT(label)),
+					suffstats);
+		}
+		g_rw_lock_writer_unlock(&cache->labels_lock);
+	}
+	return suffstats;
+
+}
+
+static SSCacheShard * sscache_shard(SSCache *cache, const Offblock_Key * key) {
+	/* labelset hashes are poorly mixed in the low bits */
+	return &cache->shards[(key->hash*2654435761u) >> (32 - SSCACHE_SHARD_BITS)];
+}
+
+static gpointer sscache_offblocks_lookup(SSCache *cache, const Offblock_Key * key) {
+	SSCacheShard * shard;
+	gpointer suffstats;
+
+	shard = sscache_shard(cache, key);
+	g_rw_lock_reader_lock(&shard->lock);
+	suffstats = g_hash_table_lookup(shard->offblocks, key);
+	g_rw_lock_reader_unlock(&shard->lock);
+	if (cache->count_hits) {
+		g_atomic_int_inc(&shard->lookups);
+		if (suffstats != NULL) {
+			g_atomic_int_inc(&shard->hits);
+		}
+	}
+	return suffstats;
+}
+
+/* takes ownership of key and suffstats. if another thread filled in the
+ * same entry meanwhile, that one is kept and returned.
+ */
+static gpointer sscache_offblocks_insert(SSCache *cache, Offblock_Key * key, gpointer suffstats) {
+	SSCacheShard * shard;
+	gpointer existing;
+
+	shard = sscache_shard(cache, key);
+	g_rw_lock_writer_lock(&shard->lock);
+	existing = g_hash_table_lookup(shard->offblocks, key);
+	if (existing == NULL) {
+		g_hash_table_insert(shard->offblocks, key, suffstats);
+	}
+	g_rw_lock_writer_unlock(&shard->lock);
+	if (existing != NULL) {
+		offblock_key_free(key);
+		suffstats_unref(suffstats);
+		return existing;
 	}
 	return suffstats;
+}
 
+/* off by default, as for lnbetacache_set_count_hits. */
+void sscache_set_count_hits(SSCache * cache, gboolean value) {
+	g_assert(value == FALSE || value == TRUE);
+	cache->count_hits = value;
+}
+
+/* the offblocks held, and the lookups of them (and those found) while
+ * counting hits. only a snapshot if other threads are using cache.
+ */
+void sscache_get_stats(SSCache * cache, guint * num_entries, guint * num_lookups, guint * num_hits) {
+	*num_entries = 0;
+	*num_lookups = 0;
+	*num_hits = 0;
+	for (guint ii = 0; ii < SSCACHE_NUM_SHARDS; ii++) {
+		SSCacheShard * shard = &cache->shards[ii];
+
+		g_rw_lock_reader_lock(&shard->lock);
+		*num_entries += g_hash_table_size(shard->offblocks);
+		g_rw_lock_reader_unlock(&shard->lock);
+		*num_lookups += (guint)g_atomic_int_get(&shard->lookups);
+		*num_hits += (guint)g_atomic_int_get(&shard->hits);
+	}
 }
 
 static Offblock_Key * offblock_key_new(Labelset * fst, Labelset * snd) {
@@ -154,7 +271,7 @@ gpointer sscache_get_offblock(SSCache *cache, Labelset * xx_left, Labelset * xx_
 	key = offblock_key_new(xx, yy);
 
 	if (!cache_disable_offblock) {
-		suffstats = g_hash_table_lookup(cache->suffstats_offblocks, key);
+		suffstats = sscache_offblocks_lookup(cache, key);
 	} else {
 		suffstats = sscache_lookup_offblock_naive(cache, xx, yy);
 		g_assert(suffstats != NULL);
@@ -226,7 +343,7 @@ gpointer sscache_get_offblock(SSCache *cache, Labelset * xx_left, Labelset * xx_
 				g_assert(FALSE);
 			}
 		}
-		g_hash_table_insert(cache->suffstats_offblocks, key, suffstats);
+		suffstats = sscache_offblocks_insert(cache, key, suffstats);
 	} else {
 free_key_out:
 		offblock_key_free(key);
@@ -236,6 +353,165 @@ free_key_out:
 	return suffstats;
 }
 
+/* the offblock between xx and yy, counted from the stored cells around
+ * the labels of the smaller of the two, so it needs no decomposition and
+ * costs their degree rather than |xx||yy|. it is cached like any other,
+ * under copies of xx and yy, as they may be the labels of a branch that
+ * grows in place.
+ */
+gpointer sscache_get_offblock_direct(SSCache *cache, Labelset * xx, Labelset * yy) {
+	Offblock_Key * key;
+	Counts * counts;
+
+	key = offblock_key_new(xx, yy);
+	counts = sscache_offblocks_lookup(cache, key);
+	offblock_key_free(key);
+	if (counts != NULL) {
+		return counts;
+	}
+	counts = suffstats_new_empty();
+	sscache_count_offblock(cache, xx, yy, counts);
+	if (cache_debug) {
+		g_print("sscache_get_offblock_direct: ");
+		suffstats_print(counts);
+		g_print("\n");
+	}
+	xx = labelset_copy(xx);
+	yy = labelset_copy(yy);
+	key = offblock_key_new(xx, yy);
+	labelset_unref(xx);
+	labelset_unref(yy);
+	return sscache_offblocks_insert(cache, key, counts);
+}
+
+/* the offblock between xx and yy into counts, as
+ * sscache_get_offblock_direct finds it, but neither looked up nor cached.
+ */
+void sscache_count_offblock(SSCache *cache, Labelset * xx, Labelset * yy, Counts * counts) {
+	LabelsetIter iter;
+	gpointer ii;
+	gboolean sparse;
+	gboolean omitted;
+
+	if (labelset_count(yy) < labelset_count(xx)) {
+		Labelset * tmp = xx;
+		xx = yy;
+		yy = tmp;
+	}
+
+	/* start with every cell omitted, then correct the stored ones */
+	sparse = dataset_get_sparse(cache->dataset, &omitted);
+	counts->num_ones = 0;
+	counts->num_total = 0;
+	if (sparse) {
+		counts->num_total = labelset_count(xx)*labelset_count(yy);
+		if (!cache_symmetric) {
+			counts->num_total *= 2;
+		}
+		counts->num_ones = omitted? counts->num_total: 0;
+	}
+	labelset_iter_init(&iter, xx);
+	while (labelset_iter_next(&iter, &ii)) {
+		GPtrArray * neighbours = dataset_label_neighbours(cache->dataset, ii);
+
+		for (guint nn = 0; nn < neighbours->len; nn++) {
+			gpointer jj = g_ptr_array_index(neighbours, nn);
+			gboolean missing;
+			gboolean value;
+
+			if (!labelset_contains(yy, jj)) {
+				continue;
+			}
+			g_assert(!labelset_contains(xx, jj));
+			for (guint dir = 0; dir < (cache_symmetric? 1u: 2u); dir++) {
+				if (sparse) {
+					counts->num_total--;
+					counts->num_ones -= (guint)omitted;
+				}
+				if (dir == 0) {
+					value = dataset_get(cache->dataset, ii, jj, &missing);
+				} else {
+					value = dataset_get(cache->dataset, jj, ii, &missing);
+				}
+				counts->num_total += (missing? 0: 1);
+				counts->num_ones  += (missing||!value? 0: 1);
+			}
+		}
+	}
+}
+
+/* the offblocks between xx and each of num_sets disjoint sets of labels,
+ * counted as sscache_count_offblock would, in one pass: label_sets
+ * gives the set of each label (by quark), G_MAXUINT if none, and
+ * set_sizes the labels in each. costs the degree of xx, plus num_sets.
+ * the offblock of a set holding labels of xx is meaningless.
+ */
+void sscache_count_offblocks(SSCache *cache, Labelset * xx, const guint * label_sets, const guint * set_sizes, guint num_sets, Counts * offblocks) {
+	LabelsetIter iter;
+	gpointer ii;
+	gboolean sparse;
+	gboolean omitted;
+	guint num_xx;
+
+	/* start with every cell omitted, then correct the stored ones */
+	sparse = dataset_get_sparse(cache->dataset, &omitted);
+	num_xx = labelset_count(xx);
+	for (guint ss = 0; ss < num_sets; ss++) {
+		offblocks[ss].ref_count = 1;
+		offblocks[ss].num_ones = 0;
+		offblocks[ss].num_total = 0;
+		if (sparse) {
+			offblocks[ss].num_total = num_xx*set_sizes[ss]*(cache_symmetric? 1u: 2u);
+			offblocks[ss].num_ones = omitted? offblocks[ss].num_total: 0;
+		}
+	}
+	labelset_iter_init(&iter, xx);
+	while (labelset_iter_next(&iter, &ii)) {
+		GPtrArray * neighbours = dataset_label_neighbours(cache->dataset, ii);
+
+		for (guint nn = 0; nn < neighbours->len; nn++) {
+			gpointer jj = g_ptr_array_index(neighbours, nn);
+			Counts * counts;
+
+			if (labelset_contains(xx, jj) || label_sets[GPOINTER_TO_INT(jj)] == G_MAXUINT) {
+				continue;
+			}
+			counts = &offblocks[label_sets[GPOINTER_TO_INT(jj)]];
+			for (guint dir = 0; dir < (cache_symmetric? 1u: 2u); dir++) {
+				gboolean missing;
+				gboolean value;
+
+				if (sparse) {
+					counts->num_total--;
+					counts->num_ones -= (guint)omitted;
+				}
+				if (dir == 0) {
+					value = dataset_get(cache->dataset, ii, jj, &missing);
+				} else {
+					value = dataset_get(cache->dataset, jj, ii, &missing);
+				}
+				counts->num_total += (missing? 0: 1);
+				counts->num_ones  += (missing||!value? 0: 1);
+			}
+		}
+	}
+}
+
+/* cache suffstats as the offblock between xx and yy, if there is none
+ * yet: for one counted by sscache_count_offblocks. returns that cached.
+ */
+gpointer sscache_put_offblock(SSCache *cache, Labelset * xx, Labelset * yy, gpointer suffstats) {
+	Offblock_Key * key;
+
+	xx = labelset_copy(xx);
+	yy = labelset_copy(yy);
+	key = offblock_key_new(xx, yy);
+	labelset_unref(xx);
+	labelset_unref(yy);
+	suffstats_ref(suffstats);
+	return sscache_offblocks_insert(cache, key, suffstats);
+}
+
 static gpointer sscache_lookup_offblock_merge(SSCache *cache, Labelset * xx, Labelset * yy_left, Labelset * yy_right) {
 	gpointer suffstats, off_left, off_right, off_sparse;
 
@@ -299,8 +575,8 @@ static gpointer sscache_lookup_offblock_simple(SSCache *cache, Labelset * ii, La
 	}
 
 	key = offblock_key_new(ii, jj);
-	if (!g_hash_table_lookup_extended(cache->suffstats_offblocks,
-				key, NULL, &suffstats)) {
+	suffstats = sscache_offblocks_lookup(cache, key);
+	if (suffstats == NULL) {
 		offblock_key_free(key);
 		if (cache_debug) {
 			g_print("sscache_lookup_offblock_simple end: fail\n");
@@ -348,6 +624,20 @@ static gpointer sscache_lookup_offblock_full(SSCache *cache, gconstpointer ii, g
 }
 
 
+/* the offblock the sparse lookup takes for num_pairs pairs of labels with
+ * no edge between them. owned by the caller.
+ */
+gpointer sscache_get_offblock_sparse(SSCache *cache, guint num_pairs) {
+	Counts * counts;
+
+	counts = suffstats_new_empty();
+	counts->num_total = num_pairs;
+	if (!cache_symmetric) {
+		counts->num_total *= 2;
+	}
+	return counts;
+}
+
 static gpointer sscache_lookup_offblock_sparse(SSCache *cache, Labelset * kk, Labelset *zz) {
 	Counts * counts;
 
@@ -355,11 +645,7 @@ static gpointer sscache_lookup_offblock_sparse(SSCache *cache, Labelset * kk, La
 		g_print("sparse not enabled\n");
 		return NULL;
 	}
-	counts = suffstats_new_empty();
-	counts->num_total = labelset_count(kk)*labelset_count(zz);
-	if (!cache_symmetric) {
-		counts->num_total *= 2;
-	}
+	counts = sscache_get_offblock_sparse(cache, labelset_count(kk)*labelset_count(zz));
 	if (cache_debug) {
 		g_print("sparse: ");
 		labelset_print(kk);
@@ -408,17 +694,23 @@ static gpointer sscache_lookup_offblock_naive(SSCache *cache, Labelset * xx, Lab
 
 
 void sscache_println(SSCache * cache, const gchar * prefix) {
-	GList * keys = g_hash_table_get_keys(cache->suffstats_offblocks);
-	for (; keys != NULL; keys = g_list_next(keys)) {
-		Offblock_Key *key = keys->data;
-		g_print(" (");
-		labelset_print(key->fst);
-		g_print(", ");
-		labelset_print(key->snd);
-		g_print(")");
-		if (g_list_next(keys) != NULL) {
+	gboolean first = TRUE;
+
+	for (guint ii = 0; ii < SSCACHE_NUM_SHARDS; ii++) {
+		GList * keys = g_hash_table_get_keys(cache->shards[ii].offblocks);
+		for (GList * xx = keys; xx != NULL; xx = g_list_next(xx)) {
+			Offblock_Key *key = xx->data;
+			if (!first) {
+				g_print(", ");
+			}
+			first = FALSE;
+			g_print(" (");
+			labelset_print(key->fst);
 			g_print(", ");
+			labelset_print(key->snd);
+			g_print(")");
 		}
+		g_list_free(keys);
 	}
 	g_print("\n");
 }
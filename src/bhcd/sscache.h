@@ -4,6 +4,7 @@
 #include <glib.h>
 #include "dataset.h"
 #include "labelset.h"
+#include "counts.h"
 
 struct SSCache_t;
 typedef struct SSCache_t SSCache;
@@ -11,7 +12,14 @@ typedef struct SSCache_t SSCache;
 SSCache * sscache_new(Dataset *, gboolean);
 gpointer sscache_get_label(SSCache *cache, gconstpointer label);
 gpointer sscache_get_offblock(SSCache *cache, Labelset * xx_left, Labelset * xx_right, Labelset * yy_left, Labelset * yy_right);
+gpointer sscache_get_offblock_direct(SSCache *cache, Labelset * xx, Labelset * yy);
+void sscache_count_offblock(SSCache *cache, Labelset * xx, Labelset * yy, Counts * counts);
+void sscache_count_offblocks(SSCache *cache, Labelset * xx, const guint * label_sets, const guint * set_sizes, guint num_sets, Counts * offblocks);
+gpointer sscache_put_offblock(SSCache *cache, Labelset * xx, Labelset * yy, gpointer suffstats);
 gpointer sscache_get_offblock_full(SSCache *cache, gconstpointer ii, gconstpointer jj);
+gpointer sscache_get_offblock_sparse(SSCache *cache, guint num_pairs);
+void sscache_set_count_hits(SSCache * cache, gboolean value);
+void sscache_get_stats(SSCache * cache, guint * num_entries, guint * num_lookups, guint * num_hits);
 void sscache_println(SSCache * cache, const gchar * prefix);
 void sscache_unref(SSCache *cache);
 
@@ -0,0 +1,49 @@
+#include "subsample.h"
+#include "util.h"
+
+/* building on a subsample of the labels (see build_set_subsample): the
+ * leaves kept are merged as usual, and the rest inserted after.
+ */
+
+static gint subsample_cmp_label(gconstpointer paa, gconstpointer pbb) {
+	return cmp_quark(*(gconstpointer const *)paa, *(gconstpointer const *)pbb);
+}
+
+/* keep num_sample of the leaves in trees, by a partial shuffle drawing from
+ * rng, and put the labels of the rest in rest, in label order.
+ */
+void subsample_trees(GPtrArray * trees, guint num_sample, GRand * rng, GPtrArray * rest) {
+	g_ptr_array_set_size(rest, 0);
+	if (trees->len <= num_sample) {
+		return;
+	}
+	for (guint ii = 0; ii < num_sample; ii++) {
+		guint jj = (guint)g_rand_int_range(rng, (gint32)ii, (gint32)trees->len);
+		gpointer tmp = g_ptr_array_index(trees, ii);
+
+		g_ptr_array_index(trees, ii) = g_ptr_array_index(trees, jj);
+		g_ptr_array_index(trees, jj) = tmp;
+	}
+	for (guint ii = num_sample; ii < trees->len; ii++) {
+		gconstpointer label = leaf_get_label(g_ptr_array_index(trees, ii));
+
+		g_ptr_array_add(rest, GINT_TO_POINTER(GPOINTER_TO_INT(label)));
+	}
+	/* so where each goes does not depend on the shuffle */
+	g_ptr_array_sort(rest, subsample_cmp_label);
+	g_ptr_array_set_size(trees, (gint)num_sample);
+}
+
+/* insert the labels in rest into root, whose reference is taken, and
+ * return the new root. empties rest.
+ */
+Tree * subsample_insert_rest(Tree * root, GPtrArray * rest) {
+	for (guint ii = 0; ii < rest->len; ii++) {
+		Tree * new_root = tree_insert_leaf(root, g_ptr_array_index(rest, ii));
+
+		tree_unref(root);
+		root = new_root;
+	}
+	g_ptr_array_set_size(rest, 0);
+	return root;
+}
@@ -0,0 +1,11 @@
+#ifndef	SUBSAMPLE_H
+#define	SUBSAMPLE_H
+
+#include <glib.h>
+#include "tree.h"
+
+void subsample_trees(GPtrArray * trees, guint num_sample, GRand * rng, GPtrArray * rest);
+Tree * subsample_insert_rest(Tree * root, GPtrArray * rest);
+
+
+#endif /*SUBSAMPLE_H*/
@@ -1,9 +1,13 @@
+#include <string.h>
 #include <glib.h>
 #include <gsl/gsl_sf_log.h>
 #include <gsl/gsl_sf_exp.h>
 #include <gsl/gsl_sf_gamma.h>
 #include <gsl/gsl_sf_pow_int.h>
+#include <glib/gstdio.h>
 #include "bhcd.h"
+#include "islands.h"
+
 
 
 void init_test_toy3(Tree **laa, Tree **lbb, Tree **lcc) {
@@ -295,8 +299,24 @@ void test_tree_logprob4(void) {
 	g_assert(tree_num_intern(tcascade) == 3);
 	assert_eqfloat(tree_get_logprob(tcascade), correct_tcascade, prec);
 
-	merge = merge_join(rng, NULL, params, 0, tcascade_intern, 1, ldd);
-	assert_eqfloat(tree_get_logprob(merge->tree), correct_tcascade, prec);
+	merge = merge_join(g_rand_double(rng), NULL, params, 0, tcascade_intern, 1, ldd);
+	g_assert(merge->tree == NULL);
+	assert_eqfloat(merge->tree_score,
+		correct_tcascade - correct_tcascade_intern - tree_get_logprob(ldd), prec);
+	assert_eqfloat(tree_get_logprob(merge_materialize(merge, tcascade_intern, ldd)), correct_tcascade, prec);
+	merge_free(merge);
+
+	/* absorbing dd into ab gives the 3-flat over ab plus dd */
+	merge = merge_absorb(g_rand_double(rng), NULL, params, 0, tab, 1, ldd);
+	g_assert(merge->tree == NULL);
+	{
+		gdouble score = merge->tree_score;
+		Tree * tabd = merge_materialize(merge, tab, ldd);
+		assert_eqfloat(score,
+			tree_get_logprob(tabd) - correct_tab - tree_get_logprob(ldd), prec);
+		g_assert(tree_num_leaves(tabd) == 3);
+		g_assert(tree_num_intern(tabd) == 1);
+	}
 	merge_free(merge);
 
 	/* deallocate */
@@ -386,6 +406,966 @@ void test_build_logpred4(void) {
 	assert_eqfloat(total_dense, total_sparse, EQFLOAT_DEFAULT_PREC);
 }
 
+typedef void (*TestBuildSetup)(Build *, gpointer);
+
+typedef struct {
+	GRand *	rng;
+	Build *	build;
+} TestBuild;
+
+/* runs a build of dataset from seed, set up by setup (if not NULL), and
+ * returns its best tree, which has every label.
+ */
+static Tree * test_build_run(TestBuild * test, Dataset * dataset, guint32 seed, guint num_restarts, gboolean sparse, TestBuildSetup setup, gpointer data) {
+	Params * params;
+	Tree * root;
+
+	test->rng = g_rand_new_with_seed(seed);
+	params = params_default(dataset);
+	test->build = build_new(test->rng, params, num_restarts, sparse);
+	params_unref(params);
+	if (setup != NULL) {
+		setup(test->build, data);
+	}
+	build_run(test->build);
+	root = build_get_best_tree(test->build);
+	g_assert_cmpuint(tree_num_leaves(root), ==, dataset_num_labels(dataset));
+	return root;
+}
+
+/* appends the best trees to out (if not NULL), and frees the build. */
+static void test_build_free(TestBuild * test, GString * out) {
+	GPtrArray * best = build_get_best_trees(test->build);
+
+	for (guint ii = 0; out != NULL && ii < best->len; ii++) {
+		tree_tostring(g_ptr_array_index(best, ii), out);
+	}
+	build_free(test->build);
+	g_rand_free(test->rng);
+}
+
+static void test_build_threads_setup(Build * build, guint * threads) {
+	build_set_num_threads(build, threads[0]);
+	build_set_restart_threads(build, threads[1]);
+	build_set_num_best_trees(build, 2);
+}
+
+static gchar * test_build_threads_tree(Dataset * dataset, gboolean sparse, guint num_threads, guint restart_threads) {
+	guint threads[] = { num_threads, restart_threads };
+	TestBuild test;
+	GPtrArray * best;
+	GString * out;
+
+	test_build_run(&test, dataset, 7, 3, sparse,
+			(TestBuildSetup)test_build_threads_setup, threads);
+	best = build_get_best_trees(test.build);
+	g_assert_cmpuint(best->len, ==, 2);
+	g_assert(build_get_best_tree(test.build) == g_ptr_array_index(best, 0));
+	assert_lefloat(tree_get_logprob(g_ptr_array_index(best, 1)),
+			tree_get_logprob(g_ptr_array_index(best, 0)), EQFLOAT_DEFAULT_PREC);
+	out = g_string_new("");
+	test_build_free(&test, out);
+	return g_string_free(out, FALSE);
+}
+
+/* enough trees that merges are scored, and the initial ones heapified, on
+ * the workers; restarts run at once must pick the same trees as in turn.
+ */
+void test_build_threads(void) {
+	GRand * rng;
+	Dataset * dataset;
+
+	rng = g_rand_new_with_seed(3);
+	dataset = dataset_gen_blocks(rng, 190, 10, 0.1);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		gchar * serial = test_build_threads_tree(dataset, sparse, 1, 1);
+		gchar * threaded = test_build_threads_tree(dataset, sparse, 4, 1);
+		gchar * restarts = test_build_threads_tree(dataset, sparse, 2, 3);
+		g_assert_cmpstr(serial, ==, threaded);
+		g_assert_cmpstr(serial, ==, restarts);
+		g_free(serial);
+		g_free(threaded);
+		g_free(restarts);
+	}
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+static void test_build_max_cands_setup(Build * build, guint * opts) {
+	build_set_num_threads(build, opts[0]);
+	build_set_max_candidates(build, opts[1]);
+}
+
+static gchar * test_build_max_cands_tree(Dataset * dataset, guint max_cands, guint num_threads) {
+	guint opts[] = { num_threads, max_cands };
+	TestBuild test;
+	GString * out;
+
+	test_build_run(&test, dataset, 5, 1, FALSE,
+			(TestBuildSetup)test_build_max_cands_setup, opts);
+	out = g_string_new("");
+	test_build_free(&test, out);
+	return g_string_free(out, FALSE);
+}
+
+/* with room for every pair, pruning changes nothing. */
+void test_build_max_candidates(void) {
+	GRand * rng;
+	Dataset * dataset;
+	gchar * exact;
+	gchar * unpruned;
+	gchar * serial;
+	gchar * threaded;
+
+	rng = g_rand_new_with_seed(4);
+	dataset = dataset_gen_blocks(rng, 80, 8, 0.1);
+	exact = test_build_max_cands_tree(dataset, 0, 1);
+	unpruned = test_build_max_cands_tree(dataset, dataset_num_labels(dataset), 1);
+	g_assert_cmpstr(exact, ==, unpruned);
+	serial = test_build_max_cands_tree(dataset, 3, 1);
+	threaded = test_build_max_cands_tree(dataset, 3, 4);
+	g_assert_cmpstr(serial, ==, threaded);
+	g_free(exact);
+	g_free(unpruned);
+	g_free(serial);
+	g_free(threaded);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+static void test_build_batch_setup(Build * build, guint * num_threads) {
+	build_set_num_threads(build, *num_threads);
+	build_set_batch_merges(build, TRUE, -G_MAXDOUBLE);
+}
+
+static gchar * test_build_batch_tree(Dataset * dataset, gboolean sparse, guint num_threads) {
+	TestBuild test;
+	GString * out;
+
+	test_build_run(&test, dataset, 6, 1, sparse,
+			(TestBuildSetup)test_build_batch_setup, &num_threads);
+	out = g_string_new("");
+	test_build_free(&test, out);
+	return g_string_free(out, FALSE);
+}
+
+void test_build_batch(void) {
+	GRand * rng;
+	Dataset * dataset;
+
+	rng = g_rand_new_with_seed(8);
+	dataset = dataset_gen_blocks(rng, 80, 8, 0.1);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		gchar * serial = test_build_batch_tree(dataset, sparse, 1);
+		gchar * threaded = test_build_batch_tree(dataset, sparse, 4);
+		g_assert_cmpstr(serial, ==, threaded);
+		g_free(serial);
+		g_free(threaded);
+	}
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+static void test_build_coarsen_setup(Build * build, gboolean * coarsen) {
+	build_set_coarsen(build, *coarsen);
+}
+
+static gdouble test_build_coarsen_logprob(Dataset * dataset, gboolean sparse, gboolean coarsen) {
+	TestBuild test;
+	gdouble logprob;
+
+	logprob = tree_get_logprob(test_build_run(&test, dataset, 9, 1, sparse,
+				(TestBuildSetup)test_build_coarsen_setup, &coarsen));
+	test_build_free(&test, NULL);
+	return logprob;
+}
+
+/* sparse, with num_items/block_width disjoint blocks and prob_drop of the
+ * edges within them left out.
+ */
+static Dataset * test_gen_cliques(GRand * rng, guint num_items, guint block_width, gdouble prob_drop) {
+	Dataset * dataset;
+	GPtrArray * labels;
+
+	dataset = dataset_new();
+	dataset_set_omitted(dataset, FALSE);
+	labels = g_ptr_array_new();
+	for (guint ii = 0; ii < num_items; ii++) {
+		gchar * name = g_strdup_printf("%d", ii);
+		g_ptr_array_add(labels, dataset_label_create(dataset, name));
+		g_free(name);
+	}
+	for (guint ii = 0; ii < num_items; ii++) {
+		for (guint jj = 0; jj < num_items; jj++) {
+			if (ii != jj && ii/block_width == jj/block_width
+					&& (prob_drop <= 0.0 || g_rand_double(rng) >= prob_drop)) {
+				dataset_set(dataset, g_ptr_array_index(labels, ii),
+						g_ptr_array_index(labels, jj), TRUE);
+			}
+		}
+	}
+	g_ptr_array_free(labels, TRUE);
+	return dataset;
+}
+
+/* disjoint cliques are groups of twins, which the exact build keeps
+ * together anyway.
+ */
+void test_build_coarsen(void) {
+	Dataset * dataset;
+	GPtrArray * groups;
+	const guint num_items = 24;
+	const guint block_width = 6;
+
+	dataset = test_gen_cliques(NULL, num_items, block_width, 0.0);
+	groups = dataset_equivalent_labels(dataset);
+	g_assert_cmpuint(groups->len, ==, num_items/block_width);
+	for (guint gg = 0; gg < groups->len; gg++) {
+		GPtrArray * group = g_ptr_array_index(groups, gg);
+		g_assert_cmpuint(group->len, ==, block_width);
+	}
+	g_ptr_array_unref(groups);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		assert_eqfloat(test_build_coarsen_logprob(dataset, sparse, FALSE),
+			test_build_coarsen_logprob(dataset, sparse, TRUE),
+			EQFLOAT_DEFAULT_PREC);
+	}
+	dataset_unref(dataset);
+}
+
+/* a clique of six twins, and a seventh label linked to all of them and to
+ * one more: the coarsened build starts from the group, and its best first
+ * merge is to absorb the seventh into it.
+ */
+void test_build_coarsen_absorb(void) {
+	Dataset * dataset;
+	gpointer labels[8];
+
+	dataset = dataset_new();
+	dataset_set_omitted(dataset, FALSE);
+	for (guint ii = 0; ii < 8; ii++) {
+		gchar * name = g_strdup_printf("%d", ii);
+		labels[ii] = dataset_label_create(dataset, name);
+		g_free(name);
+	}
+	for (guint ii = 0; ii < 7; ii++) {
+		for (guint jj = 0; jj < 7; jj++) {
+			if (ii != jj) {
+				dataset_set(dataset, labels[ii], labels[jj], TRUE);
+			}
+		}
+	}
+	dataset_set(dataset, labels[6], labels[7], TRUE);
+	dataset_set(dataset, labels[7], labels[6], TRUE);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		GRand * rng = g_rand_new_with_seed(19);
+		Params * params = params_default(dataset);
+		Build * build = build_new(rng, params, 1, sparse);
+		GPtrArray * trees;
+		guint num_flat = 0;
+
+		build_set_coarsen(build, TRUE);
+		build_begin(build);
+		g_assert_cmpuint(build_step(build, 1), ==, 1);
+		trees = build_get_trees(build);
+		for (guint ii = 0; ii < trees->len; ii++) {
+			Tree * tree = g_ptr_array_index(trees, ii);
+
+			if (tree != NULL && tree_num_leaves(tree) == 7) {
+				num_flat += g_list_length(branch_get_children(tree)) == 7;
+			}
+		}
+		g_assert_cmpuint(num_flat, ==, 1);
+		build_finish(build);
+		build_free(build);
+		params_unref(params);
+		g_rand_free(rng);
+	}
+	dataset_unref(dataset);
+}
+
+typedef struct {
+	guint		num_threads;
+	gboolean	split;
+} TestBuildComponents;
+
+static void test_build_components_setup(Build * build, TestBuildComponents * opts) {
+	build_set_num_threads(build, opts->num_threads);
+	build_set_split_components(build, opts->split);
+}
+
+static gchar * test_build_components_tree(Dataset * dataset, gboolean split, guint num_threads, Counts * counts) {
+	TestBuildComponents opts = { num_threads, split };
+	TestBuild test;
+	GString * out;
+
+	*counts = *(Counts *)tree_get_suffstats(test_build_run(&test, dataset, 11, 1, TRUE,
+				(TestBuildSetup)test_build_components_setup, &opts));
+	out = g_string_new("");
+	test_build_free(&test, out);
+	return g_string_free(out, FALSE);
+}
+
+/* the last label is on its own. */
+void test_build_components(void) {
+	GRand * rng;
+	Dataset * dataset;
+	Counts whole, serial_counts, threaded_counts;
+	gchar * serial;
+	gchar * threaded;
+
+	rng = g_rand_new_with_seed(12);
+	dataset = test_gen_cliques(rng, 41, 8, 0.3);
+	g_free(test_build_components_tree(dataset, FALSE, 1, &whole));
+	serial = test_build_components_tree(dataset, TRUE, 1, &serial_counts);
+	threaded = test_build_components_tree(dataset, TRUE, 4, &threaded_counts);
+	g_assert_cmpstr(serial, ==, threaded);
+	g_assert_cmpuint(serial_counts.num_ones, ==, whole.num_ones);
+	g_assert_cmpuint(serial_counts.num_total, ==, whole.num_total);
+	g_free(serial);
+	g_free(threaded);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+/* the sparse build only scores pairs with an edge between, so the global
+ * score's total has to agree with what it assumes of the rest, even with
+ * cells that are stored but missing.
+ */
+void test_build_sparse_global(void) {
+	GRand * rng;
+	Dataset * dataset;
+	Params * params;
+	Build * build;
+	Tree * root;
+
+	rng = g_rand_new_with_seed(18);
+	dataset = test_gen_cliques(rng, 41, 8, 0.3);
+	/* join the blocks up, and leave a cell missing beside each join */
+	for (guint ii = 0; ii + 9 < 41; ii += 5) {
+		gchar * src = g_strdup_printf("%d", ii);
+		gchar * dst = g_strdup_printf("%d", ii + 8);
+		gchar * near = g_strdup_printf("%d", ii + 9);
+
+		dataset_set(dataset, dataset_label_lookup(dataset, src),
+				dataset_label_lookup(dataset, dst), TRUE);
+		dataset_set_missing(dataset, dataset_label_lookup(dataset, src),
+				dataset_label_lookup(dataset, near));
+		g_free(src);
+		g_free(dst);
+		g_free(near);
+	}
+	params = params_default(dataset);
+	params->global_score = TRUE;
+	build = build_new(rng, params, 2, TRUE);
+	build_run(build);
+	root = build_get_best_tree(build);
+	g_assert_cmpuint(tree_num_leaves(root), ==, 41);
+	g_assert(tree_get_logprob(root) < 0.0);
+	build_free(build);
+	params_unref(params);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+/* the best tree of a few restarts outlives the pruning of the rest */
+static void test_build_prune_setup(Build * build, gboolean * prune) {
+	build_set_heuristic_prune(build, *prune);
+}
+
+static gdouble test_build_prune_run(Dataset * dataset, gboolean prune, guint * num_pruned) {
+	TestBuild test;
+	gdouble logprob;
+
+	logprob = tree_get_logprob(test_build_run(&test, dataset, 23, 12, FALSE,
+				(TestBuildSetup)test_build_prune_setup, &prune));
+	*num_pruned = build_get_num_pruned(test.build);
+	test_build_free(&test, NULL);
+	return logprob;
+}
+
+void test_build_prune(void) {
+	GRand * rng;
+	Dataset * dataset;
+	guint num_pruned;
+	gdouble logprob;
+
+	rng = g_rand_new_with_seed(22);
+	dataset = test_gen_cliques(rng, 30, 6, 0.2);
+	logprob = test_build_prune_run(dataset, FALSE, &num_pruned);
+	g_assert_cmpuint(num_pruned, ==, 0);
+	assert_eqfloat(test_build_prune_run(dataset, TRUE, &num_pruned), logprob, EQFLOAT_DEFAULT_PREC);
+	g_assert_cmpuint(num_pruned, >, 0);
+	g_assert_cmpuint(num_pruned, <=, 12 - 5);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+/* pure cliques: the restarts only break ties, and keep making the same tree */
+typedef struct {
+	guint		max_repeats;
+	gboolean	skip_repeats;
+} TestBuildAdaptive;
+
+static void test_build_adaptive_setup(Build * build, TestBuildAdaptive * opts) {
+	build_set_adaptive_restarts(build, 0, opts->max_repeats, opts->skip_repeats);
+}
+
+static gdouble test_build_adaptive_run(Dataset * dataset, guint max_repeats, gboolean skip_repeats, guint * num_run, guint * num_repeats) {
+	TestBuildAdaptive opts = { max_repeats, skip_repeats };
+	TestBuild test;
+	gdouble logprob;
+
+	logprob = tree_get_logprob(test_build_run(&test, dataset, 29, 20, FALSE,
+				(TestBuildSetup)test_build_adaptive_setup, &opts));
+	*num_run = build_get_num_run(test.build);
+	*num_repeats = build_get_num_repeats(test.build);
+	test_build_free(&test, NULL);
+	return logprob;
+}
+
+void test_build_adaptive(void) {
+	Dataset * dataset;
+	guint num_run, num_repeats;
+	gdouble logprob;
+
+	dataset = test_gen_cliques(NULL, 24, 6, 0.0);
+	logprob = test_build_adaptive_run(dataset, 0, FALSE, &num_run, &num_repeats);
+	g_assert_cmpuint(num_run, ==, 20);
+	g_assert_cmpuint(num_repeats, ==, 0);
+	assert_eqfloat(test_build_adaptive_run(dataset, 3, FALSE, &num_run, &num_repeats), logprob, EQFLOAT_DEFAULT_PREC);
+	g_assert_cmpuint(num_repeats, ==, 3);
+	g_assert_cmpuint(num_run, <, 20);
+	assert_eqfloat(test_build_adaptive_run(dataset, 3, TRUE, &num_run, &num_repeats), logprob, EQFLOAT_DEFAULT_PREC);
+	g_assert_cmpuint(num_repeats, ==, 3);
+	assert_eqfloat(test_build_adaptive_run(dataset, 0, TRUE, &num_run, &num_repeats), logprob, EQFLOAT_DEFAULT_PREC);
+	/* all the same tree: each after the first is cut short */
+	g_assert_cmpuint(num_run, ==, 20);
+	g_assert_cmpuint(num_repeats, ==, 19);
+	dataset_unref(dataset);
+}
+
+static void test_build_progress_add(const BuildProgress * progress, GArray * reports) {
+	g_array_append_val(reports, *progress);
+}
+
+static void test_build_progress_setup(Build * build, GArray * reports) {
+	build_set_progress(build, 0.0, (BuildProgressFunc)test_build_progress_add, reports);
+}
+
+/* with no interval, each merge is reported */
+void test_build_progress(void) {
+	GRand * rng;
+	Dataset * dataset;
+	TestBuild test;
+	GArray * reports;
+
+	rng = g_rand_new_with_seed(31);
+	dataset = test_gen_cliques(rng, 30, 6, 0.2);
+	reports = g_array_new(FALSE, FALSE, sizeof(BuildProgress));
+	test_build_run(&test, dataset, 31, 2, FALSE,
+			(TestBuildSetup)test_build_progress_setup, reports);
+	g_assert_cmpuint(reports->len, ==, 2*29);
+	for (guint ii = 0; ii < reports->len; ii++) {
+		BuildProgress * progress = &g_array_index(reports, BuildProgress, ii);
+		guint num_trees = progress->num_left + 1;
+
+		g_assert_cmpuint(progress->restart, ==, ii/29);
+		g_assert_cmpuint(progress->num_merges, ==, ii%29 + 1);
+		g_assert_cmpuint(progress->num_merges + progress->num_left, ==, 29);
+		/* the dense build keeps every pair of trees */
+		g_assert_cmpuint(progress->heap_size, ==, num_trees*(num_trees - 1)/2);
+		g_assert_cmpuint(progress->sscache_entries, >, 0);
+		g_assert_cmpuint(progress->sscache_hits, <=, progress->sscache_lookups);
+		g_assert_cmpuint(progress->lnbeta_hits, >, 0);
+		g_assert(progress->elapsed >= 0.0);
+	}
+	g_array_free(reports, TRUE);
+	test_build_free(&test, NULL);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+static void test_build_subsample_setup(Build * build, guint * num_sample) {
+	build_set_subsample(build, *num_sample);
+}
+
+static gdouble test_build_subsample_run(Dataset * dataset, gboolean sparse, guint num_sample) {
+	TestBuild test;
+	gdouble logprob;
+
+	logprob = tree_get_logprob(test_build_run(&test, dataset, 37, 3, sparse,
+				(TestBuildSetup)test_build_subsample_setup, &num_sample));
+	test_build_free(&test, NULL);
+	return logprob;
+}
+
+/* the labels left out are all inserted; a sample of them all is a full build */
+void test_build_subsample(void) {
+	GRand * rng;
+	Dataset * dataset;
+
+	rng = g_rand_new_with_seed(35);
+	dataset = test_gen_cliques(rng, 30, 6, 0.2);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		gdouble logprob = test_build_subsample_run(dataset, sparse, 0);
+
+		assert_eqfloat(test_build_subsample_run(dataset, sparse, 30), logprob, EQFLOAT_DEFAULT_PREC);
+		g_assert(test_build_subsample_run(dataset, sparse, 12) < 0.0);
+		g_assert(test_build_subsample_run(dataset, sparse, 1) < 0.0);
+	}
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+static Build * test_build_steps_new(Dataset * dataset, gboolean sparse, GRand * rng) {
+	Params * params;
+	Build * build;
+
+	params = params_default(dataset);
+	build = build_new(rng, params, 1, sparse);
+	params_unref(params);
+	return build;
+}
+
+static void test_build_steps_free(Build * build, GRand * rng, GString * out) {
+	tree_tostring(build_get_best_tree(build), out);
+	build_free(build);
+	g_rand_free(rng);
+}
+
+static guint test_build_num_trees(Build * build) {
+	GPtrArray * trees = build_get_trees(build);
+	guint num_trees = 0;
+
+	for (guint ii = 0; ii < trees->len; ii++) {
+		num_trees += g_ptr_array_index(trees, ii) != NULL;
+	}
+	return num_trees;
+}
+
+/* stepping a few merges at a time gives the tree of build_once; stopping
+ * early still gives a tree of every label, flatter.
+ */
+void test_build_steps(void) {
+	GRand * rng;
+	Dataset * dataset;
+
+	rng = g_rand_new_with_seed(14);
+	dataset = dataset_gen_blocks(rng, 40, 4, 0.1);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		GString * once = g_string_new("");
+		GString * stepped = g_string_new("");
+		GRand * build_rng;
+		Build * build;
+		Counts whole;
+		guint num_trees;
+		guint num_merges;
+
+		build_rng = g_rand_new_with_seed(13);
+		build = test_build_steps_new(dataset, sparse, build_rng);
+		build_once(build);
+		g_assert(!build_get_incomplete(build));
+		whole = *(Counts *)tree_get_suffstats(build_get_best_tree(build));
+		test_build_steps_free(build, build_rng, once);
+
+		build_rng = g_rand_new_with_seed(13);
+		build = test_build_steps_new(dataset, sparse, build_rng);
+		build_begin(build);
+		num_trees = test_build_num_trees(build);
+		while ((num_merges = build_step(build, 3)) > 0) {
+			g_assert_cmpuint(num_merges, <=, 3);
+			num_trees -= num_merges;
+			g_assert_cmpuint(test_build_num_trees(build), ==, num_trees);
+		}
+		g_assert_cmpuint(build_get_num_merges(build), ==, 0);
+		build_finish(build);
+		test_build_steps_free(build, build_rng, stepped);
+		g_assert_cmpstr(once->str, ==, stepped->str);
+
+		build_rng = g_rand_new_with_seed(13);
+		build = test_build_steps_new(dataset, sparse, build_rng);
+		build_begin(build);
+		g_assert_cmpuint(build_step(build, 5), ==, 5);
+		g_assert_cmpuint(build_get_num_merges(build), >, 0);
+		build_finish(build);
+		g_assert(build_get_incomplete(build));
+		g_assert_cmpuint(tree_num_leaves(build_get_best_tree(build)), ==, dataset_num_labels(dataset));
+		if (!sparse) {
+			Counts * stopped = tree_get_suffstats(build_get_best_tree(build));
+			g_assert_cmpuint(stopped->num_ones, ==, whole.num_ones);
+			g_assert_cmpuint(stopped->num_total, ==, whole.num_total);
+		}
+		g_string_truncate(stepped, 0);
+		test_build_steps_free(build, build_rng, stepped);
+
+		g_string_free(once, TRUE);
+		g_string_free(stepped, TRUE);
+	}
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+typedef struct {
+	gdouble	time_budget;
+	gint64	start;
+} TestBuildBudget;
+
+/* timed from here, so the time taken is only that of build_run */
+static void test_build_budget_setup(Build * build, TestBuildBudget * opts) {
+	build_set_time_budget(build, opts->time_budget);
+	opts->start = g_get_monotonic_time();
+}
+
+static gint64 test_build_budget_run(Dataset * dataset, gdouble time_budget) {
+	TestBuildBudget opts = { time_budget, 0 };
+	TestBuild test;
+	gint64 usec;
+
+	test_build_run(&test, dataset, 16, 1, TRUE,
+			(TestBuildSetup)test_build_budget_setup, &opts);
+	usec = g_get_monotonic_time() - opts.start;
+	g_assert(build_get_incomplete(test.build) == (time_budget > 0.0));
+	test_build_free(&test, NULL);
+	return usec;
+}
+
+/* out of time at once, flattening the whole forest is no slower than
+ * building it.
+ */
+void test_build_budget(void) {
+	GRand * rng;
+	Dataset * dataset;
+	gint64 usec;
+
+	rng = g_rand_new_with_seed(17);
+	dataset = test_gen_cliques(rng, 1000, 10, 0.2);
+	usec = test_build_budget_run(dataset, 0.0);
+	g_assert_cmpint(test_build_budget_run(dataset, 1e-9), <=, usec);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+typedef struct {
+	const gchar *	fname;
+	gboolean	resume;
+} TestBuildCheckpoint;
+
+static void test_build_checkpoint_setup(Build * build, TestBuildCheckpoint * opts) {
+	build_set_num_best_trees(build, 2);
+	if (opts->resume) {
+		build_set_resume(build, opts->fname);
+	}
+	build_set_checkpoint(build, opts->fname, 0.0);
+}
+
+static gchar * test_build_checkpoint_run(Dataset * dataset, gboolean sparse, guint num_restarts, const gchar * fname, gboolean resume) {
+	TestBuildCheckpoint opts = { fname, resume };
+	TestBuild test;
+	GString * out;
+
+	test_build_run(&test, dataset, 15, num_restarts, sparse,
+			(TestBuildSetup)test_build_checkpoint_setup, &opts);
+	g_assert(!build_get_incomplete(test.build));
+	out = g_string_new("");
+	for (guint ii = 0; ii < build_get_best_trees(test.build)->len; ii++) {
+		Tree * root = g_ptr_array_index(build_get_best_trees(test.build), ii);
+
+		g_assert_cmpuint(tree_num_leaves(root), ==, dataset_num_labels(dataset));
+		g_string_append_printf(out, "%e ", tree_get_logprob(root));
+		tree_tostring(root, out);
+		g_string_append(out, "\n");
+	}
+	test_build_free(&test, NULL);
+	return g_string_free(out, FALSE);
+}
+
+/* resuming from the end of a build rebuilds its best trees; resuming from
+ * part way through the last restart carries on to a whole tree.
+ */
+void test_build_checkpoint(void) {
+	GRand * rng;
+	Dataset * dataset;
+	gchar * fname;
+
+	rng = g_rand_new_with_seed(16);
+	dataset = dataset_gen_blocks(rng, 30, 3, 0.1);
+	fname = g_build_filename(g_get_tmp_dir(), "bhcd_test_checkpoint", NULL);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		Checkpoint * checkpoint;
+		CheckpointLog * log;
+		GArray * best;
+		GArray * prefix;
+		gchar * whole;
+		gchar * resumed;
+
+		whole = test_build_checkpoint_run(dataset, sparse, 3, fname, FALSE);
+		resumed = test_build_checkpoint_run(dataset, sparse, 3, fname, TRUE);
+		g_assert_cmpstr(whole, ==, resumed);
+		g_free(resumed);
+
+		checkpoint = checkpoint_load(dataset, fname);
+		g_assert_cmpuint(checkpoint->num_labels, ==, dataset_num_labels(dataset));
+		g_assert_cmpuint(checkpoint->restart, ==, 3);
+		g_assert(checkpoint->current == NULL);
+		g_assert_cmpuint(checkpoint->best_logs->len, ==, 2);
+		best = ((CheckpointLog *)g_ptr_array_index(checkpoint->best_logs, 0))->merges;
+		g_assert_cmpuint(best->len, >, 10);
+		prefix = g_array_new(FALSE, FALSE, sizeof(CheckpointMerge));
+		g_array_append_vals(prefix, best->data, 10);
+		checkpoint->restart = 2;
+		checkpoint->current = g_array_ref(prefix);
+		g_ptr_array_set_size(checkpoint->best_logs, 0);
+		checkpoint_save(checkpoint, fname);
+		checkpoint_free(checkpoint);
+
+		g_free(test_build_checkpoint_run(dataset, sparse, 3, fname, TRUE));
+		checkpoint = checkpoint_load(dataset, fname);
+		g_assert_cmpuint(checkpoint->best_logs->len, ==, 1);
+		log = g_ptr_array_index(checkpoint->best_logs, 0);
+		g_assert_cmpuint(log->restart, ==, 2);
+		g_assert(!log->stopped);
+		g_assert_cmpuint(log->merges->len, >, prefix->len);
+		g_assert(memcmp(log->merges->data, prefix->data, prefix->len*sizeof(CheckpointMerge)) == 0);
+		checkpoint_free(checkpoint);
+		g_array_unref(prefix);
+		g_free(whole);
+	}
+	g_unlink(fname);
+	g_free(fname);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+/* blocks with some edges left out, so a restart resumed part way has
+ * absorbs to make between the trees it replayed. it makes as good a tree
+ * as the restart left alone.
+ */
+void test_build_checkpoint_absorb(void) {
+	GRand * rng;
+	Dataset * dataset;
+	gchar * fname;
+
+	rng = g_rand_new_with_seed(21);
+	dataset = test_gen_cliques(rng, 30, 6, 0.2);
+	fname = g_build_filename(g_get_tmp_dir(), "bhcd_test_checkpoint_absorb", NULL);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		Checkpoint * checkpoint;
+		GArray * merges;
+		guint num_absorbs;
+		gchar * whole;
+		gchar * resumed;
+
+		whole = test_build_checkpoint_run(dataset, sparse, 1, fname, FALSE);
+		checkpoint = checkpoint_load(dataset, fname);
+		merges = ((CheckpointLog *)g_ptr_array_index(checkpoint->best_logs, 0))->merges;
+		g_assert_cmpuint(merges->len, >, 12);
+		num_absorbs = 0;
+		for (guint mm = 12; mm < merges->len; mm++) {
+			num_absorbs += g_array_index(merges, CheckpointMerge, mm).kind == MERGE_ABSORB;
+		}
+		g_assert_cmpuint(num_absorbs, >, 0);
+		g_array_set_size(merges, 12);
+		checkpoint->restart = 0;
+		checkpoint->current = g_array_ref(merges);
+		g_ptr_array_set_size(checkpoint->best_logs, 0);
+		checkpoint_save(checkpoint, fname);
+		checkpoint_free(checkpoint);
+
+		/* the order of the children is up to the sym_breaks drawn */
+		resumed = test_build_checkpoint_run(dataset, sparse, 1, fname, TRUE);
+		assert_eqfloat(g_ascii_strtod(whole, NULL), g_ascii_strtod(resumed, NULL), 1e-6);
+		g_free(whole);
+		g_free(resumed);
+	}
+	g_unlink(fname);
+	g_free(fname);
+	dataset_unref(dataset);
+	g_rand_free(rng);
+}
+
+/* the merges name labels by string, whatever their quarks in the process
+ * that wrote them; and load back as the quarks of this one.
+ */
+void test_checkpoint_labels(void) {
+	const gchar * text =
+		"checkpoint [\n"
+		"\tlabels 3\n\trestarts 1\n\trestart 0\n\tseed 5\n"
+		"\tcurrent [\n\t\t\"z y\" \"x\" j\n\t\t\"w\" \"z y\" a\n\t]\n"
+		"]\n";
+	Dataset * dataset;
+	Checkpoint * checkpoint;
+	CheckpointMerge * merge;
+	gchar * fname;
+	gchar * saved;
+
+	dataset = dataset_new();
+	dataset_set_omitted(dataset, FALSE);
+	dataset_label_create(dataset, "w");
+	dataset_label_create(dataset, "x");
+	dataset_label_create(dataset, "z y");
+	fname = g_build_filename(g_get_tmp_dir(), "bhcd_test_checkpoint_labels", NULL);
+	g_assert(g_file_set_contents(fname, text, -1, NULL));
+	checkpoint = checkpoint_load(dataset, fname);
+	g_assert_cmpuint(checkpoint->current->len, ==, 2);
+	merge = &g_array_index(checkpoint->current, CheckpointMerge, 0);
+	g_assert(GINT_TO_POINTER(merge->aa) == dataset_label_lookup(dataset, "z y"));
+	g_assert(GINT_TO_POINTER(merge->bb) == dataset_label_lookup(dataset, "x"));
+	g_assert(merge->kind == MERGE_JOIN);
+	merge = &g_array_index(checkpoint->current, CheckpointMerge, 1);
+	g_assert(GINT_TO_POINTER(merge->aa) == dataset_label_lookup(dataset, "w"));
+	g_assert(GINT_TO_POINTER(merge->bb) == dataset_label_lookup(dataset, "z y"));
+	g_assert(merge->kind == MERGE_ABSORB);
+	checkpoint_save(checkpoint, fname);
+	checkpoint_free(checkpoint);
+	g_assert(g_file_get_contents(fname, &saved, NULL, NULL));
+	g_assert_cmpstr(saved, ==, text);
+	g_free(saved);
+	g_unlink(fname);
+	g_free(fname);
+	dataset_unref(dataset);
+}
+
+/* a saved tree loads back as it was. a label a delta adds is inserted with
+ * the counts and logprob the loader finds from the data afresh, and the
+ * tree inserted into is left alone.
+ */
+/* a branch held elsewhere is copied to absorb a child, one only held by
+ * the caller is changed in place; both score as tree_logprob_absorb says.
+ */
+void test_tree_absorb(void) {
+	Tree *laa, *lbb, *lcc, *ldd;
+	Tree *tab, *copy, *same;
+	Params * params;
+	Counts suffstats_on = { .ref_count = 1, .num_ones = 0, .num_total = 0 };
+	gdouble logprob;
+
+	init_test_toy4(&laa, &lbb, &lcc, &ldd);
+	params = tree_get_params(laa);
+	tab = branch_new_full(params, laa, lbb);
+	/* cached, as branch_add_child needs */
+	logprob = tree_logprob_absorb(tab, lcc,
+			sscache_get_offblock_direct(params->sscache,
+				tree_get_labels(tab), tree_get_labels(lcc)),
+			&suffstats_on);
+
+	tree_ref(tab);
+	copy = branch_add_child_copy(tab, lcc);
+	tree_unref(tab);
+	g_assert(copy != tab);
+	g_assert_cmpuint(g_list_length(branch_get_children(tab)), ==, 2);
+	g_assert_cmpuint(tree_num_leaves(copy), ==, 3);
+	assert_eqfloat(tree_get_logprob(copy), logprob, EQFLOAT_DEFAULT_PREC);
+
+	same = branch_add_child_copy(tab, lcc);
+	tree_unref(tab);
+	g_assert(same == tab);
+	g_assert_cmpuint(tree_num_leaves(same), ==, 3);
+	assert_eqfloat(tree_get_logprob(same), tree_get_logprob(copy), EQFLOAT_DEFAULT_PREC);
+
+	tree_unref(same);
+	tree_unref(copy);
+	tree_unref(laa);
+	tree_unref(lbb);
+	tree_unref(lcc);
+	tree_unref(ldd);
+}
+
+void test_tree_insert(void) {
+	GRand * rng;
+	gchar * data_fname;
+	gchar * tree_fname;
+
+	rng = g_rand_new_with_seed(17);
+	data_fname = g_build_filename(g_get_tmp_dir(), "bhcd_test_insert.gml", NULL);
+	tree_fname = g_build_filename(g_get_tmp_dir(), "bhcd_test_insert.tree", NULL);
+	for (guint sparse = 0; sparse < 2; sparse++) {
+		Dataset * dataset;
+		Dataset * delta;
+		Params * params;
+		Build * build;
+		Tree * root;
+		Tree * loaded;
+		Tree * inserted;
+		DatasetLabelIter iter;
+		gpointer label;
+		gpointer new_label;
+		gpointer first_label;
+		gboolean omitted;
+		guint num_labels;
+		guint num_entries, num_inserted, num_lookups, num_hits;
+
+		if (sparse) {
+			dataset = dataset_gen_toy4(TRUE);
+		} else {
+			dataset = dataset_gen_blocks(rng, 30, 3, 0.1);
+		}
+		dataset_gml_save(dataset, data_fname);
+		dataset_unref(dataset);
+		dataset = dataset_gml_load(data_fname);
+		num_labels = dataset_num_labels(dataset);
+
+		params = params_default(dataset);
+		build = build_new(rng, params, 1, sparse);
+		params_unref(params);
+		build_run(build);
+		root = build_get_best_tree(build);
+		tree_io_save(root, tree_fname);
+		loaded = tree_io_load(tree_fname, NULL);
+		g_assert_cmpuint(tree_num_leaves(loaded), ==, num_labels);
+		assert_eqfloat(tree_get_logprob(loaded), tree_get_logprob(root), EQFLOAT_DEFAULT_PREC);
+		tree_unref(loaded);
+		build_free(build);
+
+		/* a new label joined to a few old ones, and an edge between old ones */
+		delta = dataset_new();
+		if (dataset_get_sparse(dataset, &omitted)) {
+			dataset_set_omitted(delta, omitted);
+		}
+		new_label = dataset_label_create(delta, "new");
+		first_label = NULL;
+		dataset_labels_iter_init(dataset, &iter);
+		for (guint ii = 0; ii < 3 && dataset_labels_iter_next(&iter, &label); ii++) {
+			gpointer old_label = dataset_label_create(delta,
+					dataset_label_to_string(dataset, label));
+
+			dataset_set(delta, new_label, old_label, TRUE);
+			dataset_set(delta, old_label, new_label, ii != 1);
+			if (first_label == NULL) {
+				first_label = old_label;
+			} else {
+				dataset_set(delta, first_label, old_label, TRUE);
+			}
+		}
+
+		loaded = tree_io_load(tree_fname, delta);
+		sscache_get_stats(tree_get_params(loaded)->sscache, &num_entries, &num_lookups, &num_hits);
+		inserted = tree_insert_leaf(loaded, new_label);
+		/* only the offblock the leaf is added with is cached */
+		sscache_get_stats(tree_get_params(loaded)->sscache, &num_inserted, &num_lookups, &num_hits);
+		g_assert_cmpuint(num_inserted, <=, num_entries + 1);
+		g_assert_cmpuint(tree_num_leaves(loaded), ==, num_labels);
+		g_assert_cmpuint(tree_num_leaves(inserted), ==, num_labels + 1);
+
+		dataset_unref(dataset);
+		dataset = tree_get_params(inserted)->dataset;
+		dataset_gml_save(dataset, data_fname);
+		dataset_set_filename(dataset, data_fname);
+		tree_io_save(inserted, tree_fname);
+		root = tree_io_load(tree_fname, NULL);
+		assert_eqfloat(tree_get_logprob(root), tree_get_logprob(inserted), EQFLOAT_DEFAULT_PREC);
+		tree_unref(root);
+		tree_unref(inserted);
+		tree_unref(loaded);
+		dataset_unref(delta);
+	}
+	g_unlink(data_fname);
+	g_unlink(tree_fname);
+	g_free(data_fname);
+	g_free(tree_fname);
+	g_rand_free(rng);
+}
+
 void test_merge_score3(void) {
 	GRand * rng;
 	Params * params;
@@ -405,7 +1385,7 @@ void test_merge_score3(void) {
 	tab = branch_new(params);
 	branch_add_child(tab, laa);
 	branch_add_child(tab, lbb);
-	merge_ab = merge_new(rng, NULL, params, 0, laa, 1, lbb, tab);
+	merge_ab = merge_new(g_rand_double(rng), NULL, params, 0, laa, 1, lbb, tab);
 	global_suffstats = counts_new(1, 3);
 	merge_notify_pair(merge_ab, global_suffstats);
 	suffstats_unref(global_suffstats);
@@ -428,7 +1408,7 @@ void test_merge_score3(void) {
 	branch_add_child(tabc, tab);
 	branch_add_child(tabc, lcc);
 
-	merge_abc = merge_new(rng, merge_ab, params, 0, tab, 1, lcc, tabc);
+	merge_abc = merge_new(g_rand_double(rng), merge_ab, params, 0, tab, 1, lcc, tabc);
 
 	correct_tabc =
 		log_add_exp(gsl_sf_log(0.4) + gsl_sf_lnbeta(1.0+1, 0.2+2) - gsl_sf_lnbeta(1.0, 0.2)
@@ -452,6 +1432,134 @@ void test_merge_score3(void) {
 }
 
 
+/* symmetry belongs to each dataset, so the two can be used side by side. */
+void test_dataset_symmetric(void) {
+	Dataset * datasets[2];
+	gpointer src, dst;
+	gboolean missing;
+
+	for (guint ss = 0; ss < 2; ss++) {
+		datasets[ss] = dataset_new();
+		dataset_set_omitted(datasets[ss], FALSE);
+		dataset_set_symmetric(datasets[ss], ss == 1);
+		src = dataset_label_create(datasets[ss], "a");
+		dst = dataset_label_create(datasets[ss], "b");
+		dataset_set(datasets[ss], dst, src, TRUE);
+		g_assert(dataset_get(datasets[ss], dst, src, &missing));
+	}
+	g_assert(!dataset_get_symmetric(datasets[0]));
+	g_assert(!dataset_get(datasets[0], src, dst, &missing));
+	g_assert(dataset_get_symmetric(datasets[1]));
+	g_assert(dataset_get(datasets[1], src, dst, &missing));
+	dataset_unref(datasets[0]);
+	dataset_unref(datasets[1]);
+}
+
+static gpointer test_dataset_neighbours_job(gpointer data) {
+	Dataset * dataset = data;
+	DatasetLabelIter iter;
+	gpointer label;
+	guint num_neighbours = 0;
+
+	dataset_labels_iter_init(dataset, &iter);
+	while (dataset_labels_iter_next(&iter, &label)) {
+		num_neighbours += dataset_label_neighbours(dataset, label)->len;
+	}
+	return GUINT_TO_POINTER(num_neighbours);
+}
+
+/* the index is built once whichever thread asks first, and a label
+ * without stored cells reads as having no neighbours without being added.
+ */
+void test_dataset_neighbours(void) {
+	Dataset * dataset;
+	GThread * threads[4];
+	gpointer aa, bb, cc, dd;
+
+	dataset = dataset_new();
+	dataset_set_omitted(dataset, FALSE);
+	aa = dataset_label_create(dataset, "a");
+	bb = dataset_label_create(dataset, "b");
+	cc = dataset_label_create(dataset, "c");
+	dd = dataset_label_create(dataset, "d");
+	dataset_set(dataset, aa, bb, TRUE);
+	dataset_set(dataset, bb, cc, TRUE);
+	dataset_set(dataset, cc, bb, TRUE);
+	for (guint tt = 0; tt < G_N_ELEMENTS(threads); tt++) {
+		threads[tt] = g_thread_new("neighbours", test_dataset_neighbours_job, dataset);
+	}
+	for (guint tt = 0; tt < G_N_ELEMENTS(threads); tt++) {
+		g_assert_cmpuint(GPOINTER_TO_UINT(g_thread_join(threads[tt])), ==, 4);
+	}
+	g_assert_cmpuint(dataset_label_neighbours(dataset, bb)->len, ==, 2);
+	g_assert_cmpuint(dataset_label_neighbours(dataset, dd)->len, ==, 0);
+	/* kept up to date from then on */
+	dataset_set(dataset, dd, aa, TRUE);
+	g_assert_cmpuint(dataset_label_neighbours(dataset, dd)->len, ==, 1);
+	g_assert_cmpuint(dataset_label_neighbours(dataset, aa)->len, ==, 2);
+	dataset_set(dataset, dd, aa, FALSE);
+	g_assert_cmpuint(dataset_label_neighbours(dataset, dd)->len, ==, 0);
+	dataset_unref(dataset);
+}
+
+static void test_islands_assert_edges(Islands * islands, const guint * expect, guint num_expect) {
+	guint * edges;
+	guint num_edges;
+
+	edges = islands_get_edges(islands, &num_edges);
+	g_assert_cmpuint(num_edges, ==, num_expect);
+	for (guint ee = 0; ee < 2*num_edges; ee++) {
+		g_assert_cmpuint(edges[ee], ==, expect[ee]);
+	}
+	g_free(edges);
+}
+
+void test_islands(void) {
+	const guint before[] = { 0, 1, 1, 2, 2, 3, 3, 4 };
+	const guint after[] = { 0, 5, 3, 4, 3, 5 };
+	Dataset * dataset;
+	Params * params;
+	GPtrArray * trees;
+	gpointer labels[5];
+	Islands * islands;
+	GArray * neigh;
+
+	dataset = dataset_new();
+	dataset_set_omitted(dataset, FALSE);
+	trees = g_ptr_array_new_with_free_func((GDestroyNotify)tree_unref);
+	for (guint ii = 0; ii < 5; ii++) {
+		gchar * name = num_to_string(ii);
+
+		labels[ii] = dataset_label_create(dataset, name);
+		g_free(name);
+	}
+	/* a path, one step of it missing rather than an edge */
+	dataset_set(dataset, labels[0], labels[1], TRUE);
+	dataset_set(dataset, labels[2], labels[1], TRUE);
+	dataset_set_missing(dataset, labels[2], labels[3]);
+	dataset_set(dataset, labels[3], labels[4], TRUE);
+	dataset_set(dataset, labels[0], labels[4], FALSE);
+	params = params_default(dataset);
+	for (guint ii = 0; ii < 5; ii++) {
+		g_ptr_array_add(trees, leaf_new(params, labels[ii]));
+	}
+	islands = islands_new(dataset, trees);
+	test_islands_assert_edges(islands, before, G_N_ELEMENTS(before)/2);
+
+	islands_merge(islands, 5, 1, 2);
+	test_islands_assert_edges(islands, after, G_N_ELEMENTS(after)/2);
+	neigh = islands_get_neigh(islands, 5);
+	g_assert_cmpuint(neigh->len, ==, 2);
+	g_assert_cmpuint(g_array_index(neigh, guint, 0), ==, 0);
+	g_assert_cmpuint(g_array_index(neigh, guint, 1), ==, 3);
+	g_assert(islands_get_neigh(islands, 1) == NULL);
+
+	islands_free(islands);
+	g_ptr_array_free(trees, TRUE);
+	params_unref(params);
+	dataset_unref(dataset);
+}
+
 void test_sscache_stats(void) {
 	Tree *laa;
 	Tree *lbb;
@@ -800,6 +1908,7 @@ void test_lnbetacache(void) {
 		for (guint h1 = 0; h1 < sizeof(hypers)/sizeof(hypers[0]); h1++) {
 			gdouble beta = hypers[h1];
 			LnBetaCache * cache = lnbetacache_new(alpha, beta, max_num);
+			lnbetacache_set_count_hits(cache, TRUE);
 			for (guint n0 = 0; n0 < 2*max_num; n0++) {
 				for (guint n1 = 0; n1 < 2*max_num; n1++) {
 					gdouble truth = gsl_sf_lnbeta(alpha+n1, beta+n0);
@@ -807,20 +1916,117 @@ void test_lnbetacache(void) {
 					assert_eqfloat(truth, cc, EQFLOAT_DEFAULT_PREC);
 				}
 			}
-			g_assert(lnbetacache_get_num_hits(cache) == 0);
-			for (guint n0 = 0; n0 < 2*max_num; n0++) {
-				for (guint n1 = 0; n1 < 2*max_num; n1++) {
+			/* note that only values lying < max_num are in the
+			 * tables
+			 */
+			g_assert(lnbetacache_get_num_hits(cache) == max_num*max_num);
+			lnbeta_cache_free(cache);
+		}
+	}
+
+	/* large enough to be filled in parallel */
+	{
+		const guint large_num = 1 << 17;
+		LnBetaCache * cache = lnbetacache_new(0.2, 1.0, large_num);
+		for (guint n0 = 0; n0 < large_num; n0 += 997) {
+			for (guint n1 = 0; n1 < large_num; n1 += 1009) {
+				gdouble truth = gsl_sf_lnbeta(0.2+n1, 1.0+n0);
+				gdouble cc = lnbetacache_get(cache, n1, n0);
+				assert_eqfloat(truth, cc, EQFLOAT_DEFAULT_PREC);
+			}
+		}
+		lnbeta_cache_free(cache);
+	}
+
+	/* changing hypers in place should give the same values as a fresh
+	 * cache, repeatedly.
+	 */
+	{
+		LnBetaCache * cache = lnbetacache_new(hypers[0], hypers[0], max_num);
+		for (guint h0 = 0; h0 < sizeof(hypers)/sizeof(hypers[0]); h0++) {
+			gdouble alpha = hypers[h0];
+			gdouble beta = hypers[sizeof(hypers)/sizeof(hypers[0]) - 1 - h0];
+			lnbetacache_set_hypers(cache, alpha, beta);
+			for (guint n0 = 0; n0 < max_num; n0 += 1 + h0) {
+				for (guint n1 = 0; n1 < max_num; n1 += 1 + h0) {
 					gdouble truth = gsl_sf_lnbeta(alpha+n1, beta+n0);
 					gdouble cc = lnbetacache_get(cache, n1, n0);
 					assert_eqfloat(truth, cc, EQFLOAT_DEFAULT_PREC);
 				}
 			}
-			/* note that only values lying < max_num will be cached
-			 */
-			g_assert(lnbetacache_get_num_hits(cache) == max_num*max_num);
-			lnbeta_cache_free(cache);
 		}
+		lnbeta_cache_free(cache);
+	}
+}
+
+void test_lnbeta_asymp(void) {
+	gdouble small[] = { 0.01, 0.2, 1.0, 7.5, LNBETA_ASYMP_MIN };
+	gdouble large[] = { LNBETA_ASYMP_MIN, 100.5, 1e4, 3.3e6, 1e9 };
+	gdouble xx[5*5], yy[5*5], out[5*5];
+	guint num = 0;
+
+	for (guint ii = 0; ii < 5; ii++) {
+		for (guint jj = 0; jj < 5; jj++) {
+			assert_eqfloat(gsl_sf_lnbeta(small[ii], large[jj]),
+				lnbeta_asymp(small[ii], large[jj]), 1e-8);
+			assert_eqfloat(gsl_sf_lnbeta(large[jj], small[ii]),
+				lnbeta_asymp(large[jj], small[ii]), 1e-8);
+			assert_eqfloat(gsl_sf_lnbeta(large[ii], large[jj]),
+				lnbeta_asymp(large[ii], large[jj]), 1e-8);
+			xx[num] = large[ii];
+			yy[num] = large[jj];
+			num++;
+		}
+	}
+	lnbeta_asymp_array(xx, yy, out, num);
+	for (guint ii = 0; ii < num; ii++) {
+		assert_eqfloat(gsl_sf_lnbeta(xx[ii], yy[ii]), out[ii], 1e-8);
+	}
+}
+
+void test_lnbeta_asymp_perf(void) {
+	const guint num = 1 << 20;
+	gdouble * xx, * yy, * out;
+	gdouble truth, gsl_time, asymp_time, array_time;
+
+	xx = g_new(gdouble, num);
+	yy = g_new(gdouble, num);
+	out = g_new(gdouble, num);
+	for (guint ii = 0; ii < num; ii++) {
+		xx[ii] = LNBETA_ASYMP_MIN + 0.3*ii;
+		yy[ii] = 1e6 + 17.0*ii;
+	}
+
+	g_test_timer_start();
+	truth = 0.0;
+	for (guint ii = 0; ii < num; ii++) {
+		truth += gsl_sf_lnbeta(xx[ii], yy[ii]);
+	}
+	gsl_time = g_test_timer_elapsed();
+
+	g_test_timer_start();
+	for (guint ii = 0; ii < num; ii++) {
+		out[ii] = lnbeta_asymp(xx[ii], yy[ii]);
+	}
+	asymp_time = g_test_timer_elapsed();
+	for (guint ii = 0; ii < num; ii++) {
+		assert_eqfloat(gsl_sf_lnbeta(xx[ii], yy[ii]), out[ii], 1e-8);
+	}
+
+	g_test_timer_start();
+	lnbeta_asymp_array(xx, yy, out, num);
+	array_time = g_test_timer_elapsed();
+	for (guint ii = 0; ii < num; ii++) {
+		truth -= out[ii];
 	}
+	assert_eqfloat(0.0, truth/num, 1e-6);
+
+	g_test_message("lnbeta x %u: gsl %es, asymp %es, array %es",
+			num, gsl_time, asymp_time, array_time);
+	g_test_minimized_result(array_time, "lnbeta_asymp_array x %u: %es", num, array_time);
+	g_free(xx);
+	g_free(yy);
+	g_free(out);
 }
 
 gint intp_cmp(gconstpointer aa, gconstpointer bb) {
@@ -922,19 +2128,130 @@ void test_minheap(void) {
 	minheap_free(heap);
 }
 
+typedef struct {
+	gdouble key;
+	gdouble tie;
+	guint index;
+} DHeapTestElem;
+
+void test_dheap(void) {
+	DHeapTestElem elems[200];
+	DHeap * heap;
+	GRand * rng;
+	DHeapTestElem * prev;
+	guint num_left;
+
+	rng = g_rand_new_with_seed(5);
+	heap = dheap_new(0, NULL, G_STRUCT_OFFSET(DHeapTestElem, index));
+	for (guint ii = 0; ii < 200; ii++) {
+		/* few distinct keys, so ties matter */
+		elems[ii].key = g_rand_int_range(rng, 0, 20);
+		elems[ii].tie = g_rand_double(rng);
+		if (ii < 100) {
+			dheap_append(heap, elems[ii].key, elems[ii].tie, &elems[ii]);
+		} else {
+			dheap_enq(heap, elems[ii].key, elems[ii].tie, &elems[ii]);
+		}
+		if (ii == 99) {
+			dheap_rebuild(heap);
+		}
+	}
+	g_assert(dheap_size(heap) == 200);
+
+	num_left = 200;
+	for (guint ii = 0; ii < 200; ii += 7) {
+		dheap_remove(heap, &elems[ii]);
+		g_assert(!dheap_contains(heap, &elems[ii]));
+		num_left--;
+	}
+	for (guint ii = 3; ii < 200; ii += 7) {
+		elems[ii].key = g_rand_int_range(rng, -5, 25);
+		dheap_update(heap, &elems[ii], elems[ii].key, elems[ii].tie);
+	}
+	g_assert(dheap_size(heap) == num_left);
+
+	prev = NULL;
+	while (dheap_size(heap) > 0) {
+		DHeapTestElem * cur = dheap_deq(heap);
+		g_assert(cur->index == DHEAP_NO_INDEX);
+		if (prev != NULL) {
+			g_assert(prev->key < cur->key ||
+				(prev->key <= cur->key && prev->tie < cur->tie));
+		}
+		prev = cur;
+	}
+	dheap_free(heap);
+
+	/* rebuilding in parts arrives at the same heap */
+	{
+		DHeap * parts = dheap_new(0, NULL, DHEAP_NOT_INDEXED);
+		DHeapIter iter, iter_parts;
+		gpointer elem, elem_parts;
+		guint first, num_roots;
+
+		heap = dheap_new(0, NULL, DHEAP_NOT_INDEXED);
+		for (guint ii = 0; ii < 200; ii++) {
+			dheap_append(heap, elems[ii].key, elems[ii].tie, &elems[ii]);
+			dheap_append(parts, elems[ii].key, elems[ii].tie, &elems[ii]);
+		}
+		dheap_rebuild(heap);
+		num_roots = dheap_subtree_roots(parts, 16, &first);
+		g_assert(num_roots == 16);
+		for (guint root = first + num_roots; root-- > first; ) {
+			dheap_rebuild_subtree(parts, root);
+		}
+		dheap_rebuild_top(parts, first);
+		dheap_iter_init(heap, &iter);
+		dheap_iter_init(parts, &iter_parts);
+		while (dheap_iter_next(&iter, &elem)) {
+			g_assert(dheap_iter_next(&iter_parts, &elem_parts));
+			g_assert(elem == elem_parts);
+		}
+		dheap_free(heap);
+		dheap_free(parts);
+	}
+	g_rand_free(rng);
+}
+
 int main(int argc, char *argv[]) {
 	g_test_init(&argc, &argv, NULL);
 	g_test_add_func("/tree/logprob3", test_tree_logprob3);
 	g_test_add_func("/tree/logprob4", test_tree_logprob4);
 	g_test_add_func("/tree/logpred4", test_build_logpred4);
+	g_test_add_func("/build/threads", test_build_threads);
+	g_test_add_func("/build/max_candidates", test_build_max_candidates);
+	g_test_add_func("/build/batch", test_build_batch);
+	g_test_add_func("/build/coarsen", test_build_coarsen);
+	g_test_add_func("/build/coarsen_absorb", test_build_coarsen_absorb);
+	g_test_add_func("/build/components", test_build_components);
+	g_test_add_func("/build/sparse_global", test_build_sparse_global);
+	g_test_add_func("/build/prune", test_build_prune);
+	g_test_add_func("/build/adaptive", test_build_adaptive);
+	g_test_add_func("/build/progress", test_build_progress);
+	g_test_add_func("/build/subsample", test_build_subsample);
+	g_test_add_func("/build/steps", test_build_steps);
+	g_test_add_func("/build/budget", test_build_budget);
+	g_test_add_func("/build/checkpoint", test_build_checkpoint);
+	g_test_add_func("/build/checkpoint_absorb", test_build_checkpoint_absorb);
+	g_test_add_func("/checkpoint/labels", test_checkpoint_labels);
+	g_test_add_func("/tree/absorb", test_tree_absorb);
+	g_test_add_func("/tree/insert", test_tree_insert);
 	g_test_add_func("/merge/score3", test_merge_score3);
 	g_test_add_func("/bitset", test_bitset);
 	g_test_add_func("/bitset/popcount", test_bitset_popcount);
 	g_test_add_func("/labelset", test_labelset);
+	g_test_add_func("/dataset/symmetric", test_dataset_symmetric);
+	g_test_add_func("/dataset/neighbours", test_dataset_neighbours);
+	g_test_add_func("/islands", test_islands);
 	g_test_add_func("/sscache/stats", test_sscache_stats);
 	g_test_add_func("/util/log_add_exp", test_log_add_exp);
 	g_test_add_func("/util/lnbetacache", test_lnbetacache);
+	g_test_add_func("/util/lnbeta_asymp", test_lnbeta_asymp);
+	if (g_test_perf()) {
+		g_test_add_func("/perf/lnbeta_asymp", test_lnbeta_asymp_perf);
+	}
 	g_test_add_func("/util/minheap", test_minheap);
+	g_test_add_func("/util/dheap", test_dheap);
 	g_test_run();
 	return 0;
 }
@@ -14,10 +14,13 @@ struct Tree_t {
 	gboolean	is_leaf;
 	/* shared */
 	Params *	params;
+	/* params->version when params were last set */
+	guint		params_version;
 	gpointer	suffstats_on;
 	gpointer	suffstats_off;
 	/* elements shared */
 	GList *		children;
+	guint		num_children;
 
 	Labelset *	labels;
 	Labelset *	merge_left;
@@ -28,16 +31,24 @@ struct Tree_t {
 	gdouble		log_not_pi;
 	gdouble		logprob_cluster;
 	gdouble		logprob_children;
+	/* the logprobs of the children summed in the order they were added,
+	 * so adding one more needs only one more term.
+	 */
+	gdouble		sum_children;
 
 	gdouble		logprob;
 };
 
 
 static Tree * tree_new(Params * params);
-static gdouble branch_log_not_pi(Tree * branch);
-static gdouble branch_log_pi(Tree * branch, gdouble log_not_pi);
+static gdouble branch_log_not_pi(Params * params, guint num_children);
+static gdouble branch_log_pi(gdouble log_not_pi);
+static gdouble branch_logprob_combine(Params * params, guint num_children, gpointer suffstats_on, gdouble logprob_children);
 static gdouble branch_logprob(Tree * branch);
+static gdouble branch_logprob_update(Tree * branch);
 static gdouble leaf_logprob(Tree * leaf);
+static gdouble tree_insert_best(Tree * tree, Tree * leaf, gboolean * absorb);
+static Tree * branch_replace_child(Tree * branch, Tree * old_child, Tree * new_child, gpointer offblock);
 
 void tree_assert(Tree * tree) {
 	if (!tree_debug) {
@@ -79,9 +90,11 @@ static Tree * tree_new(Params * params) {
 	tree->is_leaf = TRUE;
 	tree->params = params;
 	params_ref(tree->params);
+	tree->params_version = params->version;
 	tree->suffstats_on = NULL;
 	tree->suffstats_off = NULL;
 	tree->children = NULL;
+	tree->num_children = 0;
 	tree->labels = NULL;
 	tree->merge_left = NULL;
 	tree->merge_right = NULL;
@@ -91,6 +104,7 @@ static Tree * tree_new(Params * params) {
 	tree->log_not_pi = 0.0;
 	tree->logprob_cluster = 0.0;
 	tree->logprob_children = 0.0;
+	tree->sum_children = 0.0;
 	tree->logprob = 0.0;
 
 	return tree;
@@ -105,6 +119,7 @@ Tree * tree_copy(Tree * orig) {
 	tree->is_leaf = orig->is_leaf;
 	tree->params = orig->params;
 	params_ref(tree->params);
+	tree->params_version = orig->params_version;
 
 	tree->suffstats_on = suffstats_copy(orig->suffstats_on);
 	tree->suffstats_off = suffstats_copy(orig->suffstats_off);
@@ -112,6 +127,7 @@ Tree * tree_copy(Tree * orig) {
 	tree->merge_left = labelset_copy(orig->merge_left);
 	tree->merge_right = labelset_copy(orig->merge_right);
 	tree->children = g_list_copy(orig->children);
+	tree->num_children = orig->num_children;
 	for (child = tree->children; child != NULL; child = g_list_next(child)) {
 		tree_ref(child->data);
 	}
@@ -121,6 +137,7 @@ Tree * tree_copy(Tree * orig) {
 	tree->log_not_pi = orig->log_not_pi;
 	tree->logprob_cluster = orig->logprob_cluster;
 	tree->logprob_children = orig->logprob_children;
+	tree->sum_children = orig->sum_children;
 	tree->logprob = orig->logprob;
 
 	tree_assert(tree);
@@ -238,6 +255,11 @@ void tree_set_params(Tree * tree, Params * params, gboolean recurse) {
 		params_ref(tree->params);
 		tree->dirty = TRUE;
 	}
+	if (tree->params_version != params->version) {
+		/* same params, but hyperparameters changed in place */
+		tree->params_version = params->version;
+		tree->dirty = TRUE;
+	}
 
 	if (!recurse || tree_is_leaf(tree)) {
 		return;
@@ -347,9 +369,12 @@ static gdouble leaf_logprob(Tree * leaf) {
 
 void branch_add_child(Tree * branch, Tree * child) {
 	gpointer new_off;
+	gboolean rescore;
 
 	g_assert(!tree_is_leaf(branch));
 	tree_ref(child);
+	/* from scratch, unless only the new child's term is missing */
+	rescore = branch->dirty || branch->num_children < 2;
 
 	if (branch->children != NULL) {
 		/* once there is more than one child, we'd better start adding
@@ -398,6 +423,7 @@ void branch_add_child(Tree * branch, Tree * child) {
 	}
 
 	branch->children = g_list_prepend(branch->children, child);
+	branch->num_children++;
 	suffstats_add(branch->suffstats_on, child->suffstats_on);
 	if (tree_debug) {
 		g_print("branch on: "); suffstats_print(branch->suffstats_on); g_print("\n");
@@ -413,25 +439,44 @@ void branch_add_child(Tree * branch, Tree * child) {
 		labelset_print(branch->merge_right);
 		g_print("\n");
 	}
-	branch->dirty = TRUE;
-	branch->logprob = tree_get_logprob(branch);
+	if (rescore) {
+		branch->dirty = TRUE;
+		branch->logprob = tree_get_logprob(branch);
+	} else {
+		branch->sum_children += tree_get_logprob(child);
+		branch->logprob = branch_logprob_update(branch);
+	}
 	tree_assert(branch);
 }
 
+/* branch with child added. if the caller holds the only reference to
+ * branch, that is changed and handed back rather than copied, so a branch
+ * absorbing child after child is not copied each time; either way, the
+ * caller's reference to branch is then only good for tree_unref.
+ */
+Tree * branch_add_child_copy(Tree * branch, Tree * child) {
+	Tree * tree;
+
+	if (branch->ref_count == 1) {
+		tree_ref(branch);
+		tree = branch;
+	} else {
+		tree = tree_copy(branch);
+	}
+	branch_add_child(tree, child);
+	return tree;
+}
+
 GList * branch_get_children(Tree * branch) {
 	g_assert(!tree_is_leaf(branch));
 	return branch->children;
 }
 
-static gdouble branch_log_not_pi(Tree * branch) {
-	gdouble num_children;
-
-	num_children = g_list_length(branch->children);
-
-	return (num_children-1)*branch->params->loggamma;
+static gdouble branch_log_not_pi(Params * params, guint num_children) {
+	return (num_children-1)*params->loggamma;
 }
 
-static gdouble branch_log_pi(Tree * branch, gdouble log_not_pi) {
+static gdouble branch_log_pi(gdouble log_not_pi) {
 	if (log_not_pi > G_LN2) {
 		return gsl_sf_log(-gsl_sf_expm1(log_not_pi));
 	} else {
@@ -440,11 +485,18 @@ static gdouble branch_log_pi(Tree * branch, gdouble log_not_pi) {
 }
 
 static gdouble branch_logprob(Tree * branch) {
-	GList * child;
+	/* children are prepended: so from the last, in the order added */
+	branch->sum_children = 0.0;
+	for (GList * child = g_list_last(branch->children); child != NULL; child = g_list_previous(child)) {
+		branch->sum_children += tree_get_logprob(child->data);
+	}
+	return branch_logprob_update(branch);
+}
 
+/* the logprob of branch from its counts and sum_children */
+static gdouble branch_logprob_update(Tree * branch) {
 	/* if fewer than two children, do nothing */
-	if (branch->children == NULL || 
-	    g_list_next(branch->children) == NULL) {
+	if (branch->num_children < 2) {
 		branch->log_not_pi = 0.0;
 		branch->log_pi = 0.0;
 		branch->logprob_cluster = 0.0;
@@ -453,15 +505,11 @@ static gdouble branch_logprob(Tree * branch) {
 		return 0.0;
 	}
 
-	branch->log_not_pi = branch_log_not_pi(branch);
-	branch->log_pi = branch_log_pi(branch, branch->log_not_pi);
+	branch->log_not_pi = branch_log_not_pi(branch->params, branch->num_children);
+	branch->log_pi = branch_log_pi(branch->log_not_pi);
 	branch->logprob_cluster = params_logprob_on(branch->params, branch->suffstats_on);
-	branch->logprob_children = params_logprob_off(branch->params, branch->suffstats_off);
-	/* g_print("children 0: %2.2e\n", branch->logprob_children); */
-	for (child = branch->children; child != NULL; child = g_list_next(child)) {
-		branch->logprob_children += tree_get_logprob(child->data);
-		/* g_print("children n: %2.2e\n", branch->logprob_children); */
-	}
+	branch->logprob_children = params_logprob_off(branch->params, branch->suffstats_off)
+		+ branch->sum_children;
 	branch->logprob = log_add_exp(
 			branch->log_pi + branch->logprob_cluster,
 			branch->log_not_pi + branch->logprob_children);
@@ -469,6 +517,229 @@ static gdouble branch_logprob(Tree * branch) {
 	return branch->logprob;
 }
 
+static gdouble branch_logprob_combine(Params * params, guint num_children, gpointer suffstats_on, gdouble logprob_children) {
+	gdouble log_not_pi;
+
+	log_not_pi = branch_log_not_pi(params, num_children);
+	return log_add_exp(
+			branch_log_pi(log_not_pi) + params_logprob_on(params, suffstats_on),
+			log_not_pi + logprob_children);
+}
+
+/* the logprob of branch_new_full(params, aa, bb), without building it.
+ * offblock is the suffstats between aa and bb. the counts of the new branch
+ * are added to suffstats_on, which should start empty.
+ */
+gdouble tree_logprob_join(Tree * aa, Tree * bb, gpointer offblock, gpointer suffstats_on) {
+	gdouble logprob_children;
+
+	suffstats_add(suffstats_on, aa->suffstats_on);
+	suffstats_add(suffstats_on, offblock);
+	suffstats_add(suffstats_on, bb->suffstats_on);
+
+	/* summed as branch_logprob would */
+	logprob_children = params_logprob_off(aa->params, offblock)
+		+ (tree_get_logprob(aa) + tree_get_logprob(bb));
+	return branch_logprob_combine(aa->params, 2, suffstats_on, logprob_children);
+}
+
+/* the logprob of a copy of aa with bb added as a child, without building
+ * it. as for tree_logprob_join.
+ */
+gdouble tree_logprob_absorb(Tree * aa, Tree * bb, gpointer offblock, gpointer suffstats_on) {
+	Counts suffstats_off;
+	gdouble logprob_children;
+
+	g_assert(!tree_is_leaf(aa));
+	suffstats_add(suffstats_on, aa->suffstats_on);
+	suffstats_add(suffstats_on, offblock);
+	suffstats_add(suffstats_on, bb->suffstats_on);
+
+	suffstats_off = *(Counts *)aa->suffstats_off;
+	suffstats_add(&suffstats_off, offblock);
+
+	/* as branch_add_child would: one more term, not one per child */
+	tree_get_logprob(aa);
+	logprob_children = params_logprob_off(aa->params, &suffstats_off)
+		+ (aa->sum_children + tree_get_logprob(bb));
+	return branch_logprob_combine(aa->params, aa->num_children + 1,
+			suffstats_on, logprob_children);
+}
+
+/* the better of joining leaf onto tree and absorbing it as a child */
+static gdouble tree_insert_best(Tree * tree, Tree * leaf, gboolean * absorb) {
+	Counts suffstats_on = { .ref_count = 1, .num_ones = 0, .num_total = 0 };
+	Counts offblock = { .ref_count = 1, .num_ones = 0, .num_total = 0 };
+	gdouble logprob;
+	gdouble logprob_absorb;
+
+	sscache_count_offblock(tree->params->sscache, tree->labels, leaf->labels, &offblock);
+	logprob = tree_logprob_join(tree, leaf, &offblock, &suffstats_on);
+	*absorb = FALSE;
+	if (!tree_is_leaf(tree) && !tree->params->binary_only) {
+		suffstats_on.num_ones = 0;
+		suffstats_on.num_total = 0;
+		logprob_absorb = tree_logprob_absorb(tree, leaf, &offblock, &suffstats_on);
+		if (logprob_absorb > logprob) {
+			logprob = logprob_absorb;
+			*absorb = TRUE;
+		}
+	}
+	return logprob;
+}
+
+/* a copy of branch with old_child swapped for new_child, which is
+ * old_child with one more label. offblock is the suffstats between that
+ * label and the other children of branch.
+ */
+static Tree * branch_replace_child(Tree * branch, Tree * old_child, Tree * new_child, gpointer offblock) {
+	Tree * tree;
+	GList * link;
+
+	tree = tree_copy(branch);
+	link = g_list_find(tree->children, old_child);
+	g_assert(link != NULL);
+	tree_unref(link->data);
+	tree_ref(new_child);
+	link->data = new_child;
+
+	suffstats_sub(tree->suffstats_on, old_child->suffstats_on);
+	suffstats_add(tree->suffstats_on, new_child->suffstats_on);
+	suffstats_add(tree->suffstats_on, offblock);
+	suffstats_add(tree->suffstats_off, offblock);
+
+	/* keep merge_left and merge_right covering labels */
+	if (labelset_contains(tree->merge_left, labelset_any_label(old_child->labels))) {
+		labelset_union(tree->merge_left, new_child->labels);
+	} else {
+		labelset_union(tree->merge_right, new_child->labels);
+	}
+	labelset_union(tree->labels, new_child->labels);
+
+	tree->dirty = TRUE;
+	tree->logprob = tree_get_logprob(tree);
+	tree_assert(tree);
+	return tree;
+}
+
+/* root with a leaf for label added, placed by greedy descent: at each
+ * branch, joining the leaf onto it or absorbing it as a child is weighed
+ * against carrying on into the child whose taking the leaf scores the
+ * branch best. only the branches on the way down are copied and rescored,
+ * and the offblocks are counted from the cells around label (see
+ * sscache_count_offblock), so the cost goes with the depth times the
+ * degree of label and the number of children passed. only the offblock
+ * the leaf is finally added with is cached. root itself is left as it
+ * was.
+ */
+Tree * tree_insert_leaf(Tree * root, gconstpointer label) {
+	Params * params;
+	GPtrArray * path;
+	GPtrArray * path_offblocks;
+	Tree * leaf;
+	Tree * tree;
+	Tree * subtree;
+	gboolean absorb;
+
+	params = root->params;
+	g_assert(!labelset_contains(root->labels, label));
+	leaf = leaf_new(params, label);
+	path = g_ptr_array_new();
+	path_offblocks = g_ptr_array_new_with_free_func(suffstats_unref);
+
+	tree = root;
+	while (TRUE) {
+		gdouble logprob;
+		gdouble logprob_children;
+		Counts offblock = { .ref_count = 1, .num_ones = 0, .num_total = 0 };
+		Counts suffstats_on;
+		Tree * best_child;
+		gdouble best_logprob;
+		gpointer best_offblock_rest;
+
+		logprob = tree_insert_best(tree, leaf, &absorb);
+		if (tree_is_leaf(tree)) {
+			break;
+		}
+
+		/* tree rescored with each child in turn taking the leaf */
+		sscache_count_offblock(params->sscache, tree->labels, leaf->labels, &offblock);
+		suffstats_on = *(Counts *)tree->suffstats_on;
+		suffstats_add(&suffstats_on, &offblock);
+		suffstats_add(&suffstats_on, leaf->suffstats_on);
+		logprob_children = 0.0;
+		for (GList * child = tree->children; child != NULL; child = g_list_next(child)) {
+			logprob_children += tree_get_logprob(child->data);
+		}
+		best_child = NULL;
+		best_logprob = 0.0;
+		best_offblock_rest = NULL;
+		for (GList * child = tree->children; child != NULL; child = g_list_next(child)) {
+			Tree * child_tree = child->data;
+			gboolean child_absorb;
+			gpointer offblock_rest;
+			Counts offblock_child = { .ref_count = 1, .num_ones = 0, .num_total = 0 };
+			Counts suffstats_off;
+			gdouble child_logprob;
+
+			sscache_count_offblock(params->sscache, child_tree->labels, leaf->labels,
+					&offblock_child);
+			offblock_rest = suffstats_copy(&offblock);
+			suffstats_sub(offblock_rest, &offblock_child);
+			suffstats_off = *(Counts *)tree->suffstats_off;
+			suffstats_add(&suffstats_off, offblock_rest);
+			child_logprob = branch_logprob_combine(params, tree->num_children,
+					&suffstats_on,
+					params_logprob_off(params, &suffstats_off)
+					+ logprob_children - tree_get_logprob(child_tree)
+					+ tree_insert_best(child_tree, leaf, &child_absorb));
+			if (best_child == NULL || child_logprob > best_logprob) {
+				if (best_offblock_rest != NULL) {
+					suffstats_unref(best_offblock_rest);
+				}
+				best_child = child_tree;
+				best_logprob = child_logprob;
+				best_offblock_rest = offblock_rest;
+			} else {
+				suffstats_unref(offblock_rest);
+			}
+		}
+
+		if (best_logprob <= logprob) {
+			suffstats_unref(best_offblock_rest);
+			break;
+		}
+		g_ptr_array_add(path, tree);
+		g_ptr_array_add(path_offblocks, best_offblock_rest);
+		tree = best_child;
+	}
+
+	/* cache the offblock between tree and leaf, for branch_add_child */
+	sscache_get_offblock_direct(params->sscache, tree->labels, leaf->labels);
+	if (absorb) {
+		subtree = tree_copy(tree);
+	} else {
+		subtree = branch_new(params);
+		branch_add_child(subtree, tree);
+	}
+	branch_add_child(subtree, leaf);
+	tree_unref(leaf);
+
+	for (guint ii = path->len; ii > 0; ii--) {
+		Tree * parent = g_ptr_array_index(path, ii - 1);
+		Tree * new_parent;
+
+		new_parent = branch_replace_child(parent, tree, subtree,
+				g_ptr_array_index(path_offblocks, ii - 1));
+		tree_unref(subtree);
+		subtree = new_parent;
+		tree = parent;
+	}
+	g_ptr_array_free(path, TRUE);
+	g_ptr_array_free(path_offblocks, TRUE);
+	return subtree;
+}
+
 gdouble tree_get_logprob(Tree *tree) {
 	if (!tree->dirty) {
 		return tree->logprob;
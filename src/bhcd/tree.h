@@ -21,6 +21,7 @@ void tree_unref(Tree * tree);
 void tree_assert(Tree * tree);
 
 void branch_add_child(Tree * branch, Tree * child);
+Tree * branch_add_child_copy(Tree * branch, Tree * child);
 GList * branch_get_children(Tree * branch);
 
 gconstpointer leaf_get_label(Tree * leaf);
@@ -32,6 +33,9 @@ Labelset * tree_get_merge_right(Tree * tree);
 Params * tree_get_params(Tree * tree);
 gpointer tree_get_suffstats(Tree * tree);
 gdouble tree_get_logprob(Tree *tree);
+gdouble tree_logprob_join(Tree * aa, Tree * bb, gpointer offblock, gpointer suffstats_on);
+gdouble tree_logprob_absorb(Tree * aa, Tree * bb, gpointer offblock, gpointer suffstats_on);
+Tree * tree_insert_leaf(Tree * root, gconstpointer label);
 gdouble tree_get_logresponse(Tree *tree);
 gdouble tree_logpredict(Tree *tree, gconstpointer src, gconstpointer dst, gboolean value);
 
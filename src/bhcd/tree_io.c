@@ -1,10 +1,207 @@
+#include <string.h>
 #include "tree_io.h"
+#include "dataset_gml.h"
+#include "sscache.h"
+#include "tokens.h"
 #include "util.h"
 #include "version.h"
 
+/* a root, stem or leaf as read, before the tree is put together */
+typedef struct {
+	gint		parent;
+	/* stems and the root */
+	gint		id;
+	/* leaves */
+	gchar *		label;
+} TreeIONode;
 
-Tree * tree_io_load(const gchar *fname) {
-	return NULL;
+static gchar * tree_io_next_key(Tokens * toks);
+static gdouble tree_io_next_double(Tokens * toks);
+static gint tree_io_next_int(Tokens * toks);
+static Tree * tree_io_build(Params * params, Tokens * toks, GArray * nodes);
+
+
+/* the tree saved in fname, over the data file named in it with the labels
+ * and cells of delta added, if not NULL. the saved hyperparameters are
+ * used, but the counts and logprobs are found afresh from the data, so
+ * edges delta adds between labels already in the tree are accounted for.
+ * labels delta adds are not in the tree: see tree_insert_leaf.
+ */
+Tree * tree_io_load(const gchar *fname, Dataset * delta) {
+	Tokens * toks;
+	GArray * nodes;
+	gchar * data_fname;
+	gdouble hypers[5] = { 0.0, 0.0, 0.0, 0.0, 0.0 };
+	static const gchar * hyper_names[] = { "gamma", "alpha", "beta", "delta", "lambda" };
+	Dataset * dataset;
+	Params * params;
+	Tree * root;
+	gchar * key;
+
+	data_fname = NULL;
+	nodes = g_array_new(FALSE, FALSE, sizeof(TreeIONode));
+	toks = tokens_open(fname);
+	while (tokens_has_next(toks)) {
+		key = tree_io_next_key(toks);
+		if (key == NULL) {
+			continue;
+		}
+		if (strcmp(key, "root") == 0 || strcmp(key, "stem") == 0 || strcmp(key, "leaf") == 0) {
+			TreeIONode node = { .parent = -1, .id = -1, .label = NULL };
+
+			g_array_append_val(nodes, node);
+		} else if (strcmp(key, "file") == 0) {
+			g_free(data_fname);
+			data_fname = strip_quotes(tokens_next_quoted(toks));
+		} else if (strcmp(key, "label") == 0 && nodes->len > 0) {
+			g_array_index(nodes, TreeIONode, nodes->len - 1).label =
+				strip_quotes(tokens_next_quoted(toks));
+		} else if (strcmp(key, "parent") == 0 && nodes->len > 0) {
+			g_array_index(nodes, TreeIONode, nodes->len - 1).parent =
+				tree_io_next_int(toks);
+		} else if ((strcmp(key, "id") == 0 || strcmp(key, "child") == 0) && nodes->len > 0) {
+			g_array_index(nodes, TreeIONode, nodes->len - 1).id =
+				tree_io_next_int(toks);
+		} else if (strcmp(key, "method") == 0) {
+			g_free(tokens_next_quoted(toks));
+		} else if (strcmp(key, "logprob") == 0 || strcmp(key, "logresp") == 0) {
+			tree_io_next_double(toks);
+		} else {
+			for (guint ii = 0; ii < G_N_ELEMENTS(hyper_names); ii++) {
+				if (strcmp(key, hyper_names[ii]) == 0) {
+					hypers[ii] = tree_io_next_double(toks);
+				}
+			}
+		}
+		g_free(key);
+	}
+	if (data_fname == NULL || nodes->len == 0) {
+		tokens_fail(toks, "no data file or no tree");
+	}
+
+	/* the data is read as the delta was */
+	dataset = dataset_gml_load_full(data_fname, delta != NULL && dataset_get_symmetric(delta));
+	if (delta != NULL) {
+		dataset_add(dataset, delta);
+	}
+	params = params_new(dataset, hypers[0], hypers[1], hypers[2], hypers[3], hypers[4]);
+	root = tree_io_build(params, toks, nodes);
+	params_unref(params);
+	dataset_unref(dataset);
+
+	tokens_close(toks);
+	for (guint ii = 0; ii < nodes->len; ii++) {
+		g_free(g_array_index(nodes, TreeIONode, ii).label);
+	}
+	g_array_free(nodes, TRUE);
+	g_free(data_fname);
+	return root;
+}
+
+/* the key of a `"key":' token, less any braces before it, or NULL if the
+ * token is only punctuation.
+ */
+static gchar * tree_io_next_key(Tokens * toks) {
+	gchar * next;
+	gchar * start;
+	gsize len;
+
+	next = tokens_next(toks);
+	start = next;
+	while (*start == '{') {
+		start++;
+	}
+	len = strlen(start);
+	if (len < 3 || start[0] != '"' || start[len-2] != '"' || start[len-1] != ':') {
+		g_free(next);
+		return NULL;
+	}
+	start[len-2] = '\0';
+	start = g_strdup(start + 1);
+	g_free(next);
+	return start;
+}
+
+/* a number, perhaps followed by a comma */
+static gdouble tree_io_next_double(Tokens * toks) {
+	gchar * next;
+	gchar * endp;
+	gdouble value;
+
+	next = tokens_next(toks);
+	value = g_ascii_strtod(next, &endp);
+	if (endp == next || (*endp != '\0' && strcmp(endp, ",") != 0)) {
+		tokens_fail(toks, "expected a number; found `%s'", next);
+	}
+	g_free(next);
+	return value;
+}
+
+static gint tree_io_next_int(Tokens * toks) {
+	gchar * next;
+	gchar * endp;
+	gint64 value;
+
+	next = tokens_next(toks);
+	value = g_ascii_strtoll(next, &endp, 10);
+	if (endp == next || (*endp != '\0' && strcmp(endp, ",") != 0)) {
+		tokens_fail(toks, "expected an integer; found `%s'", next);
+	}
+	g_free(next);
+	return (gint)value;
+}
+
+/* nodes are saved breadth first, so each stem comes before its children:
+ * put the tree together from the last node back. the offblock of each
+ * child with the children added before it is counted directly, as the
+ * sscache has no merges to work it out from.
+ */
+static Tree * tree_io_build(Params * params, Tokens * toks, GArray * nodes) {
+	GHashTable * children;
+	Tree * root;
+
+	/* id of stem -> its children built so far */
+	children = g_hash_table_new(NULL, NULL);
+	root = NULL;
+	for (guint ii = nodes->len; ii > 0; ii--) {
+		TreeIONode * node = &g_array_index(nodes, TreeIONode, ii - 1);
+		Tree * tree;
+		GList * list;
+
+		if (node->label != NULL) {
+			if (!dataset_label_exists(params->dataset, node->label)) {
+				tokens_fail(toks, "unknown label `%s'", node->label);
+			}
+			tree = leaf_new(params, dataset_label_lookup(params->dataset, node->label));
+		} else {
+			tree = branch_new(params);
+			list = g_hash_table_lookup(children, GINT_TO_POINTER(node->id));
+			for (GList * child = list; child != NULL; child = g_list_next(child)) {
+				if (branch_get_children(tree) != NULL) {
+					sscache_get_offblock_direct(params->sscache,
+							tree_get_labels(tree),
+							tree_get_labels(child->data));
+				}
+				branch_add_child(tree, child->data);
+				tree_unref(child->data);
+			}
+			g_list_free(list);
+			g_hash_table_remove(children, GINT_TO_POINTER(node->id));
+		}
+		if (node->parent < 0) {
+			g_assert(root == NULL);
+			root = tree;
+			continue;
+		}
+		list = g_hash_table_lookup(children, GINT_TO_POINTER(node->parent));
+		g_hash_table_replace(children, GINT_TO_POINTER(node->parent),
+				g_list_prepend(list, tree));
+	}
+	if (root == NULL || g_hash_table_size(children) != 0) {
+		tokens_fail(toks, "tree is not connected");
+	}
+	g_hash_table_unref(children);
+	return root;
 }
 
 void tree_io_save(Tree *tree, const gchar *fname) {
@@ -4,7 +4,7 @@
 #include <glib.h>
 #include "tree.h"
 
-Tree * tree_io_load(const gchar *fname);
+Tree * tree_io_load(const gchar *fname, Dataset * delta);
 void tree_io_save(Tree *tree, const gchar *fname);
 void tree_io_save_io(Tree *tree, GIOChannel *io);
 
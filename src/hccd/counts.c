@@ -36,14 +36,12 @@ guint counts_num_ones(Counts * counts) {
 }
 
 void counts_ref(Counts * counts) {
-	counts->ref_count++;
+	g_atomic_int_inc(&counts->ref_count);
 }
 
 void counts_unref(Counts * counts) {
-	if (counts->ref_count <= 1) {
+	if (g_atomic_int_dec_and_test(&counts->ref_count)) {
 		g_slice_free(Counts, counts);
-	} else {
-		counts->ref_count--;
 	}
 }
 
@@ -5,7 +5,8 @@
 
 typedef struct {
 	/* private: */
-	guint		ref_count;
+	/* atomic: merges scored in parallel share counts */
+	gint		ref_count;
 	/* public: */
 	guint		num_ones;
 	guint		num_total;
@@ -0,0 +1,263 @@
+#include <string.h>
+#include "dheap.h"
+
+#define	DHEAP_ARITY		4
+#define	DHEAP_MIN_SIZE		16
+#define	DHEAP_PARENT(index)	(((index)-1)/DHEAP_ARITY)
+#define	DHEAP_CHILD(index)	(DHEAP_ARITY*(index)+1)
+#define	DHEAP_INDEX(heap, elem)	G_STRUCT_MEMBER(guint, elem, (heap)->index_offset)
+
+typedef struct {
+	gdouble key;
+	gdouble tie;
+	gpointer elem;
+} DHeapEntry;
+
+struct DHeap_t {
+	DHeapEntry * entries;
+	guint num_entries;
+	guint max_entries;
+	DHeapFree elem_free;
+	/* if not DHEAP_NOT_INDEXED, each element holds its position here */
+	goffset index_offset;
+};
+
+static void dheap_grow(DHeap * heap);
+static void dheap_sift_up(DHeap * heap, guint index);
+static void dheap_sift_down(DHeap * heap, guint index);
+
+
+DHeap * dheap_new(guint hint_size, DHeapFree elem_free, goffset index_offset) {
+	DHeap * heap;
+
+	heap = g_new(DHeap, 1);
+	heap->max_entries = MAX(hint_size, DHEAP_MIN_SIZE);
+	heap->entries = g_new(DHeapEntry, heap->max_entries);
+	heap->num_entries = 0;
+	heap->elem_free = elem_free;
+	heap->index_offset = index_offset;
+	return heap;
+}
+
+void dheap_free(DHeap * heap) {
+	if (heap->elem_free != NULL) {
+		for (guint ii = 0; ii < heap->num_entries; ii++) {
+			heap->elem_free(heap->entries[ii].elem);
+		}
+	}
+	g_free(heap->entries);
+	g_free(heap);
+}
+
+/* shallow: the copy shares elements with heap, does not free them and is
+ * not indexed.
+ */
+DHeap * dheap_copy(DHeap * orig) {
+	DHeap * heap;
+
+	heap = dheap_new(orig->num_entries, NULL, DHEAP_NOT_INDEXED);
+	memcpy(heap->entries, orig->entries, orig->num_entries*sizeof(DHeapEntry));
+	heap->num_entries = orig->num_entries;
+	return heap;
+}
+
+guint dheap_size(DHeap * heap) {
+	return heap->num_entries;
+}
+
+
+void dheap_iter_init(DHeap * heap, DHeapIter * iter) {
+	iter->heap = heap;
+	iter->index = 0;
+}
+
+gboolean dheap_iter_next(DHeapIter * iter, gpointer * pelem) {
+	if (iter->index >= iter->heap->num_entries) {
+		return FALSE;
+	}
+	*pelem = iter->heap->entries[iter->index].elem;
+	iter->index++;
+	return TRUE;
+}
+
+
+static inline gboolean dheap_less(const DHeapEntry * aa, const DHeapEntry * bb) {
+	/* keys equal iff neither is less */
+	return aa->key < bb->key || (aa->key <= bb->key && aa->tie < bb->tie);
+}
+
+static inline void dheap_set(DHeap * heap, guint index, const DHeapEntry * entry) {
+	heap->entries[index] = *entry;
+	if (heap->index_offset != DHEAP_NOT_INDEXED) {
+		DHEAP_INDEX(heap, entry->elem) = index;
+	}
+}
+
+static void dheap_grow(DHeap * heap) {
+	heap->max_entries *= 2;
+	heap->entries = g_renew(DHeapEntry, heap->entries, heap->max_entries);
+}
+
+void dheap_enq(DHeap * heap, gdouble key, gdouble tie, gpointer elem) {
+	dheap_append(heap, key, tie, elem);
+	dheap_sift_up(heap, heap->num_entries-1);
+}
+
+/* add without restoring the heap order; call dheap_rebuild before dequeuing. */
+void dheap_append(DHeap * heap, gdouble key, gdouble tie, gpointer elem) {
+	DHeapEntry entry = { .key = key, .tie = tie, .elem = elem };
+
+	if (heap->num_entries == heap->max_entries) {
+		dheap_grow(heap);
+	}
+	dheap_set(heap, heap->num_entries, &entry);
+	heap->num_entries++;
+}
+
+gpointer dheap_deq(DHeap * heap) {
+	gpointer root;
+
+	g_assert(heap->num_entries > 0);
+	root = heap->entries[0].elem;
+	heap->num_entries--;
+	if (heap->num_entries > 0) {
+		dheap_set(heap, 0, &heap->entries[heap->num_entries]);
+		dheap_sift_down(heap, 0);
+	}
+	if (heap->index_offset != DHEAP_NOT_INDEXED) {
+		DHEAP_INDEX(heap, root) = DHEAP_NO_INDEX;
+	}
+	return root;
+}
+
+void dheap_rebuild(DHeap * heap) {
+	if (heap->num_entries < 2) {
+		return;
+	}
+	for (guint ii = DHEAP_PARENT(heap->num_entries-1)+1; ii-- > 0; ) {
+		dheap_sift_down(heap, ii);
+	}
+}
+
+/* dheap_rebuild in parts, so that threads can share the work. the subtrees
+ * rooted at first..first+num-1, from dheap_subtree_roots, are disjoint and
+ * may be rebuilt concurrently with dheap_rebuild_subtree. dheap_rebuild_top
+ * then finishes off the nodes above them. the result is the same as that of
+ * dheap_rebuild.
+ */
+guint dheap_subtree_roots(DHeap * heap, guint min_roots, guint * first) {
+	guint num;
+
+	*first = 0;
+	num = 1;
+	while (num < min_roots) {
+		*first += num;
+		num *= DHEAP_ARITY;
+	}
+	if (*first >= heap->num_entries) {
+		return 0;
+	}
+	return MIN(num, heap->num_entries - *first);
+}
+
+void dheap_rebuild_subtree(DHeap * heap, guint root) {
+	/* the subtree's nodes at each depth are contiguous */
+	guint begin[32];
+	guint end[32];
+	guint depth;
+
+	depth = 0;
+	begin[0] = root;
+	end[0] = root + 1;
+	while (begin[depth] < heap->num_entries) {
+		begin[depth+1] = DHEAP_CHILD(begin[depth]);
+		end[depth+1] = DHEAP_CHILD(end[depth]-1) + DHEAP_ARITY;
+		depth++;
+	}
+	while (depth-- > 0) {
+		for (guint ii = MIN(end[depth], heap->num_entries); ii-- > begin[depth]; ) {
+			dheap_sift_down(heap, ii);
+		}
+	}
+}
+
+void dheap_rebuild_top(DHeap * heap, guint first) {
+	for (guint ii = MIN(first, heap->num_entries); ii-- > 0; ) {
+		dheap_sift_down(heap, ii);
+	}
+}
+
+gboolean dheap_contains(DHeap * heap, gpointer elem) {
+	guint index;
+
+	g_assert(heap->index_offset != DHEAP_NOT_INDEXED);
+	index = DHEAP_INDEX(heap, elem);
+	return index < heap->num_entries && heap->entries[index].elem == elem;
+}
+
+void dheap_remove(DHeap * heap, gpointer elem) {
+	guint index;
+
+	g_assert(dheap_contains(heap, elem));
+	index = DHEAP_INDEX(heap, elem);
+	heap->num_entries--;
+	if (index != heap->num_entries) {
+		dheap_set(heap, index, &heap->entries[heap->num_entries]);
+		dheap_sift_up(heap, index);
+		dheap_sift_down(heap, index);
+	}
+	DHEAP_INDEX(heap, elem) = DHEAP_NO_INDEX;
+}
+
+void dheap_update(DHeap * heap, gpointer elem, gdouble key, gdouble tie) {
+	guint index;
+
+	g_assert(dheap_contains(heap, elem));
+	index = DHEAP_INDEX(heap, elem);
+	heap->entries[index].key = key;
+	heap->entries[index].tie = tie;
+	dheap_sift_up(heap, index);
+	dheap_sift_down(heap, index);
+}
+
+
+/* both sifts move a hole rather than swapping, so each step is one write. */
+static void dheap_sift_up(DHeap * heap, guint index) {
+	DHeapEntry entry = heap->entries[index];
+	guint parent;
+
+	while (index > 0) {
+		parent = DHEAP_PARENT(index);
+		if (!dheap_less(&entry, &heap->entries[parent])) {
+			break;
+		}
+		dheap_set(heap, index, &heap->entries[parent]);
+		index = parent;
+	}
+	dheap_set(heap, index, &entry);
+}
+
+static void dheap_sift_down(DHeap * heap, guint index) {
+	DHeapEntry entry = heap->entries[index];
+	guint first, last, best;
+
+	while (1) {
+		first = DHEAP_CHILD(index);
+		if (first >= heap->num_entries) {
+			break;
+		}
+		last = MIN(first + DHEAP_ARITY, heap->num_entries);
+		best = first;
+		for (guint cc = first+1; cc < last; cc++) {
+			if (dheap_less(&heap->entries[cc], &heap->entries[best])) {
+				best = cc;
+			}
+		}
+		if (!dheap_less(&heap->entries[best], &entry)) {
+			break;
+		}
+		dheap_set(heap, index, &heap->entries[best]);
+		index = best;
+	}
+	dheap_set(heap, index, &entry);
+}
@@ -0,0 +1,45 @@
+#ifndef	DHEAP_H
+#define	DHEAP_H
+
+#include <glib.h>
+
+/* 4-ary min-heap ordered by (key, tie), stored inline next to each element,
+ * so comparisons never dereference elements.
+ */
+struct DHeap_t;
+typedef struct DHeap_t DHeap;
+typedef struct DHeapIter_t {
+	/* private: */
+	DHeap *		heap;
+	guint		index;
+} DHeapIter;
+
+typedef void (*DHeapFree)(gpointer);
+
+/* pass as index_offset if elements do not hold their heap position */
+#define	DHEAP_NOT_INDEXED	(-1)
+/* index of an element not in an indexed heap */
+#define	DHEAP_NO_INDEX		G_MAXUINT
+
+DHeap * dheap_new(guint hint_size, DHeapFree elem_free, goffset index_offset);
+void dheap_free(DHeap *);
+DHeap * dheap_copy(DHeap *);
+
+guint dheap_size(DHeap *);
+
+void dheap_iter_init(DHeap *, DHeapIter *);
+gboolean dheap_iter_next(DHeapIter *, gpointer *);
+
+void dheap_enq(DHeap *, gdouble key, gdouble tie, gpointer elem);
+void dheap_append(DHeap *, gdouble key, gdouble tie, gpointer elem);
+gpointer dheap_deq(DHeap *);
+void dheap_rebuild(DHeap *);
+guint dheap_subtree_roots(DHeap *, guint min_roots, guint * first);
+void dheap_rebuild_subtree(DHeap *, guint root);
+void dheap_rebuild_top(DHeap *, guint first);
+
+gboolean dheap_contains(DHeap *, gpointer elem);
+void dheap_remove(DHeap *, gpointer elem);
+void dheap_update(DHeap *, gpointer elem, gdouble key, gdouble tie);
+
+#endif /*DHEAP_H*/
@@ -2,61 +2,268 @@
 #include <math.h>
 #include "lnbetacache.h"
 
+/* below this many entries, it is not worth waking up threads to fill the
+ * tables.
+ */
+#define	LNBETACACHE_PARALLEL_MIN	(1 << 16)
+#define	LNBETACACHE_CHUNK_SIZE		(1 << 14)
+/* marks a table entry that has not been computed yet (lazy mode) */
+#define	LNBETACACHE_EMPTY		INFINITY
+/* 0.5*log(2*pi) */
+#define	LNBETA_HALF_LN_2PI		0.91893853320467274178
 
+/*
+ * lnbeta(alpha + n1, beta + n0) = lngamma(alpha + n1)
+ * 				 + lngamma(beta + n0)
+ * 				 - lngamma(alpha + beta + n1 + n0)
+ *
+ * so we keep three 1-d tables, rather than a max_num*max_num table.
+ *
+ * the tables are filled in full at construction. once the hyperparameters
+ * are changed with lnbetacache_set_hypers, the cache turns lazy: entries are
+ * only computed when first looked up, and only those are cleared on the next
+ * change. hyperparameter sampling then costs O(#counts in use) per update.
+ *
+ * lookups write nothing to the cache unless it is lazy, so a filled cache
+ * may be read from several threads at once, counting hits or not.
+ */
 struct LnBetaCache_t {
+	guint ref_count;
 	guint max_num;
-	guint size;
-	guint hits;
+	gboolean count_hits;
+	/* atomic: bumped by every thread scoring from the cache */
+	gint hits;
+	gboolean lazy;
+	/* offsets of entries computed since the last change (lazy mode) */
+	GArray * touched;
 	gdouble	alpha;
 	gdouble beta;
-	gdouble * evals;
+	/* lngamma(alpha + n), 0 <= n < max_num */
+	gdouble * lngamma_alpha;
+	/* lngamma(beta + n), 0 <= n < max_num */
+	gdouble * lngamma_beta;
+	/* lngamma(alpha + beta + n), 0 <= n < 2*max_num-1 */
+	gdouble * lngamma_alpha_beta;
 };
 
+typedef struct {
+	guint begin;
+	guint end;
+} LnBetaCacheChunk;
+
+static void lnbetacache_fill(LnBetaCache * cache);
+static void lnbetacache_fill_chunk(LnBetaCacheChunk * chunk, LnBetaCache * cache);
+static gboolean lnbetacache_lazy_fill(LnBetaCache * cache, guint num_ones, guint num_zeros);
+static inline gboolean lnbetacache_lazy_entry(LnBetaCache * cache, gdouble * table, guint index, gdouble xx);
+
 
 LnBetaCache * lnbetacache_new(gdouble alpha, gdouble beta, guint max_num) {
 	LnBetaCache * cache;
 
+	g_assert(max_num > 0);
 	cache = g_new(LnBetaCache, 1);
+	cache->ref_count = 1;
+	cache->count_hits = FALSE;
 	cache->hits = 0;
+	cache->lazy = FALSE;
+	cache->touched = g_array_new(FALSE, FALSE, sizeof(guint));
 	cache->alpha = alpha;
 	cache->beta = beta;
 	cache->max_num = max_num;
-	cache->size = max_num*max_num;
-	cache->evals = g_new(gdouble, cache->size);
-
-	for (guint ii = 0; ii < cache->size; ii++) {
-		cache->evals[ii] = INFINITY;
-	}
+	/* one allocation for all three tables */
+	cache->lngamma_alpha = g_new(gdouble, 4*max_num);
+	cache->lngamma_beta = cache->lngamma_alpha + max_num;
+	cache->lngamma_alpha_beta = cache->lngamma_beta + max_num;
+	lnbetacache_fill(cache);
 	return cache;
 }
 
+void lnbetacache_ref(LnBetaCache * cache) {
+	cache->ref_count++;
+}
+
+/* drops a reference: the tables are freed with the last one. */
 void lnbeta_cache_free(LnBetaCache * cache) {
-	g_free(cache->evals);
+	if (cache->ref_count > 1) {
+		cache->ref_count--;
+		return;
+	}
+	g_array_free(cache->touched, TRUE);
+	g_free(cache->lngamma_alpha);
 	g_free(cache);
 }
 
+static void lnbetacache_fill_chunk(LnBetaCacheChunk * chunk, LnBetaCache * cache) {
+	for (guint ii = chunk->begin; ii < chunk->end; ii++) {
+		if (ii < cache->max_num) {
+			cache->lngamma_alpha[ii] = gsl_sf_lngamma(cache->alpha + ii);
+			cache->lngamma_beta[ii] = gsl_sf_lngamma(cache->beta + ii);
+		}
+		cache->lngamma_alpha_beta[ii] = gsl_sf_lngamma(cache->alpha + cache->beta + ii);
+	}
+}
 
-gdouble lnbetacache_get(LnBetaCache * cache, guint num_ones, guint num_zeros) {
-	gdouble val;
+static void lnbetacache_fill(LnBetaCache * cache) {
+	GThreadPool * pool;
+	GError * error;
+	LnBetaCacheChunk * chunks;
+	guint num_entries;
+	guint num_chunks;
+
+	num_entries = 2*cache->max_num - 1;
+	if (num_entries < LNBETACACHE_PARALLEL_MIN) {
+		LnBetaCacheChunk all = { .begin = 0, .end = num_entries };
+		lnbetacache_fill_chunk(&all, cache);
+		return;
+	}
+
+	num_chunks = (num_entries + LNBETACACHE_CHUNK_SIZE - 1)/LNBETACACHE_CHUNK_SIZE;
+	chunks = g_new(LnBetaCacheChunk, num_chunks);
+	error = NULL;
+	pool = g_thread_pool_new((GFunc)lnbetacache_fill_chunk, cache,
+			(gint)g_get_num_processors(), TRUE, &error);
+	if (error != NULL) {
+		g_error("g_thread_pool_new: %s", error->message);
+	}
+	for (guint ii = 0; ii < num_chunks; ii++) {
+		chunks[ii].begin = ii*LNBETACACHE_CHUNK_SIZE;
+		chunks[ii].end = MIN(num_entries, (ii+1)*LNBETACACHE_CHUNK_SIZE);
+		g_thread_pool_push(pool, &chunks[ii], &error);
+		if (error != NULL) {
+			g_error("g_thread_pool_push: %s", error->message);
+		}
+	}
+	/* wait for all chunks to be filled */
+	g_thread_pool_free(pool, FALSE, TRUE);
+	g_free(chunks);
+}
+
+
+void lnbetacache_set_hypers(LnBetaCache * cache, gdouble alpha, gdouble beta) {
+	gdouble * entries = cache->lngamma_alpha;
+
+	if (!cache->lazy) {
+		/* everything was filled at construction */
+		for (guint ii = 0; ii < 4*cache->max_num - 1; ii++) {
+			entries[ii] = LNBETACACHE_EMPTY;
+		}
+		cache->lazy = TRUE;
+	} else {
+		for (guint ii = 0; ii < cache->touched->len; ii++) {
+			entries[g_array_index(cache->touched, guint, ii)] = LNBETACACHE_EMPTY;
+		}
+	}
+	g_array_set_size(cache->touched, 0);
+	cache->alpha = alpha;
+	cache->beta = beta;
+}
+
+static inline gboolean lnbetacache_lazy_entry(LnBetaCache * cache, gdouble * table, guint index, gdouble xx) {
 	guint offset;
 
+	if (isfinite(table[index])) {
+		return TRUE;
+	}
+	table[index] = gsl_sf_lngamma(xx);
+	offset = (guint)(table - cache->lngamma_alpha) + index;
+	g_array_append_val(cache->touched, offset);
+	return FALSE;
+}
+
+static gboolean lnbetacache_lazy_fill(LnBetaCache * cache, guint num_ones, guint num_zeros) {
+	gboolean hit;
+
+	hit = lnbetacache_lazy_entry(cache, cache->lngamma_alpha, num_ones, cache->alpha + num_ones);
+	hit &= lnbetacache_lazy_entry(cache, cache->lngamma_beta, num_zeros, cache->beta + num_zeros);
+	hit &= lnbetacache_lazy_entry(cache, cache->lngamma_alpha_beta, num_ones + num_zeros,
+			cache->alpha + cache->beta + num_ones + num_zeros);
+	return hit;
+}
+
+
+/*
+ * stirling series for lngamma(z) - [(z - 1/2) log(z) - z + log(2pi)/2]:
+ *
+ *   1/(12z) - 1/(360z^3) + 1/(1260z^5) - 1/(1680z^7) + R,
+ *
+ * where, for real z > 0, the remainder R has the sign of, and is smaller in
+ * magnitude than, the first omitted term 1/(1188z^9). for z >= LNBETA_ASYMP_MIN
+ * this gives |R| < 1.3e-14.
+ */
+static inline gdouble lngamma_correction(gdouble zz) {
+	gdouble rz = 1.0/zz;
+	gdouble rz2 = rz*rz;
+
+	return rz*(1.0/12.0 - rz2*(1.0/360.0 - rz2*(1.0/1260.0 - rz2*(1.0/1680.0))));
+}
+
+/* lnbeta(xx, yy) for xx, yy >= LNBETA_ASYMP_MIN.
+ *
+ * the (z - 1/2) log(z) - z terms of the three lngammas are combined with
+ * log1p, so nothing of size O(z log z) cancels. the absolute error from
+ * truncation is < 4e-14.
+ */
+static inline gdouble lnbeta_asymp_both(gdouble xx, gdouble yy) {
+	return LNBETA_HALF_LN_2PI - 0.5*log(yy)
+		- (xx - 0.5)*log1p(yy/xx)
+		- yy*log1p(xx/yy)
+		+ lngamma_correction(xx)
+		+ lngamma_correction(yy)
+		- lngamma_correction(xx + yy);
+}
+
+/* lngamma(yy) - lngamma(xx + yy) for yy >= LNBETA_ASYMP_MIN and xx > 0. */
+static inline gdouble lngamma_ratio_asymp(gdouble xx, gdouble yy) {
+	return xx - xx*log(yy)
+		- (xx + yy - 0.5)*log1p(xx/yy)
+		+ lngamma_correction(yy)
+		- lngamma_correction(xx + yy);
+}
+
+gdouble lnbeta_asymp(gdouble xx, gdouble yy) {
+	if (xx >= LNBETA_ASYMP_MIN && yy >= LNBETA_ASYMP_MIN) {
+		return lnbeta_asymp_both(xx, yy);
+	} else if (yy >= LNBETA_ASYMP_MIN) {
+		return gsl_sf_lngamma(xx) + lngamma_ratio_asymp(xx, yy);
+	} else if (xx >= LNBETA_ASYMP_MIN) {
+		return gsl_sf_lngamma(yy) + lngamma_ratio_asymp(yy, xx);
+	}
+	return gsl_sf_lnbeta(xx, yy);
+}
+
+/* branch free, so the loop vectorizes. every xx[ii], yy[ii] must be
+ * >= LNBETA_ASYMP_MIN.
+ */
+void lnbeta_asymp_array(const gdouble * restrict xx, const gdouble * restrict yy,
+		gdouble * restrict out, guint num) {
+	for (guint ii = 0; ii < num; ii++) {
+		out[ii] = lnbeta_asymp_both(xx[ii], yy[ii]);
+	}
+}
+
+gdouble lnbetacache_get(LnBetaCache * cache, guint num_ones, guint num_zeros) {
 	if (num_ones >= cache->max_num || num_zeros >= cache->max_num) {
-		return gsl_sf_lnbeta(cache->alpha + num_ones, cache->beta + num_zeros);
+		return lnbeta_asymp(cache->alpha + num_ones, cache->beta + num_zeros);
 	}
 
-	offset = num_zeros + cache->max_num*num_ones;
-	g_assert(offset < cache->size);
-	val = cache->evals[offset];
-	if (!isfinite(val)) {
-		val = gsl_sf_lnbeta(cache->alpha + num_ones, cache->beta + num_zeros);
-		cache->evals[offset] = val;
-	} else {
-		cache->hits++;
+	if (cache->lazy) {
+		if (lnbetacache_lazy_fill(cache, num_ones, num_zeros) && cache->count_hits) {
+			g_atomic_int_inc(&cache->hits);
+		}
+	} else if (cache->count_hits) {
+		g_atomic_int_inc(&cache->hits);
 	}
-	return val;
+	return cache->lngamma_alpha[num_ones]
+		+ cache->lngamma_beta[num_zeros]
+		- cache->lngamma_alpha_beta[num_ones + num_zeros];
+}
+
+/* off by default: the shared counter would be written on every lookup. */
+void lnbetacache_set_count_hits(LnBetaCache * cache, gboolean value) {
+	cache->count_hits = value;
 }
 
 guint lnbetacache_get_num_hits(LnBetaCache * cache) {
-	return cache->hits;
+	return (guint)g_atomic_int_get(&cache->hits);
 }
 
@@ -6,9 +6,19 @@
 struct LnBetaCache_t;
 typedef struct LnBetaCache_t LnBetaCache;
 
+/* above this, lnbeta_asymp uses the stirling series rather than gsl. */
+#define	LNBETA_ASYMP_MIN	16.0
+
 LnBetaCache * lnbetacache_new(gdouble alpha, gdouble beta, guint max_num);
+void lnbetacache_set_hypers(LnBetaCache * cache, gdouble alpha, gdouble beta);
 gdouble lnbetacache_get(LnBetaCache * cache, guint num_ones, guint num_zeros);
+void lnbetacache_set_count_hits(LnBetaCache * cache, gboolean value);
 guint lnbetacache_get_num_hits(LnBetaCache * cache);
+void lnbetacache_ref(LnBetaCache * cache);
 void lnbeta_cache_free(LnBetaCache * cache);
 
+gdouble lnbeta_asymp(gdouble xx, gdouble yy);
+void lnbeta_asymp_array(const gdouble * restrict xx, const gdouble * restrict yy,
+		gdouble * restrict out, guint num);
+
 #endif /*LNBETACACHE_H*/
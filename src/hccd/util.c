@@ -148,6 +148,27 @@ void io_readfile(const gchar *fname, IOFunc func, gpointer user_data) {
 }
 
 
+/* the resident set size of this process in bytes, from /proc; 0 where
+ * that is not to be had.
+ */
+gsize mem_resident(void) {
+	gchar * status;
+	gchar * line;
+	gsize rss;
+
+	if (!g_file_get_contents("/proc/self/status", &status, NULL, NULL)) {
+		return 0;
+	}
+	rss = 0;
+	line = strstr(status, "VmRSS:");
+	if (line != NULL) {
+		/* in kB */
+		rss = 1024*(gsize)g_ascii_strtoull(line + strlen("VmRSS:"), NULL, 10);
+	}
+	g_free(status);
+	return rss;
+}
+
 gchar * strip_quotes(gchar *str) {
 	guint len;
 
@@ -75,6 +75,7 @@ gboolean list_equal(GList *aa, GList *bb, GEqualFunc equal);
 guint list_hash(GList * list, GHashFunc hash_func);
 
 gchar * strip_quotes(gchar *str);
+gsize mem_resident(void);
 
 static inline guint32 pop_count(guint64 xx) {
 	/* simple divide and conquer (hd) */